@@ -0,0 +1,53 @@
+audio_mic_id = nil
+audio_out_id = nil
+
+function io_update_cb(identifier, entry)
+    if audio_mic_id == nil and entry.type == "microphone" and entry.default then
+        audio_mic_id = identifier
+    end
+    if audio_out_id == nil and entry.type == "output" and entry.default then
+        audio_out_id = identifier
+    end
+end
+
+function playback_stats(stats)
+    if stats.latency ~= nil then
+        statusline = "Monitoring, latency: " .. string.format("%.1f", stats.latency) ..
+                     " ms, underruns: " .. stats.underruns
+        tx.set_status(statusline)
+    end
+end
+
+-- Setup
+event = tx.register_io_cb(io_update_cb)
+event.destroy()
+
+tx.set_epoch(0)
+
+source_mic = tx.create_io(audio_mic_id, {
+        buffer_ms = 10,
+    })
+
+filter_a = tx.create_filter({
+        filter = "highpass",
+        options = { f = 100 },
+    })
+filter_a.link(source_mic)
+
+--[[ Plays the filtered microphone back on the default output, keeping
+     around 30 ms queued in the server ]]--
+sink_out = tx.create_io(audio_out_id, {
+        mode = "playback",
+        latency_ms = 30,
+    })
+sink_out.link(filter_a)
+sink_out.schedule("stats", playback_stats)
+
+tx.commit()
+
+function main(...)
+    while (true)
+    do
+        coroutine.yield()
+    end
+end
@@ -19,6 +19,7 @@ tx.set_epoch(0)
 
 source_mic = tx.create_io(audio_mic_id, {
         buffer_ms = 8,
+        sample_fmt = "flt", --[[ What libopus takes, converted while capturing ]]--
     })
 
 encoder_a = tx.create_encoder({
@@ -19,7 +19,13 @@ function main(...)
     event = tx.register_io_cb(io_update_cb)
     event.destroy()
 
-    tx.set_epoch(0)
+    source_audio = tx.create_io(audio_monitor_id, {
+            buffer_ms = 60,
+        })
+
+    -- Timestamps follow the audio device's clock, so video stays in sync
+    -- with it over long recordings. Set before anything is linked.
+    tx.set_epoch(source_audio)
 
     --[[ VIDEO ]] --
     source_video = tx.create_io(video_display_id, {
@@ -45,10 +51,6 @@ function main(...)
     encoder_v.link(filter_vid)
 
     --[[ AUDIO ]]--
-    source_audio = tx.create_io(audio_monitor_id, {
-            buffer_ms = 60,
-        })
-
     filter_mic = tx.create_filter({
             filter = "loudnorm",
             options = {
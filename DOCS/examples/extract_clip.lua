@@ -0,0 +1,33 @@
+function muxer_eos(event)
+    muxer_a.destroy()
+    tx.quit()
+end
+
+function main(...)
+    tx.set_epoch(0)
+
+    -- Only the 30 seconds after the 10 minute mark get read and decoded
+    source_f = tx.create_demuxer({
+            in_url = "recording.opus",
+            priv_options = { start_time = 600, end_time = 630 },
+        })
+
+    dec_f = tx.create_decoder({
+            decoder = "opus",
+        })
+    dec_f.link(source_f);
+
+    encoder_a = tx.create_encoder({
+            encoder = "libopus",
+            options = { b = 10^3 --[[ Kbps ]] * 128 },
+        })
+    encoder_a.link(dec_f)
+
+    muxer_a = tx.create_muxer({
+            out_url = "clip.opus",
+        })
+    muxer_a.link(encoder_a)
+    muxer_a.schedule("eos", muxer_eos)
+
+    tx.commit()
+end
@@ -0,0 +1,33 @@
+function muxer_stats(stats)
+    statusline = "Remuxing, bitrate: " .. math.floor(stats.bitrate / 1000) .. " Kbps"
+    tx.set_status(statusline)
+end
+
+function muxer_eos(event)
+    muxer.destroy()
+    tx.quit()
+end
+
+function main(...)
+    tx.set_epoch(0)
+
+    source_f = tx.create_demuxer({
+            in_url = "input.mp4",
+        })
+
+    muxer = tx.create_muxer({
+            out_url = "output.ts",
+            priv_options = {
+                video_bsf = "h264_mp4toannexb",
+                fifo_flags = "block_no_input,block_max_output",
+            },
+        })
+
+    -- No decoding or encoding, packets are copied straight to the muxer
+    muxer.link(source_f, "video=0")
+    muxer.link(source_f, "audio=0")
+    muxer.schedule("stats", muxer_stats)
+    muxer.schedule("eos", muxer_eos)
+
+    tx.commit()
+end
@@ -0,0 +1,57 @@
+video_display_id = nil
+
+function io_update_cb(identifier, entry)
+    if video_display_id == nil and entry.type == "display" and entry.default then
+        video_display_id = identifier
+    end
+end
+
+function replay_stats(stats)
+    statusline = "Replay buffer: " .. math.floor(stats.replay_duration / 10^6) ..
+                 " s, " .. math.floor(stats.replay_bytes / 2^20) .. " MiB"
+    tx.set_status(statusline)
+end
+
+--[[ Call from the prompt to write the last 30 seconds to disk ]]--
+function save_replay()
+    replay.ctrl("command", { command = "save" })
+    tx.commit()
+end
+
+function main(...)
+    event = tx.register_io_cb(io_update_cb)
+    event.destroy()
+
+    tx.set_epoch(0)
+
+    source_video = tx.create_io(video_display_id, {
+            capture_mode = "screencopy",
+        })
+
+    filter_vid = tx.create_filtergraph({
+            graph = "format=nv12",
+        })
+    filter_vid.link(source_video)
+
+    encoder_v = tx.create_encoder({
+            encoder = "libx264",
+            options = {
+                b = 10^3 * 6000,
+                preset = "veryfast",
+                g = 120,
+            }
+        })
+    encoder_v.link(filter_vid)
+
+    --[[ Nothing gets written until save_replay() is called, the output
+         URL is a strftime template for the saved files ]]--
+    replay = tx.create_muxer({
+            out_url = "replay-%Y%m%d-%H%M%S.mkv",
+            replay_duration = 30,
+            replay_max_bytes = 256 * 2^20,
+        })
+    replay.link(encoder_v)
+    replay.schedule("stats", replay_stats)
+
+    tx.commit()
+end
@@ -0,0 +1,45 @@
+video_display_id = nil
+
+function io_update_cb(identifier, entry)
+    if video_display_id == nil and entry.type == "display" and entry.default then
+        video_display_id = identifier
+    end
+end
+
+function main(...)
+    event = tx.register_io_cb(io_update_cb)
+    event.destroy()
+
+    tx.set_epoch(0)
+
+    source_video = tx.create_io(video_display_id, {
+            capture_mode = "screencopy",
+        })
+
+    filter_vid = tx.create_filtergraph({
+            graph = "format=nv12",
+        })
+    filter_vid.link(source_video)
+
+    --[[ Keyframes every 10 seconds, so segments get cut right on time ]]--
+    encoder_v = tx.create_encoder({
+            encoder = "libx264",
+            options = {
+                b = 10^3 * 6000,
+                preset = "veryfast",
+            },
+            priv_options = { keyframe_interval = 10 },
+        })
+    encoder_v.link(filter_vid)
+
+    --[[ Produces rec-000.mp4, rec-001.mp4, ... as fragmented MP4 files,
+         each segment gets renamed from .part once complete ]]--
+    muxer = tx.create_muxer({
+            out_url = "rec-%03d.mp4",
+            segment_duration = 10,
+            segment_list = "rec.m3u8",
+        })
+    muxer.link(encoder_v)
+
+    tx.commit()
+end
@@ -0,0 +1,51 @@
+video_display_id = nil
+
+function io_update_cb(identifier, entry)
+    if video_display_id == nil and entry.type == "display" and entry.default then
+        video_display_id = identifier
+    end
+end
+
+--[[ Streams MPEG-TS into a named pipe. Run "mkfifo /tmp/tx.ts", then
+     "mpv /tmp/tx.ts" and restart the player at will: the muxer keeps
+     running, and resumes on the newest keyframe once the pipe is reopened ]]--
+function main(...)
+    event = tx.register_io_cb(io_update_cb)
+    event.destroy()
+
+    tx.set_epoch(0)
+
+    source_video = tx.create_io(video_display_id, {
+            capture_mode = "screencopy",
+        })
+
+    filter_vid = tx.create_filtergraph({
+            graph = "format=nv12",
+        })
+    filter_vid.link(source_video)
+
+    encoder_v = tx.create_encoder({
+            encoder = "libx264",
+            options = {
+                b = 10^3 * 4000,
+                preset = "veryfast",
+                tune = "zerolatency",
+            },
+            priv_options = { keyframe_interval = 2 },
+        })
+    encoder_v.link(filter_vid)
+
+    muxer = tx.create_muxer({
+            out_url = "/tmp/tx.ts",
+            out_format = "mpegts",
+            priv_options = {
+                low_latency = true,
+                reconnect = true,
+                reconnect_delay_max = 5,
+                reconnect_queue_duration = 4,
+            },
+        })
+    muxer.link(encoder_v)
+
+    tx.commit()
+end
@@ -0,0 +1,53 @@
+video_display_id = nil
+
+function io_update_cb(identifier, entry)
+    if video_display_id == nil and entry.type == "display" and entry.default then
+        video_display_id = identifier
+    end
+end
+
+function encoder_stats_cb(stats)
+    if stats.dropped_duplicates ~= nil then
+        print("Dropped " .. stats.dropped_duplicates .. " duplicate frames")
+    end
+end
+
+function main(...)
+    event = tx.register_io_cb(io_update_cb)
+    event.destroy()
+
+    tx.set_epoch(0)
+
+    source_video = tx.create_io(video_display_id, {
+            capture_mode = "screencopy",
+            damage = "none",
+        })
+
+    filter_vid = tx.create_filtergraph({
+            graph = "format=nv12",
+        })
+    filter_vid.link(source_video)
+
+    --[[ Frames identical to the previous one never reach the encoder,
+         but one gets through at least every 2 seconds ]]--
+    encoder_v = tx.create_encoder({
+            encoder = "libx264",
+            options = {
+                b = 10^3 * 6000,
+                preset = "veryfast",
+            },
+            priv_options = {
+                dedup = "drop",
+                dedup_max_gap = 2,
+            },
+        })
+    encoder_v.link(filter_vid)
+    encoder_v.schedule("stats", encoder_stats_cb)
+
+    muxer = tx.create_muxer({
+            out_url = "rec.mkv",
+        })
+    muxer.link(encoder_v)
+
+    tx.commit()
+end
@@ -0,0 +1,718 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+
+#include <libtxproto/log.h>
+
+#include "avio_async.h"
+#include "os_compat.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define AVIO_BUF_SIZE    (1 << 16)
+#define READAHEAD_CHUNK  (1 << 20)
+#define WRITER_MAX_SEGS  4096
+#define WRITER_MAX_BATCH 32
+#define WRITER_MAX_SEG_LEN (1 << 24)
+
+/* The write callback's buffer became const with lavf 61 */
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+#define AVIO_WRITE_BUF const uint8_t
+#else
+#define AVIO_WRITE_BUF uint8_t
+#endif
+
+struct SPAVIOReadahead {
+    void *log_ctx;
+    int fd;
+    int64_t file_size;
+
+    uint8_t *ring;
+    int64_t ring_size;
+    int64_t keep; /* Already read bytes kept around for short backward seeks */
+
+    AVIOContext *pb;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Absolute file offsets, [valid_start, wr_pos) is in the ring */
+    int64_t valid_start;
+    int64_t rd_pos;
+    int64_t wr_pos;
+    unsigned int gen; /* Incremented on every seek outside the buffer */
+    int eof;
+    int err;
+    int quit;
+
+    /* Stats */
+    int64_t bytes_read;
+    int64_t read_time;
+    int64_t stall_time;
+};
+
+static void *readahead_thread(void *arg)
+{
+    SPAVIOReadahead *ra = arg;
+
+    sp_set_thread_name_self("readahead");
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->quit) {
+        int64_t lo = FFMAX(ra->valid_start, ra->rd_pos - ra->keep);
+        int64_t space = ra->ring_size - (ra->wr_pos - lo);
+        if (ra->eof || ra->err || space <= 0) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+
+        int64_t off = ra->wr_pos % ra->ring_size;
+        int64_t len = FFMIN(FFMIN(space, ra->ring_size - off), READAHEAD_CHUNK);
+        int64_t pos = ra->wr_pos;
+        unsigned int gen = ra->gen;
+
+        /* Anything before lo may get overwritten from now on */
+        ra->valid_start = lo;
+        pthread_mutex_unlock(&ra->lock);
+
+        int64_t t_start = av_gettime_relative();
+        ssize_t ret = pread(ra->fd, ra->ring + off, len, pos);
+        int64_t t_delta = av_gettime_relative() - t_start;
+
+        pthread_mutex_lock(&ra->lock);
+
+        /* Seeked while reading, data is stale */
+        if (gen != ra->gen)
+            continue;
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            ra->err = AVERROR(errno);
+            sp_log(ra->log_ctx, SP_LOG_ERROR, "Error reading: %s!\n",
+                   av_err2str(ra->err));
+        } else if (!ret) {
+            ra->eof = 1;
+        } else {
+            ra->wr_pos += ret;
+            ra->bytes_read += ret;
+            ra->read_time += t_delta;
+        }
+
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+static int readahead_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    SPAVIOReadahead *ra = opaque;
+
+    pthread_mutex_lock(&ra->lock);
+
+    if (ra->rd_pos == ra->wr_pos && !ra->eof && !ra->err) {
+        int64_t t_start = av_gettime_relative();
+        while (ra->rd_pos == ra->wr_pos && !ra->eof && !ra->err)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        ra->stall_time += av_gettime_relative() - t_start;
+    }
+
+    if (ra->rd_pos == ra->wr_pos) {
+        int err = ra->err ? ra->err : AVERROR_EOF;
+        pthread_mutex_unlock(&ra->lock);
+        return err;
+    }
+
+    int len = FFMIN(buf_size, ra->wr_pos - ra->rd_pos);
+    int64_t off = ra->rd_pos % ra->ring_size;
+    int first = FFMIN(len, ra->ring_size - off);
+
+    memcpy(buf, ra->ring + off, first);
+    if (len > first)
+        memcpy(buf + first, ra->ring, len - first);
+
+    ra->rd_pos += len;
+
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    return len;
+}
+
+static int64_t readahead_seek(void *opaque, int64_t offset, int whence)
+{
+    int64_t pos;
+    SPAVIOReadahead *ra = opaque;
+
+    if (whence & AVSEEK_SIZE)
+        return ra->file_size;
+
+    pthread_mutex_lock(&ra->lock);
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: pos = offset;                 break;
+    case SEEK_CUR: pos = ra->rd_pos + offset;    break;
+    case SEEK_END: pos = ra->file_size + offset; break;
+    default:
+        pthread_mutex_unlock(&ra->lock);
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0) {
+        pthread_mutex_unlock(&ra->lock);
+        return AVERROR(EINVAL);
+    }
+
+    if (pos >= ra->valid_start && pos <= ra->wr_pos) {
+        ra->rd_pos = pos;
+    } else {
+        ra->gen++;
+        ra->valid_start = ra->rd_pos = ra->wr_pos = pos;
+        ra->eof = 0;
+        ra->err = 0;
+    }
+
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    return pos;
+}
+
+int sp_avio_readahead_open(SPAVIOReadahead **ra, AVIOContext **pb, void *log_ctx,
+                           const char *path, size_t buf_size)
+{
+    int err;
+    struct stat st;
+
+    if (!strncmp(path, "file:", strlen("file:")))
+        path += strlen("file:");
+
+    if (stat(path, &st) || !S_ISREG(st.st_mode))
+        return AVERROR(ENOTSUP);
+
+    SPAVIOReadahead *ctx = av_mallocz(sizeof(*ctx));
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    ctx->log_ctx = log_ctx;
+    ctx->file_size = st.st_size;
+    ctx->ring_size = FFMAX(buf_size, 2*READAHEAD_CHUNK);
+    ctx->keep = ctx->ring_size >> 3;
+
+    ctx->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ctx->fd < 0) {
+        err = AVERROR(errno);
+        av_free(ctx);
+        return err;
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(ctx->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    ctx->ring = av_malloc(ctx->ring_size);
+    uint8_t *avio_buf = av_malloc(AVIO_BUF_SIZE);
+    if (!ctx->ring || !avio_buf) {
+        av_free(avio_buf);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    ctx->pb = avio_alloc_context(avio_buf, AVIO_BUF_SIZE, 0, ctx,
+                                 readahead_read, NULL, readahead_seek);
+    if (!ctx->pb) {
+        av_free(avio_buf);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    pthread_create(&ctx->thread, NULL, readahead_thread, ctx);
+
+    sp_log(log_ctx, SP_LOG_VERBOSE, "Reading \"%s\" with a %.1f MiB read-ahead buffer\n",
+           path, ctx->ring_size / (1024.0 * 1024.0));
+
+    *ra = ctx;
+    *pb = ctx->pb;
+
+    return 0;
+
+fail:
+    close(ctx->fd);
+    av_free(ctx->ring);
+    av_free(ctx);
+    return err;
+}
+
+void sp_avio_readahead_get_stats(SPAVIOReadahead *ra, SPAVIOReadaheadStats *stats)
+{
+    pthread_mutex_lock(&ra->lock);
+    stats->bytes_read = ra->bytes_read;
+    stats->read_time = ra->read_time;
+    stats->stall_time = ra->stall_time;
+    stats->buffered = ra->wr_pos - ra->rd_pos;
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void sp_avio_readahead_close(SPAVIOReadahead **ra)
+{
+    SPAVIOReadahead *ctx = *ra;
+    if (!ctx)
+        return;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->quit = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_join(ctx->thread, NULL);
+
+    av_freep(&ctx->pb->buffer);
+    avio_context_free(&ctx->pb);
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    close(ctx->fd);
+    av_free(ctx->ring);
+    av_freep(ra);
+}
+
+typedef struct WriterSegment {
+    int64_t file_off;
+    int64_t ring_pos; /* Absolute, modulo the ring size */
+    int len;
+} WriterSegment;
+
+struct SPAVIOWriter {
+    void *log_ctx;
+    int fd;
+    AVIOContext *pb;
+
+    uint8_t *ring;
+    int64_t ring_size;
+    int64_t head; /* Bytes queued, absolute */
+    int64_t tail; /* Bytes written out, absolute */
+
+    /* Segments between seg_tail and seg_head are queued, the ones below
+     * seg_busy are being written and must not be touched */
+    WriterSegment *segs;
+    int64_t seg_head;
+    int64_t seg_tail;
+    int64_t seg_busy;
+
+    int64_t pos;       /* Current write position of the AVIOContext */
+    int64_t file_size;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+    int err;
+
+#ifdef HAVE_LIBURING
+    struct io_uring uring;
+    int use_uring;
+    int uring_broken; /* Stale writes are left queued, don't submit again */
+#endif
+
+    /* Stats */
+    int64_t bytes_written;
+    int64_t last_latency;
+    int64_t max_latency;
+    int64_t stall_time;
+};
+
+static int write_full(SPAVIOWriter *w, const uint8_t *buf, int64_t len, int64_t off)
+{
+    while (len) {
+        ssize_t ret = pwrite(w->fd, buf, len, off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        buf += ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int write_batch(SPAVIOWriter *w, WriterSegment *batch, int nb)
+{
+    int err = 0;
+
+#ifdef HAVE_LIBURING
+    if (w->use_uring && !w->uring_broken) {
+        for (int i = 0; i < nb; i++) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&w->uring);
+            io_uring_prep_write(sqe, w->fd, w->ring + batch[i].ring_pos % w->ring_size,
+                                batch[i].len, batch[i].file_off);
+            io_uring_sqe_set_data(sqe, &batch[i]);
+        }
+
+        int ret = 0, submitted = 0;
+        while (submitted < nb) {
+            ret = io_uring_submit(&w->uring);
+            if (ret <= 0)
+                break;
+            submitted += ret;
+        }
+
+        /* Whatever didn't go through is still queued, so stop using the ring
+         * and write it out once the rest has completed */
+        if (submitted < nb) {
+            sp_log(w->log_ctx, SP_LOG_WARN, "Unable to submit writes: %s, "
+                   "falling back to pwrite()\n",
+                   av_err2str(ret < 0 ? ret : AVERROR(EAGAIN)));
+            w->uring_broken = 1;
+        }
+
+        for (int i = 0; i < submitted; i++) {
+            struct io_uring_cqe *cqe;
+            ret = io_uring_wait_cqe(&w->uring, &cqe);
+            if (ret < 0)
+                return ret;
+
+            WriterSegment *seg = io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&w->uring, cqe);
+
+            /* Finish off short writes synchronously */
+            if (res < 0 && !err)
+                err = res;
+            else if (res >= 0 && res < seg->len && !err)
+                err = write_full(w, w->ring + seg->ring_pos % w->ring_size + res,
+                                 seg->len - res, seg->file_off + res);
+        }
+
+        /* Batches never overlap, so the order doesn't matter */
+        for (int i = submitted; i < nb && !err; i++)
+            err = write_full(w, w->ring + batch[i].ring_pos % w->ring_size,
+                             batch[i].len, batch[i].file_off);
+
+        return err;
+    }
+#endif
+
+    for (int i = 0; i < nb && !err; i++)
+        err = write_full(w, w->ring + batch[i].ring_pos % w->ring_size,
+                         batch[i].len, batch[i].file_off);
+
+    return err;
+}
+
+static void *writer_thread(void *arg)
+{
+    SPAVIOWriter *w = arg;
+    WriterSegment batch[WRITER_MAX_BATCH];
+
+    sp_set_thread_name_self("writer");
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->seg_tail == w->seg_head && !w->quit)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->seg_tail == w->seg_head)
+            break;
+
+        /* Writes in a batch may complete in any order, so stop batching
+         * once the muxer has seeked backwards */
+        int nb = 0;
+        int64_t last_end = 0;
+        for (int64_t i = w->seg_tail; i < w->seg_head && nb < WRITER_MAX_BATCH; i++) {
+            WriterSegment *seg = &w->segs[i % WRITER_MAX_SEGS];
+            if (nb && seg->file_off < last_end)
+                break;
+            batch[nb++] = *seg;
+            last_end = seg->file_off + seg->len;
+        }
+        w->seg_busy = w->seg_tail + nb;
+        pthread_mutex_unlock(&w->lock);
+
+        int64_t t_start = av_gettime_relative();
+        int err = write_batch(w, batch, nb);
+        int64_t t_delta = av_gettime_relative() - t_start;
+
+        pthread_mutex_lock(&w->lock);
+        if (err < 0 && !w->err) {
+            w->err = err;
+            sp_log(w->log_ctx, SP_LOG_ERROR, "Error writing: %s!\n", av_err2str(err));
+        }
+
+        for (int i = 0; i < nb; i++)
+            w->bytes_written += batch[i].len;
+        w->last_latency = t_delta;
+        w->max_latency = FFMAX(w->max_latency, t_delta);
+
+        w->seg_tail += nb;
+        w->tail = batch[nb - 1].ring_pos + batch[nb - 1].len;
+
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static int writer_write(void *opaque, AVIO_WRITE_BUF *buf, int buf_size)
+{
+    SPAVIOWriter *w = opaque;
+    int remaining = buf_size;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (remaining) {
+        if (w->err) {
+            int err = w->err;
+            pthread_mutex_unlock(&w->lock);
+            return err;
+        }
+
+        int64_t space = w->ring_size - (w->head - w->tail);
+        if (!space || (w->seg_head - w->seg_tail) == WRITER_MAX_SEGS) {
+            int64_t t_start = av_gettime_relative();
+            pthread_cond_wait(&w->cond, &w->lock);
+            w->stall_time += av_gettime_relative() - t_start;
+            continue;
+        }
+
+        int64_t off = w->head % w->ring_size;
+        int len = FFMIN(FFMIN(remaining, space), w->ring_size - off);
+
+        memcpy(w->ring + off, buf, len);
+
+        /* Extend the last segment if still queued and contiguous */
+        WriterSegment *last = NULL;
+        if (w->seg_head > w->seg_busy)
+            last = &w->segs[(w->seg_head - 1) % WRITER_MAX_SEGS];
+
+        if (last && off && (last->len < WRITER_MAX_SEG_LEN) &&
+            (last->ring_pos + last->len == w->head) &&
+            (last->file_off + last->len == w->pos)) {
+            last->len += len;
+        } else {
+            WriterSegment *seg = &w->segs[w->seg_head % WRITER_MAX_SEGS];
+            seg->file_off = w->pos;
+            seg->ring_pos = w->head;
+            seg->len = len;
+            w->seg_head++;
+        }
+
+        w->head += len;
+        w->pos += len;
+        w->file_size = FFMAX(w->file_size, w->pos);
+        buf += len;
+        remaining -= len;
+
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return buf_size;
+}
+
+static int64_t writer_seek(void *opaque, int64_t offset, int whence)
+{
+    int64_t pos;
+    SPAVIOWriter *w = opaque;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (whence & AVSEEK_SIZE) {
+        pos = w->file_size;
+        pthread_mutex_unlock(&w->lock);
+        return pos;
+    }
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: pos = offset;                break;
+    case SEEK_CUR: pos = w->pos + offset;       break;
+    case SEEK_END: pos = w->file_size + offset; break;
+    default:
+        pthread_mutex_unlock(&w->lock);
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0) {
+        pthread_mutex_unlock(&w->lock);
+        return AVERROR(EINVAL);
+    }
+
+    w->pos = pos;
+
+    pthread_mutex_unlock(&w->lock);
+
+    return pos;
+}
+
+int sp_avio_writer_open(SPAVIOWriter **w, AVIOContext **pb, void *log_ctx,
+                        const char *path, size_t buf_size)
+{
+    int err;
+    struct stat st;
+
+    /* Leave pipe:, fd: and any other protocol to lavf */
+    const char *proto = avio_find_protocol_name(path);
+    if (!proto || strcmp(proto, "file"))
+        return AVERROR(ENOTSUP);
+
+    if (!strncmp(path, "file:", strlen("file:")))
+        path += strlen("file:");
+
+    /* Leave devices, pipes and such to lavf */
+    if (!stat(path, &st) && !S_ISREG(st.st_mode))
+        return AVERROR(ENOTSUP);
+
+    SPAVIOWriter *ctx = av_mallocz(sizeof(*ctx));
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    ctx->log_ctx = log_ctx;
+    ctx->ring_size = FFMAX(buf_size, AVIO_BUF_SIZE);
+
+    ctx->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (ctx->fd < 0) {
+        err = AVERROR(errno);
+        av_free(ctx);
+        return err;
+    }
+
+    ctx->ring = av_malloc(ctx->ring_size);
+    ctx->segs = av_malloc(WRITER_MAX_SEGS * sizeof(*ctx->segs));
+    uint8_t *avio_buf = av_malloc(AVIO_BUF_SIZE);
+    if (!ctx->ring || !ctx->segs || !avio_buf) {
+        av_free(avio_buf);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    ctx->pb = avio_alloc_context(avio_buf, AVIO_BUF_SIZE, 1, ctx,
+                                 NULL, writer_write, writer_seek);
+    if (!ctx->pb) {
+        av_free(avio_buf);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+#ifdef HAVE_LIBURING
+    ctx->use_uring = io_uring_queue_init(WRITER_MAX_BATCH, &ctx->uring, 0) >= 0;
+    if (!ctx->use_uring)
+        sp_log(log_ctx, SP_LOG_VERBOSE, "io_uring unavailable, using pwrite\n");
+#endif
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    pthread_create(&ctx->thread, NULL, writer_thread, ctx);
+
+    sp_log(log_ctx, SP_LOG_VERBOSE, "Writing \"%s\" with a %.1f MiB buffer\n",
+           path, ctx->ring_size / (1024.0 * 1024.0));
+
+    *w = ctx;
+    *pb = ctx->pb;
+
+    return 0;
+
+fail:
+    close(ctx->fd);
+    av_free(ctx->segs);
+    av_free(ctx->ring);
+    av_free(ctx);
+    return err;
+}
+
+void sp_avio_writer_get_stats(SPAVIOWriter *w, SPAVIOWriterStats *stats)
+{
+    pthread_mutex_lock(&w->lock);
+    stats->queued = w->head - w->tail;
+    stats->capacity = w->ring_size;
+    stats->bytes_written = w->bytes_written;
+    stats->last_latency = w->last_latency;
+    stats->max_latency = w->max_latency;
+    stats->stall_time = w->stall_time;
+    pthread_mutex_unlock(&w->lock);
+}
+
+int sp_avio_writer_flush(SPAVIOWriter *w)
+{
+    avio_flush(w->pb);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->seg_tail != w->seg_head && !w->err)
+        pthread_cond_wait(&w->cond, &w->lock);
+    int err = w->err;
+    pthread_mutex_unlock(&w->lock);
+
+    return err;
+}
+
+int sp_avio_writer_close(SPAVIOWriter **w)
+{
+    SPAVIOWriter *ctx = *w;
+    if (!ctx)
+        return 0;
+
+    avio_flush(ctx->pb);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->quit = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_join(ctx->thread, NULL);
+
+    int err = ctx->err;
+
+#ifdef HAVE_LIBURING
+    if (ctx->use_uring)
+        io_uring_queue_exit(&ctx->uring);
+#endif
+
+    av_freep(&ctx->pb->buffer);
+    avio_context_free(&ctx->pb);
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    if (close(ctx->fd) && !err)
+        err = AVERROR(errno);
+    av_free(ctx->segs);
+    av_free(ctx->ring);
+    av_freep(w);
+
+    return err;
+}
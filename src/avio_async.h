@@ -0,0 +1,71 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavformat/avio.h>
+
+/* Read-ahead AVIOContext for regular files. A dedicated thread fills a
+ * ring buffer with pread(), and the AVIOContext reads from memory. */
+typedef struct SPAVIOReadahead SPAVIOReadahead;
+
+typedef struct SPAVIOReadaheadStats {
+    int64_t bytes_read; /* Total bytes read from the file */
+    int64_t read_time;  /* Time spent in pread(), in microseconds */
+    int64_t stall_time; /* Time the reader spent waiting on data, in microseconds */
+    int64_t buffered;   /* Bytes currently buffered ahead of the reader */
+} SPAVIOReadaheadStats;
+
+/* Returns AVERROR(ENOTSUP) if path is not a regular file.
+ * The AVIOContext is owned by the read-ahead context. */
+int  sp_avio_readahead_open(SPAVIOReadahead **ra, AVIOContext **pb, void *log_ctx,
+                            const char *path, size_t buf_size);
+void sp_avio_readahead_get_stats(SPAVIOReadahead *ra, SPAVIOReadaheadStats *stats);
+void sp_avio_readahead_close(SPAVIOReadahead **ra);
+
+/* Write-behind AVIOContext for regular files. Writes are copied into a ring
+ * buffer which a dedicated thread drains, with io_uring if available or
+ * pwrite() otherwise. Seeking is supported, writes are applied in order. */
+typedef struct SPAVIOWriter SPAVIOWriter;
+
+typedef struct SPAVIOWriterStats {
+    int64_t queued;        /* Bytes waiting to be written */
+    int64_t capacity;      /* Size of the ring buffer */
+    int64_t bytes_written; /* Total bytes written to the file */
+    int64_t last_latency;  /* Duration of the last batch of writes, in microseconds */
+    int64_t max_latency;   /* Longest batch of writes, in microseconds */
+    int64_t stall_time;    /* Time the muxer spent waiting on space, in microseconds */
+} SPAVIOWriterStats;
+
+/* Returns AVERROR(ENOTSUP) if path is not, or cannot be, a regular file
+ * on the file protocol. The AVIOContext is owned by the writer context.
+ * avio_flush() only reaches the ring, so outputs lavf reopens to read back
+ * (e.g. movflags=+faststart) must not use it. */
+int  sp_avio_writer_open(SPAVIOWriter **w, AVIOContext **pb, void *log_ctx,
+                         const char *path, size_t buf_size);
+void sp_avio_writer_get_stats(SPAVIOWriter *w, SPAVIOWriterStats *stats);
+
+/* Flushes the AVIOContext and waits until everything has been written */
+int  sp_avio_writer_flush(SPAVIOWriter *w);
+
+/* Flushes and frees everything, returns any pending write error */
+int  sp_avio_writer_close(SPAVIOWriter **w);
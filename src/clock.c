@@ -0,0 +1,222 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <math.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include <libtxproto/clock.h>
+#include <libtxproto/events.h>
+#include <libtxproto/utils.h>
+
+static void clock_free(void *opaque, uint8_t *data)
+{
+    SPClock *clock = (SPClock *)data;
+
+    pthread_mutex_destroy(&clock->lock);
+    sp_class_free(clock);
+    av_free(clock);
+}
+
+AVBufferRef *sp_clock_alloc(void *owner)
+{
+    SPClock *clock = av_mallocz(sizeof(*clock));
+    if (!clock)
+        return NULL;
+
+    AVBufferRef *clock_ref = av_buffer_create((uint8_t *)clock, sizeof(*clock),
+                                              clock_free, NULL, 0);
+    if (!clock_ref) {
+        av_free(clock);
+        return NULL;
+    }
+
+    int err = sp_class_alloc(clock, "clock", SP_TYPE_CLOCK_SOURCE, owner);
+    if (err < 0) {
+        av_buffer_unref(&clock_ref);
+        return NULL;
+    }
+
+    pthread_mutex_init(&clock->lock, NULL);
+    clock->active = ATOMIC_VAR_INIT(0);
+    clock->first = INT64_MIN;
+    clock->scale = 1.0;
+
+    return clock_ref;
+}
+
+void sp_clock_activate(AVBufferRef *clock_ref, atomic_int_fast64_t *epoch)
+{
+    SPClock *clock = (SPClock *)clock_ref->data;
+
+    pthread_mutex_lock(&clock->lock);
+    clock->epoch = epoch;
+    clock->first = INT64_MIN;
+    atomic_store(&clock->active, 1);
+    pthread_mutex_unlock(&clock->lock);
+}
+
+int sp_clock_is_active(AVBufferRef *clock_ref)
+{
+    if (!clock_ref)
+        return 0;
+
+    SPClock *clock = (SPClock *)clock_ref->data;
+    return atomic_load(&clock->active);
+}
+
+void sp_clock_update(AVBufferRef *clock_ref, int64_t sys_time, int64_t time,
+                     double scale)
+{
+    SPClock *clock = (SPClock *)clock_ref->data;
+
+    pthread_mutex_lock(&clock->lock);
+
+    if (clock->first == INT64_MIN) {
+        clock->first = sys_time - time;
+        clock->first_time = time;
+        if (clock->epoch)
+            atomic_store(clock->epoch, clock->first);
+        sp_log(clock, SP_LOG_VERBOSE, "Master clock started!\n");
+    }
+
+    clock->ref_sys = sys_time;
+    clock->ref_time = time;
+    clock->scale = scale;
+
+    pthread_mutex_unlock(&clock->lock);
+}
+
+static int64_t clock_convert(SPClock *clock, int64_t sys_time)
+{
+    if (clock->first == INT64_MIN)
+        return AV_NOPTS_VALUE;
+
+    int64_t time = clock->ref_time + llrint((sys_time - clock->ref_sys) / clock->scale);
+
+    return time < clock->first_time ? AV_NOPTS_VALUE : time;
+}
+
+int64_t sp_clock_convert(AVBufferRef *clock_ref, int64_t sys_time)
+{
+    SPClock *clock = (SPClock *)clock_ref->data;
+
+    pthread_mutex_lock(&clock->lock);
+    int64_t time = clock_convert(clock, sys_time);
+    pthread_mutex_unlock(&clock->lock);
+
+    return time;
+}
+
+void sp_clock_slot_init(SPClockSlot *slot)
+{
+    pthread_mutex_init(&slot->lock, NULL);
+    slot->clock = NULL;
+}
+
+int sp_clock_slot_set(SPClockSlot *slot, AVBufferRef *clock_ref)
+{
+    AVBufferRef *ref = NULL;
+    if (clock_ref && !(ref = av_buffer_ref(clock_ref)))
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&slot->lock);
+    av_buffer_unref(&slot->clock);
+    slot->clock = ref;
+    pthread_mutex_unlock(&slot->lock);
+
+    return 0;
+}
+
+AVBufferRef *sp_clock_slot_get(SPClockSlot *slot)
+{
+    pthread_mutex_lock(&slot->lock);
+    AVBufferRef *ref = slot->clock ? av_buffer_ref(slot->clock) : NULL;
+    pthread_mutex_unlock(&slot->lock);
+
+    return ref;
+}
+
+void sp_clock_slot_uninit(SPClockSlot *slot)
+{
+    av_buffer_unref(&slot->clock);
+    pthread_mutex_destroy(&slot->lock);
+}
+
+void sp_clock_follower_init(SPClockFollower *f, SPClockSlot *slot, int64_t epoch)
+{
+    av_buffer_unref(&f->clock);
+    f->slot = slot;
+    f->clock = slot ? sp_clock_slot_get(slot) : NULL;
+    f->epoch = epoch;
+    f->last_stats = 0;
+}
+
+int64_t sp_clock_follower_time(SPClockFollower *f, int64_t sys_time)
+{
+    /* The master may have been set up after we started */
+    if (!f->clock && f->slot)
+        f->clock = sp_clock_slot_get(f->slot);
+
+    if (!f->clock)
+        return sys_time - f->epoch;
+
+    return sp_clock_convert(f->clock, sys_time);
+}
+
+void sp_clock_follower_stats(SPClockFollower *f, void *ctx, SPBufferList *events)
+{
+    if (!f->clock)
+        return;
+
+    int64_t now = av_gettime_relative();
+    if ((now - f->last_stats) < 1000000)
+        return;
+
+    SPClock *clock = (SPClock *)f->clock->data;
+
+    pthread_mutex_lock(&clock->lock);
+    int64_t time = clock_convert(clock, now);
+    int64_t first = clock->first;
+    double scale = clock->scale;
+    pthread_mutex_unlock(&clock->lock);
+
+    if (time == AV_NOPTS_VALUE)
+        return;
+
+    double offset = (time - (now - first)) / 1000.0;
+    double drift_ppm = (scale - 1.0) * 1000000.0;
+
+    SPGenericData entries[] = {
+        D_TYPE("clock_offset", NULL, offset),
+        D_TYPE("master_drift_ppm", NULL, drift_ppm),
+        { 0 },
+    };
+    sp_eventlist_dispatch(ctx, events, SP_EVENT_ON_STATS, entries);
+
+    f->last_stats = now;
+}
+
+void sp_clock_follower_uninit(SPClockFollower *f)
+{
+    av_buffer_unref(&f->clock);
+    f->slot = NULL;
+}
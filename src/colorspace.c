@@ -0,0 +1,543 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <math.h>
+#include <string.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+
+#include "colorspace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#define Y_SHIFT 15
+#define C_SHIFT (Y_SHIFT + 2) /* Chroma is computed from 2x2 sums */
+
+/* Writes two rows of luma and one of chroma, returns the number of
+ * pixels handled, the rest are done by the scalar code */
+typedef int (*conv_rows_fn)(const SPColorConv *c, uint8_t *y0, uint8_t *y1,
+                            uint8_t *u, uint8_t *v, const uint8_t *s0,
+                            const uint8_t *s1, int width);
+
+struct SPColorConv {
+    enum AVPixelFormat src_fmt;
+    enum AVPixelFormat dst_fmt;
+    enum AVColorSpace colorspace;
+    enum AVColorRange range;
+    int nv12;
+
+    /* Per byte of a source pixel, so all packed layouts share kernels */
+    int16_t cy[4];
+    int16_t cu[4];
+    int16_t cv[4];
+    int32_t y_add;
+    int32_t c_add;
+
+    conv_rows_fn rows;
+    const char *impl;
+
+    AVBufferPool *pool;
+    int width;
+    int height;
+    int stride[3];
+    size_t offset[3];
+    size_t size;
+};
+
+static int src_layout(enum AVPixelFormat fmt, int *r, int *g, int *b)
+{
+    switch (fmt) {
+    case AV_PIX_FMT_BGR0:
+    case AV_PIX_FMT_BGRA: *b = 0; *g = 1; *r = 2; return 0;
+    case AV_PIX_FMT_RGB0:
+    case AV_PIX_FMT_RGBA: *r = 0; *g = 1; *b = 2; return 0;
+    case AV_PIX_FMT_0RGB:
+    case AV_PIX_FMT_ARGB: *r = 1; *g = 2; *b = 3; return 0;
+    case AV_PIX_FMT_0BGR:
+    case AV_PIX_FMT_ABGR: *b = 1; *g = 2; *r = 3; return 0;
+    default:
+        return AVERROR(ENOTSUP);
+    }
+}
+
+int sp_colorconv_supported(enum AVPixelFormat src, enum AVPixelFormat dst)
+{
+    int r, g, b;
+    return !src_layout(src, &r, &g, &b) &&
+           (dst == AV_PIX_FMT_NV12 || dst == AV_PIX_FMT_YUV420P);
+}
+
+static inline int pix_y(const SPColorConv *c, const uint8_t *p)
+{
+    return av_clip_uint8((c->cy[0]*p[0] + c->cy[1]*p[1] + c->cy[2]*p[2] +
+                          c->cy[3]*p[3] + c->y_add) >> Y_SHIFT);
+}
+
+static inline void pix_uv(const SPColorConv *c, const int s[4], uint8_t *u, uint8_t *v)
+{
+    *u = av_clip_uint8((c->cu[0]*s[0] + c->cu[1]*s[1] + c->cu[2]*s[2] +
+                        c->cu[3]*s[3] + c->c_add) >> C_SHIFT);
+    *v = av_clip_uint8((c->cv[0]*s[0] + c->cv[1]*s[1] + c->cv[2]*s[2] +
+                        c->cv[3]*s[3] + c->c_add) >> C_SHIFT);
+}
+
+/* Starts at pixel x, which must be even. Odd widths repeat the last column. */
+static void rows_scalar(const SPColorConv *c, uint8_t *y0, uint8_t *y1,
+                        uint8_t *u, uint8_t *v, const uint8_t *s0,
+                        const uint8_t *s1, int x, int width)
+{
+    for (; x < width; x += 2) {
+        const uint8_t *a0 = s0 + 4*x, *a1 = s1 + 4*x;
+        const uint8_t *b0 = a0, *b1 = a1;
+        int s[4];
+
+        y0[x] = pix_y(c, a0);
+        y1[x] = pix_y(c, a1);
+        if (x + 1 < width) {
+            b0 += 4;
+            b1 += 4;
+            y0[x + 1] = pix_y(c, b0);
+            y1[x + 1] = pix_y(c, b1);
+        }
+
+        for (int i = 0; i < 4; i++)
+            s[i] = a0[i] + a1[i] + b0[i] + b1[i];
+
+        if (c->nv12)
+            pix_uv(c, s, &u[x], &u[x + 1]);
+        else
+            pix_uv(c, s, &u[x >> 1], &v[x >> 1]);
+    }
+}
+
+#if HAVE_X86_KERNELS
+/* Both kernels do 16 pixels of two rows per iteration. Luma is a multiply-add
+ * of the zero-extended bytes, chroma the same over pairs of vertical sums. */
+
+__attribute__((target("sse4.1")))
+static inline __m128i luma4_sse4(__m128i px, __m128i cy)
+{
+    __m128i lo = _mm_cvtepu8_epi16(px);
+    __m128i hi = _mm_unpackhi_epi8(px, _mm_setzero_si128());
+    return _mm_hadd_epi32(_mm_madd_epi16(lo, cy), _mm_madd_epi16(hi, cy));
+}
+
+/* Returns U0 V0 U1 V1 as 32-bit */
+__attribute__((target("sse4.1")))
+static inline __m128i chroma2_sse4(__m128i p0, __m128i p1, __m128i cu,
+                                   __m128i cv, __m128i add)
+{
+    const __m128i z = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(p0, z), _mm_unpacklo_epi8(p1, z));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(p0, z), _mm_unpackhi_epi8(p1, z));
+    __m128i s = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+    __m128i t = _mm_hadd_epi32(_mm_madd_epi16(s, cu), _mm_madd_epi16(s, cv));
+    t = _mm_srai_epi32(_mm_add_epi32(t, add), C_SHIFT);
+    return _mm_shuffle_epi32(t, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("sse4.1")))
+static int rows_sse4(const SPColorConv *c, uint8_t *y0, uint8_t *y1,
+                     uint8_t *u, uint8_t *v, const uint8_t *s0,
+                     const uint8_t *s1, int width)
+{
+    const __m128i cy = _mm_set_epi16(c->cy[3], c->cy[2], c->cy[1], c->cy[0],
+                                     c->cy[3], c->cy[2], c->cy[1], c->cy[0]);
+    const __m128i cu = _mm_set_epi16(c->cu[3], c->cu[2], c->cu[1], c->cu[0],
+                                     c->cu[3], c->cu[2], c->cu[1], c->cu[0]);
+    const __m128i cv = _mm_set_epi16(c->cv[3], c->cv[2], c->cv[1], c->cv[0],
+                                     c->cv[3], c->cv[2], c->cv[1], c->cv[0]);
+    const __m128i y_add = _mm_set1_epi32(c->y_add);
+    const __m128i c_add = _mm_set1_epi32(c->c_add);
+    const __m128i deint = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                        1, 3, 5, 7, 9, 11, 13, 15);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i a[4], b[4], ya[4], yb[4], uv[4];
+
+        for (int i = 0; i < 4; i++) {
+            a[i] = _mm_loadu_si128((const __m128i *)(s0 + 4*x + 16*i));
+            b[i] = _mm_loadu_si128((const __m128i *)(s1 + 4*x + 16*i));
+            ya[i] = _mm_srai_epi32(_mm_add_epi32(luma4_sse4(a[i], cy), y_add), Y_SHIFT);
+            yb[i] = _mm_srai_epi32(_mm_add_epi32(luma4_sse4(b[i], cy), y_add), Y_SHIFT);
+            uv[i] = chroma2_sse4(a[i], b[i], cu, cv, c_add);
+        }
+
+        _mm_storeu_si128((__m128i *)(y0 + x),
+                         _mm_packus_epi16(_mm_packs_epi32(ya[0], ya[1]),
+                                          _mm_packs_epi32(ya[2], ya[3])));
+        _mm_storeu_si128((__m128i *)(y1 + x),
+                         _mm_packus_epi16(_mm_packs_epi32(yb[0], yb[1]),
+                                          _mm_packs_epi32(yb[2], yb[3])));
+
+        __m128i c8 = _mm_packus_epi16(_mm_packs_epi32(uv[0], uv[1]),
+                                      _mm_packs_epi32(uv[2], uv[3]));
+        if (c->nv12) {
+            _mm_storeu_si128((__m128i *)(u + x), c8);
+        } else {
+            c8 = _mm_shuffle_epi8(c8, deint);
+            _mm_storel_epi64((__m128i *)(u + (x >> 1)), c8);
+            _mm_storel_epi64((__m128i *)(v + (x >> 1)), _mm_srli_si128(c8, 8));
+        }
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i luma8_avx2(__m256i px, __m256i cy)
+{
+    const __m256i z = _mm256_setzero_si256();
+    __m256i lo = _mm256_unpacklo_epi8(px, z);
+    __m256i hi = _mm256_unpackhi_epi8(px, z);
+    return _mm256_hadd_epi32(_mm256_madd_epi16(lo, cy), _mm256_madd_epi16(hi, cy));
+}
+
+/* Returns U0 V0 U1 V1 | U2 V2 U3 V3 as 32-bit */
+__attribute__((target("avx2")))
+static inline __m256i chroma4_avx2(__m256i p0, __m256i p1, __m256i cu,
+                                   __m256i cv, __m256i add)
+{
+    const __m256i z = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(p0, z), _mm256_unpacklo_epi8(p1, z));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(p0, z), _mm256_unpackhi_epi8(p1, z));
+    __m256i s = _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_unpackhi_epi64(lo, hi));
+    __m256i t = _mm256_hadd_epi32(_mm256_madd_epi16(s, cu), _mm256_madd_epi16(s, cv));
+    t = _mm256_srai_epi32(_mm256_add_epi32(t, add), C_SHIFT);
+    return _mm256_shuffle_epi32(t, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/* packs work within 128-bit lanes, this restores the order */
+__attribute__((target("avx2")))
+static inline __m128i pack_u8_avx2(__m256i a, __m256i b)
+{
+    __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+}
+
+__attribute__((target("avx2")))
+static int rows_avx2(const SPColorConv *c, uint8_t *y0, uint8_t *y1,
+                     uint8_t *u, uint8_t *v, const uint8_t *s0,
+                     const uint8_t *s1, int width)
+{
+    const __m256i cy = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)c->cy));
+    const __m256i cu = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)c->cu));
+    const __m256i cv = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)c->cv));
+    const __m256i y_add = _mm256_set1_epi32(c->y_add);
+    const __m256i c_add = _mm256_set1_epi32(c->c_add);
+    const __m128i deint = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                        1, 3, 5, 7, 9, 11, 13, 15);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i a[2], b[2], ya[2], yb[2], uv[2];
+
+        for (int i = 0; i < 2; i++) {
+            a[i] = _mm256_loadu_si256((const __m256i *)(s0 + 4*x + 32*i));
+            b[i] = _mm256_loadu_si256((const __m256i *)(s1 + 4*x + 32*i));
+            ya[i] = _mm256_srai_epi32(_mm256_add_epi32(luma8_avx2(a[i], cy), y_add), Y_SHIFT);
+            yb[i] = _mm256_srai_epi32(_mm256_add_epi32(luma8_avx2(b[i], cy), y_add), Y_SHIFT);
+            uv[i] = chroma4_avx2(a[i], b[i], cu, cv, c_add);
+        }
+
+        _mm_storeu_si128((__m128i *)(y0 + x), pack_u8_avx2(ya[0], ya[1]));
+        _mm_storeu_si128((__m128i *)(y1 + x), pack_u8_avx2(yb[0], yb[1]));
+
+        __m128i c8 = pack_u8_avx2(uv[0], uv[1]);
+        if (c->nv12) {
+            _mm_storeu_si128((__m128i *)(u + x), c8);
+        } else {
+            c8 = _mm_shuffle_epi8(c8, deint);
+            _mm_storel_epi64((__m128i *)(u + (x >> 1)), c8);
+            _mm_storel_epi64((__m128i *)(v + (x >> 1)), _mm_srli_si128(c8, 8));
+        }
+    }
+
+    return x;
+}
+#endif
+
+/* Exact round(d*(255 - a)/255) + s */
+static inline uint8_t blend_px(uint8_t d, uint8_t s, uint8_t a)
+{
+    int x = d*(255 - a) + 128;
+    return av_clip_uint8(s + ((x + (x >> 8)) >> 8));
+}
+
+#if HAVE_X86_KERNELS
+/* SSE2 is part of x86-64, and rare to lack on anything running this */
+__attribute__((target("sse2")))
+static inline __m128i blend4_sse2(__m128i d, __m128i s, __m128i a)
+{
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i c255 = _mm_set1_epi16(255);
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(c255, a)), c128);
+    x = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    return _mm_add_epi16(x, s);
+}
+
+#define BLEND_ROW_SSE2(name, shuf)                                              \
+__attribute__((target("sse2")))                                                 \
+static int name(uint8_t *dst, const uint8_t *src, int width)                    \
+{                                                                               \
+    const __m128i z = _mm_setzero_si128();                                      \
+    int x;                                                                      \
+    for (x = 0; x + 4 <= width; x += 4) {                                       \
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + 4*x));              \
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + 4*x));              \
+        __m128i s_lo = _mm_unpacklo_epi8(s, z), s_hi = _mm_unpackhi_epi8(s, z); \
+        __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, shuf), shuf); \
+        __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, shuf), shuf); \
+        __m128i r_lo = blend4_sse2(_mm_unpacklo_epi8(d, z), s_lo, a_lo);        \
+        __m128i r_hi = blend4_sse2(_mm_unpackhi_epi8(d, z), s_hi, a_hi);        \
+        _mm_storeu_si128((__m128i *)(dst + 4*x), _mm_packus_epi16(r_lo, r_hi)); \
+    }                                                                           \
+    return x;                                                                   \
+}
+
+BLEND_ROW_SSE2(blend_row_a0_sse2, _MM_SHUFFLE(0, 0, 0, 0))
+BLEND_ROW_SSE2(blend_row_a3_sse2, _MM_SHUFFLE(3, 3, 3, 3))
+#endif
+
+void sp_blend_premult(uint8_t *dst, int dst_stride, const uint8_t *src,
+                      int src_stride, int width, int height, int alpha_idx)
+{
+#if HAVE_X86_KERNELS
+    int simd = !!(av_get_cpu_flags() & AV_CPU_FLAG_SSE2);
+#endif
+
+    for (int y = 0; y < height; y++) {
+        uint8_t *d = dst + y*dst_stride;
+        const uint8_t *s = src + y*src_stride;
+        int x = 0;
+
+#if HAVE_X86_KERNELS
+        if (simd)
+            x = alpha_idx ? blend_row_a3_sse2(d, s, width) :
+                            blend_row_a0_sse2(d, s, width);
+#endif
+
+        for (; x < width; x++)
+            for (int i = 0; i < 4; i++)
+                d[4*x + i] = blend_px(d[4*x + i], s[4*x + i], s[4*x + alpha_idx]);
+    }
+}
+
+static void set_coeffs(SPColorConv *c, int r, int g, int b)
+{
+    double kr, kb;
+    int full = c->range == AVCOL_RANGE_JPEG;
+    double ys = full ? 1.0 : 219.0/255.0;
+    double cs = full ? 1.0 : 224.0/255.0;
+
+    if (c->colorspace == AVCOL_SPC_BT709) {
+        kr = 0.2126;
+        kb = 0.0722;
+    } else {
+        kr = 0.299;
+        kb = 0.114;
+    }
+
+    memset(c->cy, 0, sizeof(c->cy));
+    memset(c->cu, 0, sizeof(c->cu));
+    memset(c->cv, 0, sizeof(c->cv));
+
+    /* Green takes the rounding error, so that greys map exactly */
+    c->cy[r] = lrint(kr*ys*(1 << Y_SHIFT));
+    c->cy[b] = lrint(kb*ys*(1 << Y_SHIFT));
+    c->cy[g] = lrint(ys*(1 << Y_SHIFT)) - c->cy[r] - c->cy[b];
+
+    c->cu[r] = lrint(-kr/(2.0*(1.0 - kb))*cs*(1 << Y_SHIFT));
+    c->cu[b] = lrint(0.5*cs*(1 << Y_SHIFT));
+    c->cu[g] = -c->cu[r] - c->cu[b];
+
+    c->cv[r] = lrint(0.5*cs*(1 << Y_SHIFT));
+    c->cv[b] = lrint(-kb/(2.0*(1.0 - kr))*cs*(1 << Y_SHIFT));
+    c->cv[g] = -c->cv[r] - c->cv[b];
+
+    c->y_add = ((full ? 0 : 16) << Y_SHIFT) + (1 << (Y_SHIFT - 1));
+    c->c_add = (128 << C_SHIFT) + (1 << (C_SHIFT - 1));
+}
+
+int sp_colorconv_alloc(SPColorConv **c, enum AVPixelFormat src,
+                       enum AVPixelFormat dst, enum AVColorSpace colorspace,
+                       enum AVColorRange range)
+{
+    int r = 0, g = 0, b = 0;
+
+    if (!sp_colorconv_supported(src, dst))
+        return AVERROR(ENOTSUP);
+
+    switch (colorspace) {
+    case AVCOL_SPC_UNSPECIFIED:
+        colorspace = AVCOL_SPC_BT709;
+        break;
+    case AVCOL_SPC_BT709:
+    case AVCOL_SPC_BT470BG:
+    case AVCOL_SPC_SMPTE170M:
+        break;
+    default:
+        return AVERROR(ENOTSUP);
+    }
+
+    SPColorConv *ctx = av_mallocz(sizeof(*ctx));
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    ctx->src_fmt = src;
+    ctx->dst_fmt = dst;
+    ctx->nv12 = dst == AV_PIX_FMT_NV12;
+    ctx->colorspace = colorspace;
+    ctx->range = range == AVCOL_RANGE_JPEG ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+
+    src_layout(src, &r, &g, &b);
+    set_coeffs(ctx, r, g, b);
+
+    ctx->impl = "c";
+
+#if HAVE_X86_KERNELS
+    int flags = av_get_cpu_flags();
+    if (flags & AV_CPU_FLAG_AVX2) {
+        ctx->rows = rows_avx2;
+        ctx->impl = "avx2";
+    } else if (flags & AV_CPU_FLAG_SSE4) {
+        ctx->rows = rows_sse4;
+        ctx->impl = "sse4.1";
+    }
+#endif
+
+    *c = ctx;
+
+    return 0;
+}
+
+void sp_colorconv_planes(SPColorConv *c, uint8_t *dst[3], const int dst_stride[3],
+                         const uint8_t *src, int src_stride, int width, int height)
+{
+    for (int y = 0; y < height; y += 2) {
+        const uint8_t *s0 = src + y*src_stride;
+        const uint8_t *s1 = (y + 1 < height) ? s0 + src_stride : s0;
+        uint8_t *y0 = dst[0] + y*dst_stride[0];
+        uint8_t *y1 = (y + 1 < height) ? y0 + dst_stride[0] : y0;
+        uint8_t *u = dst[1] + (y >> 1)*dst_stride[1];
+        uint8_t *v = c->nv12 ? NULL : dst[2] + (y >> 1)*dst_stride[2];
+        int x = 0;
+
+        if (c->rows)
+            x = c->rows(c, y0, y1, u, v, s0, s1, width);
+
+        rows_scalar(c, y0, y1, u, v, s0, s1, x, width);
+    }
+}
+
+static int setup_pool(SPColorConv *c, int width, int height)
+{
+    int cw = (width + 1) >> 1, ch = (height + 1) >> 1;
+
+    c->stride[0] = FFALIGN(width, 64);
+    c->stride[1] = FFALIGN(c->nv12 ? 2*cw : cw, 64);
+    c->stride[2] = c->nv12 ? 0 : c->stride[1];
+
+    c->offset[0] = 0;
+    c->offset[1] = (size_t)c->stride[0]*height;
+    c->offset[2] = c->offset[1] + (size_t)c->stride[1]*ch;
+    c->size      = c->offset[2] + (size_t)c->stride[2]*ch;
+
+    av_buffer_pool_uninit(&c->pool);
+    c->pool = av_buffer_pool_init(c->size + 64, NULL);
+    if (!c->pool)
+        return AVERROR(ENOMEM);
+
+    c->width = width;
+    c->height = height;
+
+    return 0;
+}
+
+int sp_colorconv_convert(SPColorConv *c, AVFrame **dst, const AVFrame *src)
+{
+    int err;
+
+    if (src->format != c->src_fmt)
+        return AVERROR(EINVAL);
+
+    if (!c->pool || src->width != c->width || src->height != c->height) {
+        err = setup_pool(c, src->width, src->height);
+        if (err < 0)
+            return err;
+    }
+
+    AVFrame *out = av_frame_alloc();
+    if (!out)
+        return AVERROR(ENOMEM);
+
+    out->buf[0] = av_buffer_pool_get(c->pool);
+    if (!out->buf[0]) {
+        av_frame_free(&out);
+        return AVERROR(ENOMEM);
+    }
+
+    for (int i = 0; i < (c->nv12 ? 2 : 3); i++) {
+        out->data[i] = out->buf[0]->data + c->offset[i];
+        out->linesize[i] = c->stride[i];
+    }
+
+    out->format = c->dst_fmt;
+    out->width = src->width;
+    out->height = src->height;
+
+    err = av_frame_copy_props(out, src);
+    if (err < 0) {
+        av_frame_free(&out);
+        return err;
+    }
+
+    out->colorspace = c->colorspace;
+    out->color_range = c->range;
+    out->chroma_location = AVCHROMA_LOC_CENTER;
+
+    sp_colorconv_planes(c, out->data, out->linesize, src->data[0],
+                        src->linesize[0], src->width, src->height);
+
+    *dst = out;
+
+    return 0;
+}
+
+const char *sp_colorconv_impl(SPColorConv *c)
+{
+    return c->impl;
+}
+
+void sp_colorconv_free(SPColorConv **c)
+{
+    if (!*c)
+        return;
+
+    av_buffer_pool_uninit(&(*c)->pool);
+    av_freep(c);
+}
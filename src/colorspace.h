@@ -0,0 +1,55 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#pragma once
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+/* Packed 32-bit RGB to NV12/YUV420P conversion, for screen capture.
+ * Uses hand-vectorised kernels where the CPU supports them, and is
+ * bit-exact with its scalar fallback. */
+typedef struct SPColorConv SPColorConv;
+
+/* Returns 1 if src can be converted to dst */
+int sp_colorconv_supported(enum AVPixelFormat src, enum AVPixelFormat dst);
+
+/* Only BT.601 and BT.709 are supported, unspecified values default to
+ * limited range BT.709. */
+int sp_colorconv_alloc(SPColorConv **c, enum AVPixelFormat src,
+                       enum AVPixelFormat dst, enum AVColorSpace colorspace,
+                       enum AVColorRange range);
+
+/* Converts src into a newly allocated, pooled frame, with properties
+ * copied and color properties set. Dimensions may change between calls. */
+int sp_colorconv_convert(SPColorConv *c, AVFrame **dst, const AVFrame *src);
+
+/* Converts into preallocated planes */
+void sp_colorconv_planes(SPColorConv *c, uint8_t *dst[3], const int dst_stride[3],
+                         const uint8_t *src, int src_stride, int width, int height);
+
+/* Name of the kernel in use */
+const char *sp_colorconv_impl(SPColorConv *c);
+
+void sp_colorconv_free(SPColorConv **c);
+
+/* Blends premultiplied 32-bit pixels from src over dst, in place. Both use
+ * the same byte order, with alpha at byte alpha_idx, which must be 0 or 3. */
+void sp_blend_premult(uint8_t *dst, int dst_stride, const uint8_t *src,
+                      int src_stride, int width, int height, int alpha_idx);
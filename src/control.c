@@ -94,7 +94,7 @@ int sp_generic_ctrl(TXMainContext *ctx,
     }
 
     if (flags & SP_EVENT_CTRL_START)
-        err = fn(ref, flags, &ctx->epoch_value);
+        err = fn(ref, flags, ctx);
     else
         err = fn(ref, flags, arg);
     if (err < 0) {
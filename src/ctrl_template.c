@@ -19,6 +19,7 @@
 #include <stdatomic.h>
 
 #include <libtxproto/log.h>
+#include <libtxproto/txproto_main.h>
 #include "ctrl_template.h"
 
 static void ctrl_template_ctx_free(void *callback_ctx, void *ctx, void *dep_ctx)
@@ -81,7 +82,9 @@ int sp_ctrl_template(void *ctx, SPBufferList *events, SPEventType extra_ctrl,
     } else if (ctrl & SP_EVENT_CTRL_COMMAND) {
         av_dict_copy(&ctrl_ctx->cmd, arg, 0);
     } else if (ctrl & SP_EVENT_CTRL_START) {
-        ctrl_ctx->epoch = arg;
+        TXMainContext *main = arg;
+        ctrl_ctx->epoch = &main->epoch_value;
+        ctrl_ctx->clock = &main->epoch_clock;
     }
 
     if (ctrl & SP_EVENT_FLAG_IMMEDIATE) {
@@ -20,6 +20,7 @@
 
 #include <stdatomic.h>
 
+#include <libtxproto/clock.h>
 #include <libtxproto/events.h>
 #include <libtxproto/utils.h>
 
@@ -28,6 +29,7 @@ typedef struct SPCtrlTemplateCbCtx {
     AVDictionary *opts;
     AVDictionary *cmd;
     atomic_int_fast64_t *epoch;
+    SPClockSlot *clock;
 } SPCtrlTemplateCbCtx;
 
 int sp_ctrl_template(void *ctx, SPBufferList *events, SPEventType extra_ctrl,
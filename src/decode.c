@@ -31,59 +31,9 @@ int sp_decoding_connect(DecodingContext *dec, DemuxingContext *mux,
                         int stream_id, char *stream_desc)
 {
     int err;
-    int idx = -1;
-
-    if (stream_id >= 0) {
-has_stream_id:
-        idx = stream_id;
-        if (stream_id > (mux->avf->nb_streams - 1)) {
-            sp_log(dec, SP_LOG_ERROR, "Invalid stream ID %i, demuxer only has %i streams!\n",
-                   stream_id, mux->avf->nb_streams);
-            return AVERROR(EINVAL);
-        }
-    } else if (stream_desc) {
-#define FIND_STREAM(prefix_str, media_type)                                     \
-        if (!strncmp(stream_desc, prefix_str, strlen(prefix_str))) {            \
-            int cnt = 0;                                                        \
-            stream_id = strtol(stream_desc + strlen(prefix_str), NULL, 10);     \
-            for (int i = 0; i < mux->avf->nb_streams; i++) {                    \
-                if (mux->avf->streams[i]->codecpar->codec_type == media_type) { \
-                    if (stream_id == cnt) {                                     \
-                        stream_id = i;                                          \
-                        goto has_stream_id;                                     \
-                    }                                                           \
-                    cnt++;                                                      \
-                }                                                               \
-            }                                                                   \
-            goto has_stream_id;                                                 \
-        }
-
-        FIND_STREAM("video=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("vid=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("audio=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("aid=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("subtitle=", AVMEDIA_TYPE_VIDEO)
-        FIND_STREAM("sub=", AVMEDIA_TYPE_VIDEO)
-
-        for (int i = 0; i < mux->avf->nb_streams; i++) {
-            AVDictionaryEntry *d = av_dict_get(mux->avf->streams[i]->metadata, "title", NULL, 0);
-            if (!d)
-                continue;
-            if (!strcmp(d->value, stream_desc)) {
-                stream_id = i;
-                break;
-            }
-        }
-
-        sp_log(dec, SP_LOG_ERROR, "Unable to find stream with title \"%s\"\n",
-               stream_desc);
-        return AVERROR(EINVAL);
-    } else if (mux->avf->nb_streams == 1) {
-        idx = 0;
-    } else {
-        sp_log(dec, SP_LOG_ERROR, "No stream ID or description specified for searching!\n");
-        return AVERROR(EINVAL);
-    }
+    int idx = sp_demuxer_find_stream(mux, dec, stream_id, stream_desc);
+    if (idx < 0)
+        return idx;
 
     AVStream *st = mux->avf->streams[idx];
 
@@ -119,9 +69,11 @@ has_stream_id:
            sp_class_get_name(dec),
            dec->avctx->time_base.num, dec->avctx->time_base.den);
 
-    dec->src_packets = av_buffer_ref(mux->dst_packets[idx]);
+    AVBufferRef *src_fifo = sp_demuxer_enable_stream(mux, idx);
+    if (!src_fifo)
+        return AVERROR(ENOMEM);
 
-    return 0;
+    return sp_packet_fifo_mirror(dec->src_packets, src_fifo);
 }
 
 static void *decoding_thread(void *arg)
@@ -145,6 +97,16 @@ static void *decoding_thread(void *arg)
             flush = !packet;
         }
 
+        /* The demuxer seeked, drop any frames still delayed from before it,
+         * and restart timestamps from the new in-point */
+        if (packet && packet->opaque_ref) {
+            PacketExtraData *pe = (PacketExtraData *)packet->opaque_ref->data;
+            sp_log(ctx, SP_LOG_DEBUG, "Seek, flushing decoder\n");
+            avcodec_flush_buffers(ctx->avctx);
+            ctx->discard_pts = pe->in_point;
+            ctx->start_pts = 0;
+        }
+
         /* Give packet */
         ret = avcodec_send_packet(ctx->avctx, packet);
         av_packet_free(&packet);
@@ -174,6 +136,15 @@ static void *decoding_thread(void *arg)
                 goto fail;
             }
 
+            if (ctx->discard_pts != AV_NOPTS_VALUE &&
+                out_frame->pts != AV_NOPTS_VALUE &&
+                out_frame->pts < ctx->discard_pts) {
+                sp_log(ctx, SP_LOG_TRACE, "Discarding frame before in-point, pts = %f\n",
+                       av_q2d(ctx->avctx->time_base) * out_frame->pts);
+                av_frame_free(&out_frame);
+                continue;
+            }
+
             if (!ctx->start_pts)
                 ctx->start_pts = out_frame->pts;
 
@@ -293,7 +264,7 @@ static void decoder_free(void *opaque, uint8_t *data)
 {
     DecodingContext *ctx = (DecodingContext *)data;
 
-    sp_frame_fifo_unmirror_all(ctx->src_packets);
+    sp_packet_fifo_unmirror_all(ctx->src_packets);
     sp_frame_fifo_unmirror_all(ctx->dst_frames);
 
     if (ctx->decoding_thread) {
@@ -334,7 +305,10 @@ AVBufferRef *sp_decoder_alloc(void)
     pthread_mutex_init(&ctx->lock, NULL);
     ctx->events = sp_bufferlist_new();
 
+    ctx->src_packets = sp_packet_fifo_create(ctx, 10, PACKET_FIFO_BLOCK_MAX_OUTPUT |
+                                                      PACKET_FIFO_BLOCK_NO_INPUT);
     ctx->dst_frames = sp_frame_fifo_create(ctx, 0, 0);
+    ctx->discard_pts = AV_NOPTS_VALUE;
 
     return ctx_ref;
 }
@@ -0,0 +1,222 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+
+#include "dedup.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#define LANES 8
+#define BLOCK (LANES * 4)
+
+#define PRIME1 0x9E3779B1U
+#define PRIME2 0x85EBCA77U
+#define PRIME3 0xC2B2AE3DU
+
+/* Hashes the whole blocks of each row into the lanes */
+typedef void (*hash_rows_fn)(uint32_t acc[LANES], const uint8_t *src,
+                             ptrdiff_t stride, int len, int rows);
+
+struct SPDedup {
+    hash_rows_fn hash_rows;
+    const char *impl;
+    int row_step;
+
+    /* Last frame */
+    int valid;
+    int width, height, format;
+    uint32_t last[LANES];
+};
+
+static inline uint32_t rotl32(uint32_t v, int r)
+{
+    return (v << r) | (v >> (32 - r));
+}
+
+/* The 32-bit xxHash round, one input word per lane */
+static inline void hash_block_c(uint32_t acc[LANES], const uint8_t *src)
+{
+    for (int i = 0; i < LANES; i++) {
+        uint32_t v;
+        memcpy(&v, src + 4*i, 4);
+        acc[i] = rotl32(acc[i] + v*PRIME2, 13)*PRIME1;
+    }
+}
+
+static void hash_rows_c(uint32_t acc[LANES], const uint8_t *src,
+                        ptrdiff_t stride, int len, int rows)
+{
+    for (int y = 0; y < rows; y++, src += stride)
+        for (int x = 0; x + BLOCK <= len; x += BLOCK)
+            hash_block_c(acc, src + x);
+}
+
+#if HAVE_X86_KERNELS
+/* Same round as above, with the lanes split over two registers */
+__attribute__((target("sse4.1")))
+static void hash_rows_sse4(uint32_t acc[LANES], const uint8_t *src,
+                           ptrdiff_t stride, int len, int rows)
+{
+    const __m128i p1 = _mm_set1_epi32(PRIME1);
+    const __m128i p2 = _mm_set1_epi32(PRIME2);
+    __m128i a0 = _mm_loadu_si128((const __m128i *)&acc[0]);
+    __m128i a1 = _mm_loadu_si128((const __m128i *)&acc[4]);
+
+    for (int y = 0; y < rows; y++, src += stride) {
+        for (int x = 0; x + BLOCK <= len; x += BLOCK) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(src + x));
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(src + x + 16));
+            a0 = _mm_add_epi32(a0, _mm_mullo_epi32(v0, p2));
+            a1 = _mm_add_epi32(a1, _mm_mullo_epi32(v1, p2));
+            a0 = _mm_or_si128(_mm_slli_epi32(a0, 13), _mm_srli_epi32(a0, 19));
+            a1 = _mm_or_si128(_mm_slli_epi32(a1, 13), _mm_srli_epi32(a1, 19));
+            a0 = _mm_mullo_epi32(a0, p1);
+            a1 = _mm_mullo_epi32(a1, p1);
+        }
+    }
+
+    _mm_storeu_si128((__m128i *)&acc[0], a0);
+    _mm_storeu_si128((__m128i *)&acc[4], a1);
+}
+
+__attribute__((target("avx2")))
+static void hash_rows_avx2(uint32_t acc[LANES], const uint8_t *src,
+                           ptrdiff_t stride, int len, int rows)
+{
+    const __m256i p1 = _mm256_set1_epi32(PRIME1);
+    const __m256i p2 = _mm256_set1_epi32(PRIME2);
+    __m256i a = _mm256_loadu_si256((const __m256i *)acc);
+
+    for (int y = 0; y < rows; y++, src += stride) {
+        for (int x = 0; x + BLOCK <= len; x += BLOCK) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + x));
+            a = _mm256_add_epi32(a, _mm256_mullo_epi32(v, p2));
+            a = _mm256_or_si256(_mm256_slli_epi32(a, 13), _mm256_srli_epi32(a, 19));
+            a = _mm256_mullo_epi32(a, p1);
+        }
+    }
+
+    _mm256_storeu_si256((__m256i *)acc, a);
+}
+#endif
+
+static void hash_plane(SPDedup *d, uint32_t acc[LANES], const uint8_t *src,
+                       ptrdiff_t stride, int len, int height)
+{
+    int rows = (height + d->row_step - 1) / d->row_step;
+    int tail = len % BLOCK;
+
+    d->hash_rows(acc, src, stride * d->row_step, len, rows);
+
+    /* Partial blocks are zero-padded, with the length mixed in so that
+     * padding can't alias real zeroes */
+    if (tail) {
+        uint8_t tmp[BLOCK] = { 0 };
+        src += len - tail;
+        for (int y = 0; y < rows; y++, src += stride * d->row_step) {
+            memcpy(tmp, src, tail);
+            hash_block_c(acc, tmp);
+        }
+    }
+
+    for (int i = 0; i < LANES; i++)
+        acc[i] ^= (uint32_t)len*PRIME3;
+}
+
+int sp_dedup_check(SPDedup *d, const AVFrame *f)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(f->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM)) ||
+        f->width <= 0 || f->height <= 0) {
+        d->valid = 0;
+        return 0;
+    }
+
+    uint32_t acc[LANES];
+    for (int i = 0; i < LANES; i++)
+        acc[i] = PRIME1*(i + 1);
+
+    int nb_planes = av_pix_fmt_count_planes(f->format);
+    for (int i = 0; i < nb_planes; i++) {
+        int len = av_image_get_linesize(f->format, f->width, i);
+        int chroma = (i == 1 || i == 2) && !(desc->flags & AV_PIX_FMT_FLAG_PAL);
+        int height = chroma ? AV_CEIL_RSHIFT(f->height, desc->log2_chroma_h) : f->height;
+        if (len <= 0 || !f->data[i])
+            continue;
+        hash_plane(d, acc, f->data[i], f->linesize[i], len, height);
+    }
+
+    int dup = d->valid && d->width == f->width && d->height == f->height &&
+              d->format == f->format && !memcmp(d->last, acc, sizeof(acc));
+
+    d->valid = 1;
+    d->width = f->width;
+    d->height = f->height;
+    d->format = f->format;
+    memcpy(d->last, acc, sizeof(acc));
+
+    return dup;
+}
+
+const char *sp_dedup_impl(SPDedup *d)
+{
+    return d->impl;
+}
+
+int sp_dedup_alloc(SPDedup **d, int row_step)
+{
+    SPDedup *ctx = av_mallocz(sizeof(*ctx));
+    if (!ctx)
+        return AVERROR(ENOMEM);
+
+    ctx->row_step = FFMAX(row_step, 1);
+    ctx->hash_rows = hash_rows_c;
+    ctx->impl = "c";
+
+#if HAVE_X86_KERNELS
+    int flags = av_get_cpu_flags();
+    if (flags & AV_CPU_FLAG_AVX2) {
+        ctx->hash_rows = hash_rows_avx2;
+        ctx->impl = "avx2";
+    } else if (flags & AV_CPU_FLAG_SSE4) {
+        ctx->hash_rows = hash_rows_sse4;
+        ctx->impl = "sse4";
+    }
+#endif
+
+    *d = ctx;
+
+    return 0;
+}
+
+void sp_dedup_free(SPDedup **d)
+{
+    av_freep(d);
+}
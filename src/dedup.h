@@ -0,0 +1,38 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <libavutil/frame.h>
+
+/* Detects frames whose contents are identical to the previous frame, by
+ * hashing every plane with a vectorised, xxHash-style 8-lane hash. */
+typedef struct SPDedup SPDedup;
+
+/* Only every row_step-th row is hashed. Steps above 1 are cheaper, but
+ * can miss changes which only touch the skipped rows. */
+int sp_dedup_alloc(SPDedup **d, int row_step);
+
+/* Returns 1 if the frame has the same contents, size and format as the last
+ * frame given, 0 otherwise. Hardware frames are never duplicates. */
+int sp_dedup_check(SPDedup *d, const AVFrame *f);
+
+/* Name of the kernel in use */
+const char *sp_dedup_impl(SPDedup *d);
+
+void sp_dedup_free(SPDedup **d);
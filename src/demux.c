@@ -25,29 +25,254 @@
 #include "utils.h"
 #include "ctrl_template.h"
 #include "os_compat.h"
+#include "avio_async.h"
+
+/* How far past the out-point the demuxer reads before ending streams which
+ * had no packet beyond it, in AV_TIME_BASE. Covers interleaving. */
+#define OUT_POINT_SLACK (1 * AV_TIME_BASE)
+
+/* Must be called with the lock held */
+static void update_discard(DemuxingContext *ctx)
+{
+    for (int i = 0; i < ctx->avf->nb_streams; i++) {
+        AVStream *st = ctx->avf->streams[i];
+        enum AVDiscard discard = ctx->dst_packets[i] ? AVDISCARD_DEFAULT :
+                                                       AVDISCARD_ALL;
+        if (st->discard != discard)
+            sp_log(ctx, SP_LOG_VERBOSE, "%s stream %i\n",
+                   discard == AVDISCARD_ALL ? "Discarding unlinked" : "Enabling", i);
+        st->discard = discard;
+    }
+    ctx->streams_changed = 0;
+}
+
+static void pace_packet(DemuxingContext *ctx, AVPacket *pkt)
+{
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts == AV_NOPTS_VALUE)
+        return;
+
+    pthread_mutex_lock(&ctx->lock);
+    double speed = ctx->speed;
+    int64_t burst = ctx->burst;
+    int64_t max_lag = ctx->max_lag;
+    int catchup_rebase = ctx->catchup_rebase;
+    pthread_mutex_unlock(&ctx->lock);
+
+    ts = av_rescale_q(ts, pkt->time_base, AV_TIME_BASE_Q);
+
+    int64_t now = av_gettime_relative();
+    if (ctx->pace_base_ts == AV_NOPTS_VALUE) {
+        ctx->pace_base_ts = ts;
+        /* Don't burst out everything between the epoch and the first read */
+        ctx->pace_base_time = FFMAX(ctx->epoch, now);
+    }
+
+    int64_t target = ctx->pace_base_time +
+                     (int64_t)((ts - ctx->pace_base_ts - burst) / speed);
+    int64_t lag = now - target;
+
+    if (lag > max_lag && catchup_rebase && (ts - ctx->pace_base_ts) > burst) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Lagging by %.3f s, rebasing timeline\n",
+               lag / (double)AV_TIME_BASE);
+        ctx->pace_base_time += lag;
+        return;
+    }
+
+    if (target > now) {
+        sp_log(ctx, SP_LOG_TRACE, "Pacing, sleeping for %.3f ms\n",
+               (target - now) / 1000.0f);
+        av_usleep(target - now);
+    }
+}
+
+int sp_demuxer_seek(DemuxingContext *ctx, int64_t ts)
+{
+    int64_t off = ctx->avf->start_time != AV_NOPTS_VALUE ? ctx->avf->start_time : 0;
+
+    int err = avformat_seek_file(ctx->avf, -1, INT64_MIN, ts + off, ts + off, 0);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to seek to %.3f s: %s!\n",
+               ts / (double)AV_TIME_BASE, av_err2str(err));
+        return err;
+    }
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Seeked to %.3f s\n", ts / (double)AV_TIME_BASE);
+
+    ctx->start_time = ts;
+    memset(ctx->stream_ended, 0, ctx->avf->nb_streams);
+    memset(ctx->stream_seeked, 1, ctx->avf->nb_streams);
+    ctx->pace_base_ts = AV_NOPTS_VALUE;
+
+    return 0;
+}
+
+/* Returns 1 if the packet is past the out-point and should not be output */
+static int trim_packet(DemuxingContext *ctx, AVPacket *pkt)
+{
+    int idx = pkt->stream_index;
+    int64_t off = ctx->avf->start_time != AV_NOPTS_VALUE ? ctx->avf->start_time : 0;
+    int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    if (ctx->stream_ended[idx])
+        return 1;
+
+    /* Replaces whatever in-point decoders had before, even when no packet
+     * ends up discarded */
+    if (ctx->stream_seeked[idx]) {
+        AVBufferRef *ref = av_buffer_allocz(sizeof(PacketExtraData));
+        if (ref) {
+            PacketExtraData *pe = (PacketExtraData *)ref->data;
+            pe->in_point = av_rescale_q(ctx->start_time + off, AV_TIME_BASE_Q,
+                                        pkt->time_base);
+            av_buffer_unref(&pkt->opaque_ref);
+            pkt->opaque_ref = ref;
+            ctx->stream_seeked[idx] = 0;
+        }
+    }
+
+    if (pts == AV_NOPTS_VALUE)
+        return 0;
+
+    pts = av_rescale_q(pts, pkt->time_base, AV_TIME_BASE_Q) - off;
+    dts = av_rescale_q(dts, pkt->time_base, AV_TIME_BASE_Q) - off;
+
+    /* Decoders need everything from the keyframe onwards, but will
+     * not output frames from these */
+    if (ctx->start_time != AV_NOPTS_VALUE && pts < ctx->start_time)
+        pkt->flags |= AV_PKT_FLAG_DISCARD;
+
+    if (ctx->end_time == AV_NOPTS_VALUE)
+        return 0;
+
+    /* With reordering, packets with a lower PTS may still follow. EOS only
+     * gets sent once all streams are done, as a stream-copying muxer would
+     * stop at the first one. */
+    if (dts >= ctx->end_time) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Stream %i reached the out-point\n", idx);
+        ctx->stream_ended[idx] = 1;
+    }
+
+    /* Sparse streams (e.g. subtitles) may never get a packet past the
+     * out-point, so end them once the demuxer position is well past it */
+    if (dts >= ctx->end_time + OUT_POINT_SLACK) {
+        for (int i = 0; i < ctx->avf->nb_streams; i++) {
+            if (!ctx->dst_packets[i] || ctx->stream_ended[i])
+                continue;
+            sp_log(ctx, SP_LOG_VERBOSE, "Stream %i passed the out-point\n", i);
+            ctx->stream_ended[i] = 1;
+        }
+    }
+
+    return pts >= ctx->end_time;
+}
+
+static int all_streams_ended(DemuxingContext *ctx)
+{
+    for (int i = 0; i < ctx->avf->nb_streams; i++)
+        if (ctx->dst_packets[i] && !ctx->stream_ended[i])
+            return 0;
+    return 1;
+}
+
+/* Sends EOS to every linked stream, unless a seek came in meanwhile.
+ * Returns 1 if it did, after which seeks get rejected. */
+static int send_eos(DemuxingContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->seek_req != AV_NOPTS_VALUE) {
+        pthread_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+    for (int i = 0; i < ctx->avf->nb_streams; i++)
+        if (ctx->dst_packets[i])
+            sp_packet_fifo_push(ctx->dst_packets[i], NULL);
+    ctx->eos_sent = 1;
+    pthread_mutex_unlock(&ctx->lock);
+    return 1;
+}
+
+static void send_readahead_stats(DemuxingContext *ctx, SlidingWinCtx *sctx,
+                                 int64_t *last_bytes, int64_t *last_update)
+{
+    SPAVIOReadaheadStats stats;
+    sp_avio_readahead_get_stats(ctx->readahead, &stats);
+
+    int64_t cur_time = av_gettime_relative();
+    int64_t t_delta = cur_time - *last_update;
+    if (t_delta < 100000 || stats.bytes_read == *last_bytes)
+        return;
+
+    int64_t read_rate = av_rescale((stats.bytes_read - *last_bytes) << 3, 1000000, t_delta);
+    read_rate = sp_sliding_win(sctx, read_rate, cur_time, av_make_q(1, 1000000),
+                               10000000, 1);
+    *last_bytes = stats.bytes_read;
+    *last_update = cur_time;
+
+    SPGenericData entries[] = {
+        D_TYPE("bitrate", NULL, read_rate),
+        D_TYPE("read_time", NULL, stats.read_time),
+        D_TYPE("stall_time", NULL, stats.stall_time),
+        D_TYPE("cached", NULL, stats.buffered),
+        { 0 },
+    };
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
+}
 
 static void *demuxing_thread(void *arg)
 {
     int err;
     DemuxingContext *ctx = arg;
 
+    /* Read-ahead stats */
+    SlidingWinCtx sctx_read = { 0 };
+    int64_t last_bytes = 0;
+    int64_t last_update = av_gettime_relative();
+
     sp_set_thread_name_self(sp_class_get_name(ctx));
 
     sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
 
+    /* Consumers mirror our stream FIFOs once their links run, which happens
+     * after we've signalled ON_INIT, so wait for them before reading. */
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->pending_links)
+        pthread_cond_wait(&ctx->links_cond, &ctx->lock);
+    update_discard(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (ctx->start_time != AV_NOPTS_VALUE) {
+        err = sp_demuxer_seek(ctx, ctx->start_time);
+        if (err < 0)
+            goto end;
+    }
+
     sp_log(ctx, SP_LOG_VERBOSE, "Demuxer initialized!\n");
 
     while (1) {
+        AVBufferRef *fifo;
         AVPacket *out_packet = av_packet_alloc();
 
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->streams_changed)
+            update_discard(ctx);
+        int64_t seek_req = ctx->seek_req;
+        ctx->seek_req = AV_NOPTS_VALUE;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (seek_req != AV_NOPTS_VALUE)
+            sp_demuxer_seek(ctx, seek_req);
+
         err = av_read_frame(ctx->avf, out_packet);
         if (err == AVERROR_EOF) {
-            for (int i = 0; i < ctx->avf->nb_streams; i++)
-                sp_packet_fifo_push(ctx->dst_packets[i], NULL);
+            av_packet_free(&out_packet);
+            if (!send_eos(ctx))
+                continue;
 
             sp_log(ctx, SP_LOG_VERBOSE, "Stream EOF, FIFOs flushed!\n");
             err = 0;
-            av_packet_free(&out_packet);
             break;
         } else if (err < 0) {
             sp_log(ctx, SP_LOG_ERROR, "Failed to read packet: %s\n", av_err2str(err));
@@ -55,14 +280,43 @@ static void *demuxing_thread(void *arg)
             goto fail;
         }
 
+        /* Some demuxers ignore the discard flags */
+        pthread_mutex_lock(&ctx->lock);
+        fifo = ctx->dst_packets[out_packet->stream_index];
+        pthread_mutex_unlock(&ctx->lock);
+        if (!fifo) {
+            av_packet_free(&out_packet);
+            continue;
+        }
+
+        out_packet->opaque = (void *)(intptr_t)sp_class_get_id(ctx);
+        out_packet->time_base = ctx->avf->streams[out_packet->stream_index]->time_base;
+
+        if (trim_packet(ctx, out_packet)) {
+            av_packet_free(&out_packet);
+            if (all_streams_ended(ctx) && send_eos(ctx)) {
+                sp_log(ctx, SP_LOG_VERBOSE, "All streams reached the out-point!\n");
+                err = 0;
+                break;
+            }
+            continue;
+        }
+
+        if (ctx->realtime)
+            pace_packet(ctx, out_packet);
+
         sp_log(ctx, SP_LOG_TRACE, "Sending packet from stream %i\n", out_packet->stream_index);
-        sp_packet_fifo_push(ctx->dst_packets[out_packet->stream_index], out_packet);
+        sp_packet_fifo_push(fifo, out_packet);
+
+        if (ctx->readahead)
+            send_readahead_stats(ctx, &sctx_read, &last_bytes, &last_update);
 
         sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
 
         av_packet_free(&out_packet);
     }
 
+end:
     sp_event_send_eos_packets(ctx, ctx->events,
                               ctx->dst_packets, ctx->avf->nb_streams,
                               err);
@@ -84,7 +338,66 @@ static int demuxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
     } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
         pthread_join(ctx->demuxing_thread, NULL);
     } else if (event->ctrl & SP_EVENT_CTRL_OPTS) {
-
+        pthread_mutex_lock(&ctx->lock);
+        const char *tmp_val = NULL;
+        if ((tmp_val = dict_get(event->opts, "start_time")))
+            ctx->start_time = strtod(tmp_val, NULL) * AV_TIME_BASE;
+        if ((tmp_val = dict_get(event->opts, "end_time")))
+            ctx->end_time = strtod(tmp_val, NULL) * AV_TIME_BASE;
+        if ((tmp_val = dict_get(event->opts, "realtime")))
+            ctx->realtime = !strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0;
+        if ((tmp_val = dict_get(event->opts, "speed"))) {
+            double speed = strtod(tmp_val, NULL);
+            if (speed <= 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid speed \"%s\"!\n", tmp_val);
+            else
+                ctx->speed = speed;
+        }
+        if ((tmp_val = dict_get(event->opts, "burst"))) {
+            double burst = strtod(tmp_val, NULL);
+            if (burst < 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid burst duration \"%s\"!\n", tmp_val);
+            else
+                ctx->burst = burst * AV_TIME_BASE;
+        }
+        if ((tmp_val = dict_get(event->opts, "max_lag"))) {
+            double max_lag = strtod(tmp_val, NULL);
+            if (max_lag < 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid max lag \"%s\"!\n", tmp_val);
+            else
+                ctx->max_lag = max_lag * AV_TIME_BASE;
+        }
+        if ((tmp_val = dict_get(event->opts, "catchup"))) {
+            if (!strcmp(tmp_val, "burst"))
+                ctx->catchup_rebase = 0;
+            else if (!strcmp(tmp_val, "rebase"))
+                ctx->catchup_rebase = 1;
+            else
+                sp_log(ctx, SP_LOG_ERROR, "Invalid catchup mode \"%s\"!\n", tmp_val);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    } else if (event->ctrl & SP_EVENT_CTRL_COMMAND) {
+        const char *command = dict_get(event->cmd, "command");
+
+        /* Seeks are done by the demuxing thread before its next read */
+        if (command && !strcmp(command, "seek")) {
+            const char *time_str = dict_get(event->cmd, "time");
+            if (!time_str) {
+                sp_log(ctx, SP_LOG_ERROR, "No time specified to seek to!\n");
+                return AVERROR(EINVAL);
+            }
+            pthread_mutex_lock(&ctx->lock);
+            if (ctx->eos_sent) {
+                pthread_mutex_unlock(&ctx->lock);
+                sp_log(ctx, SP_LOG_ERROR, "Cannot seek, all streams have ended!\n");
+                return AVERROR(EINVAL);
+            }
+            ctx->seek_req = strtod(time_str, NULL) * AV_TIME_BASE;
+            pthread_mutex_unlock(&ctx->lock);
+        } else {
+            sp_log(ctx, SP_LOG_WARN, "Got unknown command %s\n",
+                   command ? command : "(none)");
+        }
     } else if (event->ctrl & SP_EVENT_CTRL_FLUSH) {
         sp_log(ctx, SP_LOG_VERBOSE, "Flushing buffer\n");
         pthread_mutex_lock(&ctx->lock);
@@ -100,7 +413,99 @@ static int demuxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
 int sp_demuxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
 {
     DemuxingContext *ctx = (DemuxingContext *)ctx_ref->data;
-    return sp_ctrl_template(ctx, ctx->events, 0x0, demuxer_ioctx_ctrl_cb, ctrl, arg);
+    return sp_ctrl_template(ctx, ctx->events, SP_EVENT_CTRL_COMMAND,
+                            demuxer_ioctx_ctrl_cb, ctrl, arg);
+}
+
+int sp_demuxer_find_stream(DemuxingContext *ctx, void *log_ctx,
+                           int stream_id, const char *stream_desc)
+{
+    if (stream_id >= 0) {
+        if (stream_id > (ctx->avf->nb_streams - 1)) {
+            sp_log(log_ctx, SP_LOG_ERROR, "Invalid stream ID %i, demuxer only has %i streams!\n",
+                   stream_id, ctx->avf->nb_streams);
+            return AVERROR(EINVAL);
+        }
+        return stream_id;
+    } else if (stream_desc) {
+#define FIND_STREAM(prefix_str, media_type)                                     \
+        if (!strncmp(stream_desc, prefix_str, strlen(prefix_str))) {            \
+            int cnt = 0;                                                        \
+            int nb = strtol(stream_desc + strlen(prefix_str), NULL, 10);        \
+            for (int i = 0; i < ctx->avf->nb_streams; i++) {                    \
+                if (ctx->avf->streams[i]->codecpar->codec_type == media_type) { \
+                    if (nb == cnt)                                              \
+                        return i;                                               \
+                    cnt++;                                                      \
+                }                                                               \
+            }                                                                   \
+            sp_log(log_ctx, SP_LOG_ERROR, "Unable to find stream \"%s\"!\n",    \
+                   stream_desc);                                                \
+            return AVERROR(EINVAL);                                             \
+        }
+
+        FIND_STREAM("video=", AVMEDIA_TYPE_VIDEO)
+        FIND_STREAM("vid=", AVMEDIA_TYPE_VIDEO)
+        FIND_STREAM("audio=", AVMEDIA_TYPE_AUDIO)
+        FIND_STREAM("aid=", AVMEDIA_TYPE_AUDIO)
+        FIND_STREAM("subtitle=", AVMEDIA_TYPE_SUBTITLE)
+        FIND_STREAM("sub=", AVMEDIA_TYPE_SUBTITLE)
+
+#undef FIND_STREAM
+
+        for (int i = 0; i < ctx->avf->nb_streams; i++) {
+            AVDictionaryEntry *d = av_dict_get(ctx->avf->streams[i]->metadata, "title", NULL, 0);
+            if (d && !strcmp(d->value, stream_desc))
+                return i;
+        }
+
+        sp_log(log_ctx, SP_LOG_ERROR, "Unable to find stream with title \"%s\"\n",
+               stream_desc);
+        return AVERROR(EINVAL);
+    } else if (ctx->avf->nb_streams == 1) {
+        return 0;
+    }
+
+    sp_log(log_ctx, SP_LOG_ERROR, "No stream ID or description specified for searching!\n");
+    return AVERROR(EINVAL);
+}
+
+AVBufferRef *sp_demuxer_enable_stream(DemuxingContext *ctx, int idx)
+{
+    AVBufferRef *fifo;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    /* Pass-through, decoders and muxers mirror these with their own FIFOs */
+    if (!ctx->dst_packets[idx]) {
+        ctx->dst_packets[idx] = sp_packet_fifo_create(ctx, 0, 0);
+        ctx->streams_changed = 1;
+    }
+    fifo = ctx->dst_packets[idx];
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (!fifo)
+        sp_log(ctx, SP_LOG_ERROR, "Unable to allocate FIFO for stream %i!\n", idx);
+
+    return fifo;
+}
+
+void sp_demuxer_add_pending_link(DemuxingContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->pending_links++;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void sp_demuxer_pending_link_done(DemuxingContext *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->pending_links--;
+    sp_assert(ctx->pending_links >= 0);
+    if (!ctx->pending_links)
+        pthread_cond_broadcast(&ctx->links_cond);
+    pthread_mutex_unlock(&ctx->lock);
 }
 
 int sp_demuxer_init(AVBufferRef *ctx_ref)
@@ -119,10 +524,29 @@ int sp_demuxer_init(AVBufferRef *ctx_ref)
             ctx->in_format = "dash";
     }
 
+    if (ctx->readahead_size > 0 && !strstr(ctx->in_url, "://")) {
+        AVIOContext *pb = NULL;
+        err = sp_avio_readahead_open(&ctx->readahead, &pb, ctx, ctx->in_url,
+                                     ctx->readahead_size);
+        if (err >= 0) {
+            ctx->avf = avformat_alloc_context();
+            if (!ctx->avf) {
+                sp_avio_readahead_close(&ctx->readahead);
+                return AVERROR(ENOMEM);
+            }
+            ctx->avf->pb = pb;
+        } else if (err != AVERROR(ENOTSUP)) {
+            sp_log(ctx, SP_LOG_WARN, "Unable to open read-ahead I/O: %s, "
+                   "falling back to lavf I/O\n", av_err2str(err));
+        }
+    }
+
     err = avformat_open_input(&ctx->avf, ctx->in_url, NULL, &ctx->start_options);
     if (err < 0) {
         sp_log(ctx, SP_LOG_ERROR, "Couldn't initialize demuxer: %s!\n", av_err2str(err));
-        goto fail;
+        /* lavf frees the context on failure, but not custom I/O */
+        sp_avio_readahead_close(&ctx->readahead);
+        return err;
     }
 
     if (!ctx->name) {
@@ -148,9 +572,14 @@ int sp_demuxer_init(AVBufferRef *ctx_ref)
         goto fail;
     }
 
-    ctx->dst_packets = av_mallocz(ctx->avf->nb_streams*sizeof(ctx->dst_packets));
-    for (int i = 0; i < ctx->avf->nb_streams; i++)
-        ctx->dst_packets[i] = sp_packet_fifo_create(ctx, 10, PACKET_FIFO_BLOCK_MAX_OUTPUT | PACKET_FIFO_BLOCK_NO_INPUT);
+    /* FIFOs are created once a stream gets linked */
+    ctx->dst_packets = av_mallocz(ctx->avf->nb_streams*sizeof(*ctx->dst_packets));
+    ctx->stream_ended = av_mallocz(ctx->avf->nb_streams);
+    ctx->stream_seeked = av_mallocz(ctx->avf->nb_streams);
+    if (!ctx->dst_packets || !ctx->stream_ended || !ctx->stream_seeked) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
 
     /* Both fields alive for the duration of the avf context */
     ctx->in_format = ctx->avf->iformat->name;
@@ -159,7 +588,8 @@ int sp_demuxer_init(AVBufferRef *ctx_ref)
     return 0;
 
 fail:
-    avformat_free_context(ctx->avf);
+    avformat_close_input(&ctx->avf);
+    sp_avio_readahead_close(&ctx->readahead);
     return err;
 }
 
@@ -170,17 +600,21 @@ static void demuxer_free(void *opaque, uint8_t *data)
     if (ctx->demuxing_thread)
         pthread_join(ctx->demuxing_thread, NULL);
 
-    for (int i = 0; i < ctx->avf->nb_streams; i++)
+    for (int i = 0; ctx->avf && ctx->dst_packets && i < ctx->avf->nb_streams; i++)
         av_buffer_unref(&ctx->dst_packets[i]);
 
     sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_DESTROY, NULL);
     sp_bufferlist_free(&ctx->events);
 
     avformat_close_input(&ctx->avf);
+    sp_avio_readahead_close(&ctx->readahead);
 
+    pthread_cond_destroy(&ctx->links_cond);
     pthread_mutex_destroy(&ctx->lock);
 
     av_free(ctx->dst_packets);
+    av_free(ctx->stream_ended);
+    av_free(ctx->stream_seeked);
 
     sp_log(ctx, SP_LOG_VERBOSE, "Demuxer destroyed!\n");
     sp_class_free(ctx);
@@ -203,7 +637,15 @@ AVBufferRef *sp_demuxer_alloc(void)
     }
 
     pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->links_cond, NULL);
     ctx->events = sp_bufferlist_new();
 
+    ctx->speed = 1.0;
+    ctx->max_lag = AV_TIME_BASE / 2;
+    ctx->pace_base_ts = AV_NOPTS_VALUE;
+    ctx->start_time = AV_NOPTS_VALUE;
+    ctx->end_time = AV_NOPTS_VALUE;
+    ctx->seek_req = AV_NOPTS_VALUE;
+
     return ctx_ref;
 }
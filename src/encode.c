@@ -16,15 +16,19 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <math.h>
+
 #include <libavutil/avstring.h>
 #include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/cpu.h>
+#include <libavutil/time.h>
 
 #include <libtxproto/encode.h>
 #include <libtxproto/log.h>
 
 #include "encoding_utils.h"
+#include "dedup.h"
 #include "os_compat.h"
 #include <libtxproto/utils.h>
 #include "utils.h"
@@ -479,6 +483,18 @@ static int video_process_frame(EncodingContext *ctx, AVFrame **input)
 
     }
 
+    /* Force keyframes on a fixed grid so that segments can be cut at the
+     * same times on every output */
+    if (ctx->keyframe_interval > 0.0 && in_f->pts != AV_NOPTS_VALUE) {
+        AVRational tb = in_f->time_base.num ? in_f->time_base : ctx->avctx->time_base;
+        double t = in_f->pts * av_q2d(tb);
+        if (t >= ctx->next_keyframe_time) {
+            in_f->pict_type = AV_PICTURE_TYPE_I;
+            ctx->next_keyframe_time = (floor(t / ctx->keyframe_interval) + 1) *
+                                      ctx->keyframe_interval;
+        }
+    }
+
     *input = in_f;
 
     return 0;
@@ -582,6 +598,45 @@ static int video_config_changed(const EncodingContext *ctx, const AVFrame *frame
            (ctx->rotation != fe->rotation);
 }
 
+/* Returns 1 if the frame only repeats the last one and should be dropped */
+static int drop_duplicate(EncodingContext *ctx, AVFrame *frame)
+{
+    if (ctx->codec->type != AVMEDIA_TYPE_VIDEO)
+        return 0;
+
+    int dup = sp_dedup_check(ctx->dedup, frame);
+
+    double t = NAN;
+    if (frame->pts != AV_NOPTS_VALUE) {
+        AVRational tb = frame->time_base.num ? frame->time_base : ctx->avctx->time_base;
+        t = frame->pts * av_q2d(tb);
+    }
+
+    if (dup && ctx->dedup_max_gap > 0.0 && !isnan(t) &&
+        (t - ctx->dedup_last_time) >= ctx->dedup_max_gap)
+        dup = 0;
+
+    if (!dup) {
+        ctx->dedup_last_time = t;
+        return 0;
+    }
+
+    ctx->dedup_dropped++;
+    sp_log(ctx, SP_LOG_TRACE, "Dropping duplicate frame, pts = %f\n", t);
+
+    int64_t now = av_gettime_relative();
+    if ((now - ctx->dedup_last_stats) >= 1000000) {
+        SPGenericData entries[] = {
+            D_TYPE("dropped_duplicates", NULL, ctx->dedup_dropped),
+            { 0 },
+        };
+        sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
+        ctx->dedup_last_stats = now;
+    }
+
+    return 1;
+}
+
 static void *encoding_thread(void *arg)
 {
     EncodingContext *ctx = arg;
@@ -620,6 +675,12 @@ static void *encoding_thread(void *arg)
         } else if (!flush) {
             frame = sp_frame_fifo_pop(ctx->src_frames);
             flush = !frame;
+
+            if (frame && ctx->dedup && drop_duplicate(ctx, frame)) {
+                av_frame_free(&frame);
+                pthread_mutex_unlock(&ctx->lock);
+                continue;
+            }
         }
 
         if (ctx->codec->type == AVMEDIA_TYPE_VIDEO) {
@@ -779,6 +840,43 @@ static int encoder_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
             else
                 sp_packet_fifo_set_max_queued(ctx->src_frames, len);
         }
+        if ((tmp_val = dict_get(event->opts, "keyframe_interval"))) {
+            double interval = strtod(tmp_val, NULL);
+            if (interval < 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid keyframe interval \"%s\"!\n", tmp_val);
+            else
+                ctx->keyframe_interval = interval;
+        }
+        if ((tmp_val = dict_get(event->opts, "dedup_step"))) {
+            long int step = strtol(tmp_val, NULL, 10);
+            if (step < 1)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid dedup step \"%s\"!\n", tmp_val);
+            else
+                ctx->dedup_step = step;
+        }
+        if ((tmp_val = dict_get(event->opts, "dedup_max_gap"))) {
+            double gap = strtod(tmp_val, NULL);
+            if (gap < 0.0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid dedup max gap \"%s\"!\n", tmp_val);
+            else
+                ctx->dedup_max_gap = gap;
+        }
+        if ((tmp_val = dict_get(event->opts, "dedup"))) {
+            if (ctx->encoding_thread) {
+                sp_log(ctx, SP_LOG_ERROR, "Dedup mode can only be set before starting!\n");
+            } else if (!strcmp(tmp_val, "drop")) {
+                sp_dedup_free(&ctx->dedup);
+                int err = sp_dedup_alloc(&ctx->dedup, ctx->dedup_step);
+                if (err < 0)
+                    return err;
+                sp_log(ctx, SP_LOG_VERBOSE, "Dropping duplicate frames, hash: %s\n",
+                       sp_dedup_impl(ctx->dedup));
+            } else if (!strcmp(tmp_val, "none")) {
+                sp_dedup_free(&ctx->dedup);
+            } else {
+                sp_log(ctx, SP_LOG_ERROR, "Invalid dedup mode \"%s\"!\n", tmp_val);
+            }
+        }
         if ((tmp_val = dict_get(event->opts, "fifo_flags"))) {
             enum SPFrameFIFOFlags new_block_flags = 0;
             int res = sp_frame_fifo_string_to_block_flags(&new_block_flags, tmp_val);
@@ -884,6 +982,7 @@ static void encoder_free(void *opaque, uint8_t *data)
         av_buffer_unref(&ctx->enc_frames_ref);
 
     avcodec_free_context(&ctx->avctx);
+    sp_dedup_free(&ctx->dedup);
 
     pthread_mutex_destroy(&ctx->lock);
 
@@ -914,6 +1013,9 @@ AVBufferRef *sp_encoder_alloc(void)
     ctx->events = sp_bufferlist_new();
     ctx->swr = swr_alloc();
     ctx->soft_flush = ATOMIC_VAR_INIT(0);
+    ctx->next_keyframe_time = -INFINITY;
+    ctx->dedup_step = 1;
+    ctx->dedup_last_time = -INFINITY;
 
     ctx->src_frames = sp_frame_fifo_create(ctx, 8, FRAME_FIFO_BLOCK_NO_INPUT);
     ctx->dst_packets = sp_packet_fifo_create(ctx, 0, 0);
@@ -4,11 +4,12 @@
 #include <libtxproto/events.h>
 
 #include <libtxproto/epoch.h>
+#include <libtxproto/clock.h>
+#include <libtxproto/io.h>
 
 static int epoch_event_cb(AVBufferRef *event, void *callback_ctx, void *_ctx,
                           void *dep_ctx, void *data)
 {
-    int err = 0;
     TXMainContext *ctx = _ctx;
     EpochEventCtx *epoch_ctx = callback_ctx;
 
@@ -21,8 +22,8 @@ static int epoch_event_cb(AVBufferRef *event, void *callback_ctx, void *_ctx,
         val = 0;
         break;
     case EP_MODE_SOURCE:
-        sp_log(ctx, SP_LOG_ERROR, "Warning epoch mode source, using epoch of system!\n");
-        val = 0;
+        /* Only used until the master's first timestamp replaces it */
+        val = av_gettime_relative();
         break;
     case EP_MODE_EXTERNAL:
         val = (*epoch_ctx->external_cb)(av_gettime_relative(), epoch_ctx->external_arg);
@@ -31,7 +32,14 @@ static int epoch_event_cb(AVBufferRef *event, void *callback_ctx, void *_ctx,
 
     atomic_store(&ctx->epoch_value, val);
 
-    return err;
+    /* Components pick the clock up whenever it's published */
+    AVBufferRef *clock = NULL;
+    if (epoch_ctx->mode == EP_MODE_SOURCE) {
+        clock = epoch_ctx->src_ref;
+        sp_clock_activate(clock, &ctx->epoch_value);
+    }
+
+    return sp_clock_slot_set(&ctx->epoch_clock, clock);
 }
 
 static void epoch_event_free(void *callback_ctx, void *_ctx, void *dep_ctx)
@@ -60,7 +68,13 @@ int sp_epoch_event_set_source(AVBufferRef *epoch_event,
 {
     EpochEventCtx *epoch_ctx = av_buffer_get_opaque(epoch_event);
 
+    /* I/O entries which can be a master hand out their clock */
     enum SPType type = sp_class_get_type(obj->data);
+    if ((type & SP_TYPE_INOUT) && ((IOSysEntry *)obj->data)->clock) {
+        obj = ((IOSysEntry *)obj->data)->clock;
+        type = sp_class_get_type(obj->data);
+    }
+
     if (type != SP_TYPE_CLOCK_SOURCE)
         return AVERROR(EINVAL);
 
@@ -30,6 +30,8 @@ typedef struct SNAME {
 
     SPBufferList *dests;
     SPBufferList *sources;
+
+    SPFIFONotify *notify;
 } SNAME;
 
 static AVBufferRef *find_ref_by_data(AVBufferRef *entry, void *opaque)
@@ -206,6 +208,14 @@ void RENAME(fifo_set_block_flags)(AVBufferRef *dst, FNAME block_flags)
     pthread_mutex_unlock(&ctx->lock);
 }
 
+void RENAME(fifo_set_notify)(AVBufferRef *dst, SPFIFONotify *notify)
+{
+    SNAME *ctx = (SNAME *)dst->data;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->notify = notify;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
 // convert a lowercase, comma-separated list of block flags to actual flags
 int RENAME(fifo_string_to_block_flags)(FNAME *dst, const char *in_str)
 {
@@ -271,6 +281,9 @@ int RENAME(fifo_push)(AVBufferRef *dst, TYPE *in)
 
     pthread_cond_signal(&ctx->cond_in);
 
+    if (ctx->notify)
+        sp_fifo_notify_signal(ctx->notify);
+
 distribute:
     while ((dist = sp_bufferlist_iter_ref(ctx->dests))) {
         int ret = RENAME(fifo_push)(dist, in);
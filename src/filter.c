@@ -16,10 +16,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <math.h>
 #include <stdatomic.h>
 
 #include <libavutil/time.h>
 #include <libavutil/avstring.h>
+#include <libavutil/samplefmt.h>
 #include <libavfilter/buffersink.h>
 
 #include <libtxproto/filter.h>
@@ -169,6 +171,10 @@ static void add_pad(FilterContext *ctx, int is_out, int index,
         }
 
         pad->fifo = is_out ? sp_frame_fifo_create(ctx, 0, 0) : sp_frame_fifo_create(ctx, 8, FRAME_FIFO_BLOCK_NO_INPUT);
+        if (!is_out) {
+            sp_frame_fifo_set_notify(pad->fifo, &ctx->in_notify);
+            pad->last_frame = av_frame_alloc();
+        }
         pad->main = ctx;
         pad->is_out = is_out;
         pad->name = av_strdup(name);
@@ -220,6 +226,9 @@ static int re_create_filtering(FilterContext *ctx, int first_init)
 {
     int err = 0;
 
+    /* add_pad() does nothing once this is set */
+    ctx->err = 0;
+
     ctx->graph = avfilter_graph_alloc();
     if (!ctx->graph) {
         sp_log(ctx, SP_LOG_ERROR, "Unable to allocate, no memory!\n");
@@ -267,8 +276,8 @@ static int re_create_filtering(FilterContext *ctx, int first_init)
     }
 
 end:
-    /* This resets the error state */
-    ctx->err = err;
+    if (err)
+        ctx->err = err;
 
     return err;
 }
@@ -354,6 +363,43 @@ static void attempt_derive_device(FilterContext *ctx, AVBufferRef *frames_ref)
     }
 }
 
+/* Keeps what's needed to configure a pad for a frame, but not its data */
+static AVFrame *frame_params(const AVFrame *src)
+{
+    AVFrame *dst = av_frame_alloc();
+    if (!dst)
+        return NULL;
+
+    dst->format      = src->format;
+    dst->width       = src->width;
+    dst->height      = src->height;
+    dst->sample_rate = src->sample_rate;
+
+    if (av_frame_copy_props(dst, src) < 0 ||
+        av_channel_layout_copy(&dst->ch_layout, &src->ch_layout) < 0 ||
+        (src->hw_frames_ctx && !(dst->hw_frames_ctx = av_buffer_ref(src->hw_frames_ctx))))
+        av_frame_free(&dst);
+
+    return dst;
+}
+
+static int frame_params_changed(enum AVMediaType type, const AVFrame *ref,
+                                const AVFrame *frame)
+{
+    if (ref->format != frame->format)
+        return 1;
+
+    if (type == AVMEDIA_TYPE_VIDEO)
+        return ref->width != frame->width || ref->height != frame->height ||
+               ref->sample_aspect_ratio.num != frame->sample_aspect_ratio.num ||
+               ref->sample_aspect_ratio.den != frame->sample_aspect_ratio.den ||
+               (ref->hw_frames_ctx ? ref->hw_frames_ctx->data : NULL) !=
+               (frame->hw_frames_ctx ? frame->hw_frames_ctx->data : NULL);
+
+    return ref->sample_rate != frame->sample_rate ||
+           av_channel_layout_compare(&ref->ch_layout, &frame->ch_layout);
+}
+
 static int init_pads(FilterContext *ctx)
 {
     int err = 0;
@@ -398,19 +444,25 @@ static int init_pads(FilterContext *ctx)
         if (pad->buffer)
             continue;
 
-        av_frame_free(&pad->in_fmt);
+        /* Rebuilds already know which format they're for */
+        if (!pad->in_fmt) {
+            sp_log(ctx, SP_LOG_VERBOSE, "Getting a frame to configure pad \"%s\"...\n",
+                   pad->name);
+            AVFrame *frame = sp_frame_fifo_peek(pad->fifo);
+            pad->in_fmt = frame_params(frame);
+            av_frame_free(&frame);
+            if (!pad->in_fmt) {
+                err = AVERROR(ENOMEM);
+                goto error;
+            }
+        }
 
-        sp_log(ctx, SP_LOG_VERBOSE, "Getting a frame to configure pad \"%s\"...\n",
-               pad->name);
-        AVFrame *in_fmt = sp_frame_fifo_peek(pad->fifo);
-        pad->in_fmt = av_frame_alloc();
-        av_frame_copy_props(pad->in_fmt, in_fmt);
+        AVFrame *in_fmt = pad->in_fmt;
 
         /* Set the filter buffer source paramters */
         AVBufferSrcParameters *params = av_buffersrc_parameters_alloc();
         if (!params) {
             err = AVERROR(ENOMEM);
-            av_frame_free(&in_fmt);
             goto error;
         }
 
@@ -435,8 +487,6 @@ static int init_pads(FilterContext *ctx)
             filter_name = "buffer";
         }
 
-        av_frame_free(&in_fmt);
-
         const AVFilter *filter = avfilter_get_by_name(filter_name);
         if (filter) {
             char name[256];
@@ -477,6 +527,319 @@ error:
     return err;
 }
 
+/* Creates the buffer sources and sinks, and configures the graph */
+static int configure_graph(FilterContext *ctx)
+{
+    int err;
+
+    if ((err = init_pads(ctx)))
+        return err;
+
+    if (!ctx->hw_device_ref && ctx->device_type != AV_HWDEVICE_TYPE_NONE) {
+        err = av_hwdevice_ctx_create(&ctx->hw_device_ref, ctx->device_type,
+                                     NULL, NULL, 0);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Could not init hardware device: %s!\n",
+                   av_err2str(err));
+            return err;
+        }
+    }
+
+    if (ctx->hw_device_ref) {
+        for (int i = 0; i < ctx->graph->nb_filters; i++) {
+            AVFilterContext *filter = ctx->graph->filters[i];
+            filter->hw_device_ctx = av_buffer_ref(ctx->hw_device_ref);
+        }
+        av_buffer_unref(&ctx->hw_device_ref);
+    }
+
+    if ((err = avfilter_graph_config(ctx->graph, NULL)) < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to configure graph: %s!\n", av_err2str(err));
+        free_graph(ctx);
+        ctx->err = err;
+        return err;
+    }
+
+    if (ctx->dump_graph) {
+        char *graph_dump = avfilter_graph_dump(ctx->graph, NULL);
+        if (graph_dump)
+            sp_log(NULL, SP_LOG_INFO, "\n%s\n", graph_dump);
+        av_free(graph_dump);
+    }
+
+    sp_log(ctx, SP_LOG_DEBUG, "Filter configured!\n");
+
+    return err;
+}
+
+/* Tracks inputs for stall detection, returns 1 if the frame must be
+ * dropped, being older than what we generated in its place */
+static int input_pad_resumed(FilterContext *ctx, FilterPad *pad, AVFrame *frame)
+{
+    if (pad->timed_out) {
+        if (pad->last_frame->pts != AV_NOPTS_VALUE &&
+            frame->pts != AV_NOPTS_VALUE && frame->pts <= pad->last_frame->pts)
+            return 1;
+
+        sp_log(ctx, SP_LOG_INFO, "Input pad \"%s\" resumed\n", pad->name);
+        pad->timed_out = 0;
+    }
+
+    av_frame_unref(pad->last_frame);
+    av_frame_ref(pad->last_frame, frame);
+    pad->deadline = av_gettime_relative() + ctx->input_timeout;
+
+    return 0;
+}
+
+/* Generates a frame following the last one of a stalled input: the same
+ * picture again for video, silence for audio */
+static AVFrame *stalled_pad_frame(FilterContext *ctx, FilterPad *pad, int64_t *duration)
+{
+    AVFrame *frame, *last = pad->last_frame;
+    FormatExtraData *fe = (FormatExtraData *)last->opaque_ref->data;
+    int64_t dur;
+
+    if (pad->type == AVMEDIA_TYPE_VIDEO) {
+        frame = av_frame_clone(last);
+        if (!frame)
+            return NULL;
+
+        if (fe->avg_frame_rate.num && fe->avg_frame_rate.den)
+            dur = av_rescale_q(1, av_inv_q(fe->avg_frame_rate), fe->time_base);
+        else
+            dur = av_rescale_q(ctx->input_timeout, AV_TIME_BASE_Q, fe->time_base);
+    } else {
+        frame = av_frame_alloc();
+        if (!frame)
+            return NULL;
+
+        frame->format = last->format;
+        frame->sample_rate = last->sample_rate;
+        frame->nb_samples = last->nb_samples;
+        if (av_channel_layout_copy(&frame->ch_layout, &last->ch_layout) < 0 ||
+            av_frame_get_buffer(frame, 0) < 0 ||
+            av_frame_copy_props(frame, last) < 0) {
+            av_frame_free(&frame);
+            return NULL;
+        }
+
+        av_samples_set_silence(frame->extended_data, 0, frame->nb_samples,
+                               frame->ch_layout.nb_channels, frame->format);
+
+        dur = av_rescale_q(frame->nb_samples, av_make_q(1, frame->sample_rate),
+                           fe->time_base);
+    }
+
+    if (last->pts != AV_NOPTS_VALUE)
+        frame->pts = last->pts + dur;
+
+    av_frame_unref(pad->last_frame);
+    if (av_frame_ref(pad->last_frame, frame) < 0) {
+        av_frame_free(&frame);
+        return NULL;
+    }
+
+    *duration = FFMAX(av_rescale_q(dur, fe->time_base, AV_TIME_BASE_Q), 1000);
+
+    return frame;
+}
+
+/* Gives frames to inputs the graph is waiting on, but which stalled.
+ * Updates next_deadline to the earliest time an input may stall. */
+static int fill_stalled_pads(FilterContext *ctx, int64_t *next_deadline)
+{
+    int ret;
+    int64_t now = av_gettime_relative();
+
+    for (int i = 0; i < ctx->num_in_pads; i++) {
+        FilterPad *pad = ctx->in_pads[i];
+
+        if (pad->eos || pad->pending_frame ||
+            !av_buffersrc_get_nb_failed_requests(pad->buffer) ||
+            sp_frame_fifo_get_size(pad->fifo))
+            continue;
+
+        if (now < pad->deadline) {
+            *next_deadline = FFMIN(*next_deadline, pad->deadline);
+            continue;
+        }
+
+        if (!pad->timed_out) {
+            sp_log(ctx, SP_LOG_WARN, "Input pad \"%s\" stalled, %s!\n", pad->name,
+                   ctx->input_timeout_eos ? "ending it" : "generating frames");
+            pad->timed_out = 1;
+        }
+
+        if (ctx->input_timeout_eos || !pad->last_frame->buf[0]) {
+            pad->eos = 1;
+            ret = av_buffersrc_add_frame_flags(pad->buffer, NULL, AV_BUFFERSRC_FLAG_PUSH);
+            if (ret < 0)
+                return ret;
+            ctx->frames_in++;
+            continue;
+        }
+
+        int64_t duration;
+        AVFrame *frame = stalled_pad_frame(ctx, pad, &duration);
+        if (!frame)
+            return AVERROR(ENOMEM);
+
+        ret = av_buffersrc_add_frame_flags(pad->buffer, frame, AV_BUFFERSRC_FLAG_PUSH);
+        av_frame_free(&frame);
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            sp_log(ctx, SP_LOG_ERROR, "Error pushing frame to input pad \"%s\": %s!\n",
+                   pad->name, av_err2str(ret));
+            return ret;
+        }
+
+        ctx->frames_in++;
+        pad->deadline = now + duration;
+        *next_deadline = FFMIN(*next_deadline, pad->deadline);
+    }
+
+    return 0;
+}
+
+typedef struct FilterRebuild {
+    FilterContext *main;
+    FilterContext shadow; /* Only what building a graph needs, with its own pads */
+    pthread_t thread;
+    atomic_int done;
+    int err;
+    int64_t t_start;
+} FilterRebuild;
+
+static void free_rebuild(FilterRebuild **rebuild)
+{
+    FilterRebuild *rb = *rebuild;
+    if (!rb)
+        return;
+
+    FilterContext *shadow = &rb->shadow;
+    avfilter_graph_free(&shadow->graph);
+    for (int i = 0; i < shadow->num_in_pads; i++) {
+        if (shadow->in_pads[i])
+            av_frame_free(&shadow->in_pads[i]->in_fmt);
+        av_free(shadow->in_pads[i]);
+    }
+    for (int i = 0; i < shadow->num_out_pads; i++)
+        av_free(shadow->out_pads[i]);
+    av_free(shadow->in_pads);
+    av_free(shadow->out_pads);
+    av_buffer_unref(&shadow->hw_device_ref);
+    pthread_mutex_destroy(&shadow->lock);
+
+    av_freep(rebuild);
+}
+
+static void *rebuild_thread(void *arg)
+{
+    FilterRebuild *rb = arg;
+
+    sp_set_thread_name_self("filter_rebuild");
+
+    rb->err = re_create_filtering(&rb->shadow, 0);
+
+    /* add_pad() only flags its errors, leaving the pad without a filter */
+    if (rb->err >= 0 && rb->shadow.err < 0)
+        rb->err = rb->shadow.err;
+
+    if (rb->err >= 0)
+        rb->err = configure_graph(&rb->shadow);
+
+    atomic_store(&rb->done, 1);
+    sp_fifo_notify_signal(&rb->main->in_notify);
+
+    return NULL;
+}
+
+/* Builds a graph for the current input formats on a separate thread, while
+ * the filtering thread keeps running the old one. The graph is built on a
+ * separate context, holding only the options and copies of the pads, so the
+ * two never share any state but immutable options. */
+static int start_rebuild(FilterContext *ctx)
+{
+    int err = AVERROR(ENOMEM);
+    FilterRebuild *rb = av_mallocz(sizeof(*rb));
+    if (!rb)
+        return err;
+
+    rb->main = ctx;
+
+    FilterContext *shadow = &rb->shadow;
+    pthread_mutex_init(&shadow->lock, NULL);
+    shadow->class              = ctx->class;
+    shadow->in_pad_names       = ctx->in_pad_names;
+    shadow->out_pad_names      = ctx->out_pad_names;
+    shadow->dump_graph         = ctx->dump_graph;
+    shadow->device_type        = ctx->device_type;
+    shadow->graph_str          = ctx->graph_str;
+    shadow->direct_filter_opts = ctx->direct_filter_opts;
+    shadow->direct_filter_fmt  = ctx->direct_filter_fmt;
+    shadow->graph_opts         = ctx->graph_opts;
+    shadow->direct_filter      = ctx->direct_filter;
+    shadow->num_in_pads        = ctx->num_in_pads;
+    shadow->num_out_pads       = ctx->num_out_pads;
+    shadow->in_pads = av_calloc(ctx->num_in_pads, sizeof(*shadow->in_pads));
+    shadow->out_pads = av_calloc(ctx->num_out_pads, sizeof(*shadow->out_pads));
+    if (!shadow->in_pads || !shadow->out_pads) {
+        shadow->num_in_pads = shadow->num_out_pads = 0;
+        goto fail;
+    }
+
+    for (int i = 0; i < ctx->num_in_pads; i++) {
+        FilterPad *pad = ctx->in_pads[i];
+        FilterPad *copy = shadow->in_pads[i] = av_malloc(sizeof(*copy));
+        if (!copy)
+            goto fail;
+
+        *copy = *pad;
+        copy->main = shadow;
+        copy->buffer = copy->filter = NULL;
+        copy->filter_pad = -1;
+        copy->in_fmt = frame_params(pad->pending_frame ? pad->pending_frame : pad->in_fmt);
+        if (!copy->in_fmt)
+            goto fail;
+    }
+
+    for (int i = 0; i < ctx->num_out_pads; i++) {
+        FilterPad *pad = ctx->out_pads[i];
+        FilterPad *copy = shadow->out_pads[i] = av_malloc(sizeof(*copy));
+        if (!copy)
+            goto fail;
+
+        *copy = *pad;
+        copy->main = shadow;
+        copy->buffer = copy->filter = NULL;
+        copy->filter_pad = -1;
+        copy->in_fmt = NULL;
+    }
+
+    rb->t_start = av_gettime_relative();
+
+    err = AVERROR(pthread_create(&rb->thread, NULL, rebuild_thread, rb));
+    if (err < 0)
+        goto fail;
+
+    ctx->rebuild = rb;
+
+    return 0;
+
+fail:
+    free_rebuild(&rb);
+    return err;
+}
+
+static void cancel_rebuild(FilterContext *ctx)
+{
+    if (!ctx->rebuild)
+        return;
+
+    pthread_join(ctx->rebuild->thread, NULL);
+    free_rebuild(&ctx->rebuild);
+}
+
 static int push_input_pads(FilterContext *ctx, int *flush, int opportunistically)
 {
     int err = 0, ret, push_flags;
@@ -490,6 +853,12 @@ static int push_input_pads(FilterContext *ctx, int *flush, int opportunistically
     for (int i = 0; i < ctx->num_in_pads; i++) {
         FilterPad *in_pad = ctx->in_pads[i];
 
+        /* Wait for the graph being rebuilt for its new format */
+        if (in_pad->pending_frame) {
+            pads_satisfied++;
+            continue;
+        }
+
         unsigned nb_req;
         if (!in_pad->eos && !opportunistically) {
             nb_req = sp_frame_fifo_get_size(in_pad->fifo);
@@ -524,6 +893,8 @@ static int push_input_pads(FilterContext *ctx, int *flush, int opportunistically
                 return ret;
             }
 
+            ctx->frames_in++;
+
             if (!in_frame) {
                 *flush = 1;
                 push_flags = AV_BUFFERSRC_FLAG_PUSH;
@@ -534,6 +905,21 @@ static int push_input_pads(FilterContext *ctx, int *flush, int opportunistically
                 FormatExtraData *fe = (FormatExtraData *)in_frame->opaque_ref->data;
                 sp_log(ctx, SP_LOG_TRACE, "Giving frame to input pad \"%s\", pts = %f\n",
                        in_pad->name, av_q2d(fe->time_base) * in_frame->pts);
+
+                if (ctx->input_timeout && input_pad_resumed(ctx, in_pad, in_frame)) {
+                    av_frame_free(&in_frame);
+                    continue;
+                }
+
+                if (frame_params_changed(in_pad->type, in_pad->in_fmt, in_frame)) {
+                    sp_log(ctx, SP_LOG_VERBOSE, "Input pad \"%s\" changed format, "
+                           "rebuilding graph\n", in_pad->name);
+                    in_pad->pending_frame = in_frame;
+                    if (!ctx->rebuild && (ret = start_rebuild(ctx)) < 0)
+                        return ret;
+                    j++;
+                    break;
+                }
             }
 
             /* Takes ownership of in_frame */
@@ -562,6 +948,53 @@ static int push_input_pads(FilterContext *ctx, int *flush, int opportunistically
     return (err < 0 && !pads_satisfied) ? err : (pads_satisfied == ctx->num_in_pads);
 }
 
+/* Sends a filtered frame downstream, replacing it with a new one */
+static int output_frame(FilterContext *ctx, FilterPad *out_pad, AVFrame **tmp_frame)
+{
+    int ret;
+    AVFrame *filt_frame = *tmp_frame;
+
+    av_buffer_unref(&filt_frame->opaque_ref);
+    filt_frame->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
+    if (!filt_frame->opaque_ref)
+        return AVERROR(ENOMEM);
+
+    FormatExtraData *fe = (FormatExtraData *)filt_frame->opaque_ref->data;
+    fe->time_base = out_pad->buffer->inputs[0]->time_base;
+    if (out_pad->buffer->inputs[0]->type == AVMEDIA_TYPE_VIDEO)
+        fe->avg_frame_rate  = av_buffersink_get_frame_rate(out_pad->buffer);
+    else if (out_pad->buffer->inputs[0]->type == AVMEDIA_TYPE_AUDIO)
+        fe->bits_per_sample = av_get_bytes_per_sample(out_pad->buffer->inputs[0]->format) * 8;
+
+    sp_log(ctx, SP_LOG_TRACE, "Pushing frame to FIFO from output pad \"%s\", pts = %f\n",
+           out_pad->name, av_q2d(fe->time_base) * filt_frame->pts);
+
+    if (out_pad->deliver_fifo)
+        ret = sp_frame_fifo_push(out_pad->deliver_fifo, filt_frame);
+    else
+        ret = sp_frame_fifo_push(out_pad->fifo, filt_frame);
+    av_frame_free(tmp_frame);
+    if (ret == AVERROR(ENOMEM))
+        return ret;
+
+    *tmp_frame = av_frame_alloc();
+    if (!*tmp_frame)
+        return AVERROR(ENOMEM);
+
+    if (ret == AVERROR(ENOBUFS)) {
+        out_pad->dropped_frames++;
+        sp_log(ctx, SP_LOG_WARN,
+               "Dropping filtered frame from output pad \"%s\" (%i dropped)!\n",
+               out_pad->name, out_pad->dropped_frames);
+    } else if (ret < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Error pushing frame to FIFO on output pad \"%s\": %s\n",
+               out_pad->name, av_err2str(ret));
+        return ret;
+    }
+
+    return 0;
+}
+
 static int drain_output_pad(FilterContext *ctx, FilterPad *out_pad,
                             AVFrame **tmp_frame, int *flush)
 {
@@ -592,53 +1025,232 @@ static int drain_output_pad(FilterContext *ctx, FilterPad *out_pad,
 
         input_pushed = 0;
 
-        av_buffer_unref(&filt_frame->opaque_ref);
-        filt_frame->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
-        if (!filt_frame->opaque_ref)
-            return AVERROR(ENOMEM);
+        ret = output_frame(ctx, out_pad, tmp_frame);
+        if (ret < 0)
+            return ret;
+        filt_frame = *tmp_frame;
+    } while (1);
 
-        FormatExtraData *fe = (FormatExtraData *)filt_frame->opaque_ref->data;
-        fe->time_base = out_pad->buffer->inputs[0]->time_base;
-        if (out_pad->buffer->inputs[0]->type == AVMEDIA_TYPE_VIDEO)
-            fe->avg_frame_rate  = av_buffersink_get_frame_rate(out_pad->buffer);
-        else if (out_pad->buffer->inputs[0]->type == AVMEDIA_TYPE_AUDIO)
-            fe->bits_per_sample = av_get_bytes_per_sample(out_pad->buffer->inputs[0]->format) * 8;
+    /* Probably overkill, but why take a chance? */
+    if ((ret == AVERROR_EOF) || ((ret == AVERROR(EAGAIN)) && *flush)) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Output pad \"%s\" flushed!\n", out_pad->name);
+        ret = AVERROR_EOF;
+        out_pad->eos = 1;
+    } else if (ret != AVERROR(EAGAIN)) {
+        sp_log(ctx, SP_LOG_ERROR, "Error pulling filtered frame from output pad \"%s\": %s!\n",
+               out_pad->name, av_err2str(ret));
+    }
 
-        sp_log(ctx, SP_LOG_TRACE, "Pushing frame to FIFO from output pad \"%s\", pts = %f\n",
-               out_pad->name, av_q2d(fe->time_base) * filt_frame->pts);
+    return ret;
+}
 
-        ret = sp_frame_fifo_push(out_pad->fifo, filt_frame);
-        av_frame_free(tmp_frame);
-        if (ret == AVERROR(ENOMEM))
-            return ret;
+/* Swaps in the rebuilt graph, after flushing everything the old one
+ * still held out to the outputs */
+static int finish_rebuild(FilterContext *ctx, AVFrame **tmp_frame)
+{
+    int err;
+    FilterRebuild *rb = ctx->rebuild;
+    FilterContext *shadow = &rb->shadow;
 
-        *tmp_frame = filt_frame = av_frame_alloc();
-        if (!filt_frame)
-            return AVERROR(ENOMEM);
+    pthread_join(rb->thread, NULL);
+    ctx->rebuild = NULL;
+
+    int64_t t_built = av_gettime_relative();
+
+    if (rb->err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to rebuild graph: %s!\n", av_err2str(rb->err));
+        err = rb->err;
+        free_rebuild(&rb);
+        return err;
+    }
+
+    /* Another input changed in the meantime, start over */
+    for (int i = 0; i < ctx->num_in_pads; i++) {
+        FilterPad *pad = ctx->in_pads[i];
+        if (pad->pending_frame &&
+            frame_params_changed(pad->type, shadow->in_pads[i]->in_fmt, pad->pending_frame)) {
+            free_rebuild(&rb);
+            return start_rebuild(ctx);
+        }
+    }
+
+    for (int i = 0; i < ctx->num_in_pads; i++) {
+        FilterPad *pad = ctx->in_pads[i];
+        if (pad->eos)
+            continue;
+        err = av_buffersrc_add_frame_flags(pad->buffer, NULL, 0);
+        if (err < 0)
+            goto end;
+    }
+
+    for (int i = 0; i < ctx->num_out_pads; i++) {
+        FilterPad *pad = ctx->out_pads[i];
+        if (pad->eos)
+            continue;
+        while ((err = av_buffersink_get_frame(pad->buffer, *tmp_frame)) >= 0) {
+            err = output_frame(ctx, pad, tmp_frame);
+            if (err < 0)
+                goto end;
+        }
+        if (err != AVERROR_EOF && err != AVERROR(EAGAIN))
+            goto end;
+    }
+
+    avfilter_graph_free(&ctx->graph);
+    FFSWAP(AVFilterGraph *, ctx->graph, shadow->graph);
+
+    for (int i = 0; i < ctx->num_out_pads; i++) {
+        FilterPad *pad = ctx->out_pads[i], *new_pad = shadow->out_pads[i];
+        pad->buffer     = new_pad->buffer;
+        pad->filter     = new_pad->filter;
+        pad->filter_pad = new_pad->filter_pad;
+    }
+
+    for (int i = 0; i < ctx->num_in_pads; i++) {
+        FilterPad *pad = ctx->in_pads[i], *new_pad = shadow->in_pads[i];
+        pad->buffer     = new_pad->buffer;
+        pad->filter     = new_pad->filter;
+        pad->filter_pad = new_pad->filter_pad;
+        av_frame_free(&pad->in_fmt);
+        FFSWAP(AVFrame *, pad->in_fmt, new_pad->in_fmt);
+
+        err = 0;
+        if (pad->eos) {
+            err = av_buffersrc_add_frame_flags(pad->buffer, NULL, 0);
+        } else if (pad->pending_frame) {
+            err = av_buffersrc_add_frame_flags(pad->buffer, pad->pending_frame, 0);
+            av_frame_free(&pad->pending_frame);
+        }
+        if (err < 0)
+            goto end;
+    }
+
+    int64_t build_time = t_built - rb->t_start;
+    int64_t swap_time = av_gettime_relative() - t_built;
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Graph rebuilt in %.2f ms, swapped in %.2f ms\n",
+           build_time / 1000.0, swap_time / 1000.0);
+
+    SPGenericData entries[] = {
+        D_TYPE("rebuild_time", NULL, build_time),
+        D_TYPE("swap_time", NULL, swap_time),
+        { 0 },
+    };
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
+
+    err = 0;
+
+end:
+    if (err < 0)
+        sp_log(ctx, SP_LOG_ERROR, "Unable to swap in rebuilt graph: %s!\n", av_err2str(err));
+    free_rebuild(&rb);
+    return err;
+}
+
+static void *output_delivery_thread(void *data)
+{
+    FilterPad *pad = data;
+    FilterContext *ctx = pad->main;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s:%s", sp_class_get_name(ctx), pad->name);
+    sp_set_thread_name_self(name);
+
+    while (1) {
+        /* EOS gets sent by the filtering thread, once we're done */
+        AVFrame *frame = sp_frame_fifo_pop(pad->deliver_fifo);
+        if (!frame)
+            break;
+
+        int64_t t_start = av_gettime_relative();
+        int ret = sp_frame_fifo_push(pad->fifo, frame);
+        int64_t t_end = av_gettime_relative();
+        av_frame_free(&frame);
+
+        atomic_store(&pad->deliver_latency,
+                     sp_sliding_win(pad->deliver_win, t_end - t_start, t_end,
+                                    av_make_q(1, 1000000), 1000000, 1));
 
         if (ret == AVERROR(ENOBUFS)) {
-            out_pad->dropped_frames++;
+            int dropped = atomic_fetch_add(&pad->deliver_dropped, 1) + 1;
             sp_log(ctx, SP_LOG_WARN,
                    "Dropping filtered frame from output pad \"%s\" (%i dropped)!\n",
-                   out_pad->name, out_pad->dropped_frames);
+                   pad->name, pad->dropped_frames + dropped);
         } else if (ret < 0) {
             sp_log(ctx, SP_LOG_ERROR, "Error pushing frame to FIFO on output pad \"%s\": %s\n",
-                   out_pad->name, av_err2str(ret));
+                   pad->name, av_err2str(ret));
+        }
+    }
+
+    return NULL;
+}
+
+static int start_output_delivery(FilterContext *ctx)
+{
+    for (int i = 0; i < ctx->num_out_pads; i++) {
+        FilterPad *pad = ctx->out_pads[i];
+
+        /* The delivery thread only falls behind while a downstream FIFO blocks
+         * it, in which case the filter has to block too, rather than drop */
+        pad->deliver_fifo = sp_frame_fifo_create(ctx, FFMAX(ctx->fifo_size, 8),
+                                                 FRAME_FIFO_BLOCK_NO_INPUT |
+                                                 FRAME_FIFO_BLOCK_MAX_OUTPUT);
+        pad->deliver_win = av_mallocz(sizeof(*pad->deliver_win));
+
+        atomic_init(&pad->deliver_dropped, 0);
+        atomic_init(&pad->deliver_latency, 0);
+
+        int ret = AVERROR(ENOMEM);
+        if (!pad->deliver_fifo || !pad->deliver_win ||
+            (ret = AVERROR(pthread_create(&pad->deliver_thread, NULL,
+                                          output_delivery_thread, pad)))) {
+            av_buffer_unref(&pad->deliver_fifo);
+            av_freep(&pad->deliver_win);
             return ret;
         }
-    } while (1);
+    }
 
-    /* Probably overkill, but why take a chance? */
-    if ((ret == AVERROR_EOF) || ((ret == AVERROR(EAGAIN)) && *flush)) {
-        sp_log(ctx, SP_LOG_VERBOSE, "Output pad \"%s\" flushed!\n", out_pad->name);
-        ret = AVERROR_EOF;
-        out_pad->eos = 1;
-    } else if (ret != AVERROR(EAGAIN)) {
-        sp_log(ctx, SP_LOG_ERROR, "Error pulling filtered frame from output pad \"%s\": %s!\n",
-               out_pad->name, av_err2str(ret));
+    return 0;
+}
+
+/* Lets all queued frames through before returning */
+static void stop_output_delivery(FilterContext *ctx)
+{
+    for (int i = 0; i < ctx->num_out_pads; i++) {
+        FilterPad *pad = ctx->out_pads[i];
+        if (!pad->deliver_fifo)
+            continue;
+
+        sp_frame_fifo_push(pad->deliver_fifo, NULL);
+        pthread_join(pad->deliver_thread, NULL);
+        av_buffer_unref(&pad->deliver_fifo);
+        av_freep(&pad->deliver_win);
     }
+}
 
-    return ret;
+static void output_delivery_stats(FilterContext *ctx, int64_t *last_update)
+{
+    int64_t cur_time = av_gettime_relative();
+    if ((cur_time - *last_update) < 100000)
+        return;
+    *last_update = cur_time;
+
+    SPGenericData entries[3*ctx->num_out_pads + 1];
+    int64_t vals[3*ctx->num_out_pads];
+
+    for (int i = 0; i < ctx->num_out_pads; i++) {
+        FilterPad *pad = ctx->out_pads[i];
+        vals[3*i + 0] = pad->dropped_frames + atomic_load(&pad->deliver_dropped);
+        vals[3*i + 1] = atomic_load(&pad->deliver_latency);
+        vals[3*i + 2] = sp_frame_fifo_get_size(pad->deliver_fifo);
+        entries[3*i + 0] = D_TYPE("dropped", pad->name, vals[3*i + 0]);
+        entries[3*i + 1] = D_TYPE("latency", pad->name, vals[3*i + 1]);
+        entries[3*i + 2] = D_TYPE("queued", pad->name, vals[3*i + 2]);
+    }
+
+    entries[3*ctx->num_out_pads] = (SPGenericData){ 0 };
+
+    sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, entries);
 }
 
 static void *filtering_thread(void *data)
@@ -653,13 +1265,53 @@ static void *filtering_thread(void *data)
 
     AVFrame *filt_frame = av_frame_alloc();
 
+    /* With several inputs, never block on any single one of them, but feed
+     * whichever one the graph asks for as soon as it has frames */
+    int event_driven = ctx->num_in_pads > 1 || ctx->input_timeout;
+
+    /* Likewise, don't let any single output hold up the others */
+    int parallel_outputs = ctx->num_out_pads > 1;
+    int64_t last_stats = 0;
+    if (parallel_outputs) {
+        pthread_mutex_lock(&ctx->lock);
+        err = start_output_delivery(ctx);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to start output delivery: %s!\n",
+                   av_err2str(err));
+            goto fail;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    for (int i = 0; i < ctx->num_in_pads; i++)
+        ctx->in_pads[i]->deadline = ctx->input_timeout ?
+                                    av_gettime_relative() + ctx->input_timeout :
+                                    INT64_MAX;
+
     while (1) {
+        unsigned int notify_seq = sp_fifo_notify_seq(&ctx->in_notify);
+        int64_t next_deadline = INT64_MAX;
+
         pthread_mutex_lock(&ctx->lock);
 
-        err = push_input_pads(ctx, &flushing, 0);
+        if (ctx->rebuild && atomic_load(&ctx->rebuild->done)) {
+            err = finish_rebuild(ctx, &filt_frame);
+            if (err < 0)
+                goto fail;
+        }
+
+        uint64_t frames_in = ctx->frames_in;
+
+        err = push_input_pads(ctx, &flushing, event_driven);
         if (err < 0)
             goto fail;
 
+        if (ctx->input_timeout) {
+            err = fill_stalled_pads(ctx, &next_deadline);
+            if (err < 0)
+                goto fail;
+        }
+
         pthread_mutex_unlock(&ctx->lock);
         pthread_mutex_lock(&ctx->lock);
 
@@ -684,11 +1336,20 @@ static void *filtering_thread(void *data)
                 pads_errors++;
         }
 
+        int idle = ctx->frames_in == frames_in;
+
+        if (parallel_outputs)
+            output_delivery_stats(ctx, &last_stats);
+
         pthread_mutex_unlock(&ctx->lock);
 
         /* Yes, I'm being clever. */
         if ((pads_flushed + pads_errors) == ctx->num_out_pads)
             break;
+
+        /* Nothing came in, sleep until an input does or stalls */
+        if ((event_driven || ctx->rebuild) && idle && !flushing)
+            sp_fifo_notify_wait(&ctx->in_notify, notify_seq, next_deadline);
     }
 
     if (err >= 0 || (err == AVERROR_EOF))
@@ -698,6 +1359,9 @@ static void *filtering_thread(void *data)
 
     av_frame_free(&filt_frame);
 
+    cancel_rebuild(ctx);
+    stop_output_delivery(ctx);
+
     {
         int tmp = err;
         sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_EOS, &tmp);
@@ -710,6 +1374,12 @@ static void *filtering_thread(void *data)
     return NULL;
 
 fail:
+    /* Joining may wait on a blocked downstream FIFO, like on a clean exit */
+    pthread_mutex_unlock(&ctx->lock);
+
+    cancel_rebuild(ctx);
+    stop_output_delivery(ctx);
+
     {
         int tmp = err;
         sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_EOS, &tmp);
@@ -720,7 +1390,6 @@ fail:
     }
 
     av_frame_free(&filt_frame);
-    pthread_mutex_unlock(&ctx->lock);
     return NULL;
 }
 
@@ -737,46 +1406,10 @@ static int sp_filter_init_graph(FilterContext *ctx)
     if (err < 0)
         return err;
 
-    if ((err = init_pads(ctx)))
-        return err;
-
-    if (!ctx->hw_device_ref && ctx->device_type != AV_HWDEVICE_TYPE_NONE) {
-        err = av_hwdevice_ctx_create(&ctx->hw_device_ref, ctx->device_type,
-                                     NULL, NULL, 0);
-        if (err < 0) {
-            sp_log(ctx, SP_LOG_ERROR, "Could not init hardware device: %s!\n",
-                   av_err2str(err));
-            return err;
-        }
-    }
-
-    if (ctx->hw_device_ref) {
-        for (int i = 0; i < ctx->graph->nb_filters; i++) {
-            AVFilterContext *filter = ctx->graph->filters[i];
-            filter->hw_device_ctx = av_buffer_ref(ctx->hw_device_ref);
-        }
-        av_buffer_unref(&ctx->hw_device_ref);
-    }
-
-    if ((err = avfilter_graph_config(ctx->graph, NULL)) < 0) {
-        sp_log(ctx, SP_LOG_ERROR, "Unable to configure graph: %s!\n", av_err2str(err));
-        free_graph(ctx);
-        ctx->err = err;
-        return err;
-    }
-
-    if (ctx->dump_graph) {
-        char *graph_dump = avfilter_graph_dump(ctx->graph, NULL);
-        if (graph_dump)
-            sp_log(NULL, SP_LOG_INFO, "\n%s\n", graph_dump);
-        av_free(graph_dump);
-    }
-
-    sp_log(ctx, SP_LOG_DEBUG, "Filter configured!\n");
-
-    return err;
+    return configure_graph(ctx);
 }
 
+
 static int filter_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
                                void *_ctx, void *dep_ctx, void *data)
 {
@@ -805,6 +1438,21 @@ static int filter_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
         if ((tmp_val = dict_get(event->opts, "dump_graph")))
             if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
                 ctx->dump_graph = 1;
+        if ((tmp_val = dict_get(event->opts, "input_timeout"))) {
+            double timeout = strtod(tmp_val, NULL);
+            if (timeout < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid input timeout \"%s\"!\n", tmp_val);
+            else
+                ctx->input_timeout = llrint(timeout * AV_TIME_BASE);
+        }
+        if ((tmp_val = dict_get(event->opts, "input_timeout_action"))) {
+            if (!strcmp(tmp_val, "eos"))
+                ctx->input_timeout_eos = 1;
+            else if (!strcmp(tmp_val, "repeat"))
+                ctx->input_timeout_eos = 0;
+            else
+                sp_log(ctx, SP_LOG_ERROR, "Invalid input timeout action \"%s\"!\n", tmp_val);
+        }
         if ((tmp_val = dict_get(event->opts, "fifo_size"))) {
             long int len = strtol(tmp_val, NULL, 10);
             if (len < 0) {
@@ -883,8 +1531,11 @@ static void filter_free(void *opaque, uint8_t *data)
     }
 
     for (int i = 0; i < ctx->num_in_pads; i++) {
+        sp_frame_fifo_set_notify(ctx->in_pads[i]->fifo, NULL);
         av_buffer_unref(&ctx->in_pads[i]->fifo);
         av_frame_free(&ctx->in_pads[i]->in_fmt);
+        av_frame_free(&ctx->in_pads[i]->last_frame);
+        av_frame_free(&ctx->in_pads[i]->pending_frame);
         av_free(ctx->in_pads[i]->name);
         av_free(ctx->in_pads[i]);
     }
@@ -903,6 +1554,7 @@ static void filter_free(void *opaque, uint8_t *data)
 
     av_dict_free(&ctx->direct_filter_opts);
     av_dict_free(&ctx->graph_opts);
+    sp_fifo_notify_uninit(&ctx->in_notify);
 
     sp_class_free(ctx);
     av_free(ctx);
@@ -929,6 +1581,7 @@ AVBufferRef *sp_filter_alloc(void)
     }
 
     pthread_mutex_init(&ctx->lock, NULL);
+    sp_fifo_notify_init(&ctx->in_notify);
     ctx->events = sp_bufferlist_new();
 
     return ctx_ref;
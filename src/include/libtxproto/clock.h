@@ -0,0 +1,108 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#pragma once
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <libavutil/buffer.h>
+
+#include <libtxproto/bufferlist.h>
+#include <libtxproto/log.h>
+
+/* A component's clock, which the rest of the pipeline can follow. The
+ * component (the master) publishes how its own timeline relates to the
+ * system clock, and other sources convert their system timestamps into it.
+ * All times are in microseconds, system ones in av_gettime_relative() time. */
+typedef struct SPClock {
+    SPClass *class;
+
+    pthread_mutex_t lock;
+
+    /* Set once an epoch is taken from the clock */
+    atomic_bool active;
+    atomic_int_fast64_t *epoch;
+
+    /* System time of the master's first timestamp, INT64_MIN until known,
+     * and that timestamp */
+    int64_t first;
+    int64_t first_time;
+
+    /* Latest timestamp, and the system clock's rate over the master's */
+    int64_t ref_sys;
+    int64_t ref_time;
+    double scale;
+} SPClock;
+
+AVBufferRef *sp_clock_alloc(void *owner);
+
+/* Makes the clock the pipeline's master. On the first update, the epoch is
+ * set to the system time of the master's first timestamp. */
+void sp_clock_activate(AVBufferRef *clock_ref, atomic_int_fast64_t *epoch);
+
+int sp_clock_is_active(AVBufferRef *clock_ref);
+
+/* Called by the master for each of its timestamps */
+void sp_clock_update(AVBufferRef *clock_ref, int64_t sys_time, int64_t time,
+                     double scale);
+
+/* Converts a system time to the master's timeline. Returns AV_NOPTS_VALUE
+ * until the master has produced its first timestamp, and for times which
+ * predate it. */
+int64_t sp_clock_convert(AVBufferRef *clock_ref, int64_t sys_time);
+
+/* Where the pipeline's master clock is published, once there is one. Lives
+ * as long as the main context, so components may pick the master up at any
+ * point, whether it was set up before or after they started. */
+typedef struct SPClockSlot {
+    pthread_mutex_t lock;
+    AVBufferRef *clock;
+} SPClockSlot;
+
+void sp_clock_slot_init(SPClockSlot *slot);
+
+/* Replaces the published clock, which may be NULL */
+int sp_clock_slot_set(SPClockSlot *slot, AVBufferRef *clock_ref);
+
+/* Returns a new reference to the published clock, or NULL */
+AVBufferRef *sp_clock_slot_get(SPClockSlot *slot);
+
+void sp_clock_slot_uninit(SPClockSlot *slot);
+
+/* Timestamps of a source following the master, or just the epoch without one */
+typedef struct SPClockFollower {
+    SPClockSlot *slot;
+    AVBufferRef *clock;
+    int64_t epoch;
+    int64_t last_stats;
+} SPClockFollower;
+
+/* slot may be NULL */
+void sp_clock_follower_init(SPClockFollower *f, SPClockSlot *slot, int64_t epoch);
+
+/* Returns the timestamp for a system time, AV_NOPTS_VALUE if the frame should
+ * be dropped as it predates the master's first one */
+int64_t sp_clock_follower_time(SPClockFollower *f, int64_t sys_time);
+
+/* Dispatches clock_offset (in milliseconds, how far the master's timeline has
+ * drifted from the system one) and master_drift_ppm, at most once a second */
+void sp_clock_follower_stats(SPClockFollower *f, void *ctx, SPBufferList *events);
+
+void sp_clock_follower_uninit(SPClockFollower *f);
@@ -38,6 +38,11 @@ typedef struct DecodingContext {
     int64_t start_pts;
     int64_t epoch;
 
+    /* Frames before this PTS precede the demuxer's in-point, and are
+     * dropped. Updated from PacketExtraData after every seek, which also
+     * flushes the decoder and resets start_pts. */
+    int64_t discard_pts;
+
     /* Options */
     int low_latency;
 
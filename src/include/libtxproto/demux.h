@@ -42,12 +42,65 @@ typedef struct DemuxingContext {
     const char *in_format;
     AVDictionary *start_options;
 
-    AVBufferRef **dst_packets; // One per output stream
+    /* Read-ahead buffer size for regular files, 0 (default) to disable */
+    int64_t readahead_size;
+    struct SPAVIOReadahead *readahead;
+
+    AVBufferRef **dst_packets; // One per output stream, NULL until linked
     AVCodecParameters par;
 
+    /* Links which have been requested but not yet connected.
+     * The demuxing thread will not start reading until this reaches 0. */
+    int pending_links;
+    pthread_cond_t links_cond;
+
+    /* Set when a stream gets enabled, the demuxing thread then updates
+     * the discard flags of all streams before its next read */
+    int streams_changed;
+
+    /* Realtime pacing, packets are output at their DTS relative to the epoch */
+    int realtime;
+    double speed;         // Playback speed multiplier
+    int64_t burst;        // Media duration output unpaced at start, in AV_TIME_BASE
+    int64_t max_lag;      // Lag beyond which the timeline gets rebased, if enabled
+    int catchup_rebase;   // Rebase the timeline rather than bursting when lagging
+    int64_t pace_base_ts;
+    int64_t pace_base_time;
+
+    /* Trimming, in AV_TIME_BASE relative to the start of the file.
+     * Packets before the in-point are flagged with AV_PKT_FLAG_DISCARD,
+     * and the first packet of each stream after a seek carries the in-point
+     * as PacketExtraData. */
+    int64_t start_time;
+    int64_t end_time;
+    uint8_t *stream_ended;  // One per stream, set once past the out-point
+    uint8_t *stream_seeked; // One per stream, set until its first packet after a seek
+    int64_t seek_req;       // Pending seek command, AV_NOPTS_VALUE if none
+    int eos_sent;           // Set once all streams got EOS, seeks are rejected from then on
+
     int err;
 } DemuxingContext;
 
 AVBufferRef *sp_demuxer_alloc(void);
 int  sp_demuxer_init(AVBufferRef *ctx_ref);
 int  sp_demuxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg);
+
+/* Returns the stream index matching either an ID or a description
+ * (e.g. "video=0", "aid=1" or a stream title), or a negative error */
+int  sp_demuxer_find_stream(DemuxingContext *ctx, void *log_ctx,
+                            int stream_id, const char *stream_desc);
+
+/* Seeks to the keyframe preceding ts (AV_TIME_BASE, relative to the start
+ * of the file), and sets ts as the new in-point. Demuxing thread only,
+ * use the "seek" command from elsewhere. A seek received before the last
+ * stream reaches the out-point or EOF resumes every stream, but once EOS
+ * has been sent the command fails. */
+int  sp_demuxer_seek(DemuxingContext *ctx, int64_t ts);
+
+/* Enables a stream and returns its (borrowed) packet FIFO, or NULL on
+ * allocation failure. Streams which are never enabled are discarded. */
+AVBufferRef *sp_demuxer_enable_stream(DemuxingContext *ctx, int idx);
+
+/* Link bookkeeping, every added pending link must be marked as done */
+void sp_demuxer_add_pending_link(DemuxingContext *ctx);
+void sp_demuxer_pending_link_done(DemuxingContext *ctx);
@@ -56,6 +56,16 @@ typedef struct EncodingContext {
     int width, height;
     enum AVPixelFormat pix_fmt;
     SPRotation rotation;
+    double keyframe_interval; /* Forced keyframes every N seconds, for segment alignment */
+    double next_keyframe_time;
+
+    /* Duplicate frame dropping, for variable framerate output */
+    struct SPDedup *dedup;
+    int dedup_step;
+    double dedup_max_gap; /* A duplicate is let through after N seconds */
+    double dedup_last_time;
+    int64_t dedup_dropped;
+    int64_t dedup_last_stats;
 
     /* Audio options only */
     int sample_rate;
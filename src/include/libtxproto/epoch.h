@@ -25,7 +25,7 @@
 enum EpochMode {
     EP_MODE_OFFSET,   /* Timestamps will start at an offset (value = system time + offset) */
     EP_MODE_SYSTEM,   /* Timestamps will start at the system arbitrary time (value = 0) */
-    EP_MODE_SOURCE,   /* Timestamps will be set to the first output's PTS */
+    EP_MODE_SOURCE,   /* Timestamps will follow a master clock, from its first output (value = its system time) */
     EP_MODE_EXTERNAL, /* A Lua function will give us the epoch */
 };
 
@@ -46,6 +46,9 @@ void RENAME(fifo_set_max_queued)(AVBufferRef *dst, int max_queued);
 void RENAME(fifo_set_block_flags)(AVBufferRef *dst, FNAME block_flags);
 int  RENAME(fifo_string_to_block_flags)(FNAME *dst, const char *in_str);
 
+/* Signalled on every push, lets a consumer wait on several FIFOs at once */
+void RENAME(fifo_set_notify)(AVBufferRef *dst, struct SPFIFONotify *notify);
+
 /* Up/downstreaming */
 int RENAME(fifo_mirror)(AVBufferRef *dst, AVBufferRef *src);
 int RENAME(fifo_unmirror)(AVBufferRef *dst, AVBufferRef *src);
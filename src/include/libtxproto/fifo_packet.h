@@ -27,6 +27,13 @@ enum SPPacketFIFOFlags {
     PACKET_FIFO_PULL_NO_BLOCK    = (1 << 2),
 };
 
+/* opaque data a packet may carry */
+typedef struct PacketExtraData {
+    /* In-point, in the packet's time base, set on the first packet of each
+     * stream after a demuxer seek. Decoders drop frames before it. */
+    int64_t in_point;
+} PacketExtraData;
+
 #define FRENAME(x) PACKET_FIFO_ ## x
 #define RENAME(x)  sp_packet_ ##x
 #define FNAME      enum SPPacketFIFOFlags
@@ -46,6 +53,9 @@ void RENAME(fifo_set_max_queued)(AVBufferRef *dst, int max_queued);
 void RENAME(fifo_set_block_flags)(AVBufferRef *dst, FNAME block_flags);
 int  RENAME(fifo_string_to_block_flags)(FNAME *dst, const char *in_str);
 
+/* Signalled on every push, lets a consumer wait on several FIFOs at once */
+void RENAME(fifo_set_notify)(AVBufferRef *dst, struct SPFIFONotify *notify);
+
 /* Up/downstreaming */
 int RENAME(fifo_mirror)(AVBufferRef *dst, AVBufferRef *src);
 int RENAME(fifo_unmirror)(AVBufferRef *dst, AVBufferRef *src);
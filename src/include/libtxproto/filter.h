@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <stdatomic.h>
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/dict.h>
@@ -39,10 +40,22 @@ typedef struct FilterPad {
 
     /* Input only */
     int eos;
+    AVFrame *pending_frame; /* First frame in a new format, held until the graph is rebuilt */
+    AVFrame *last_frame; /* Kept to generate frames when the input stalls */
+    int64_t deadline; /* When the input counts as stalled, if requested */
+    int timed_out;
 
     /* Output only */
     int dropped_frames;
 
+    /* Output only, with several outputs each one gets delivered downstream
+     * by its own thread, so one blocked consumer can't stall the others */
+    AVBufferRef *deliver_fifo;
+    pthread_t deliver_thread;
+    SlidingWinCtx *deliver_win;
+    atomic_int deliver_dropped;
+    _Atomic int64_t deliver_latency; /* Time spent pushing downstream, in us */
+
     AVBufferRef *fifo;
     AVFrame *in_fmt; /* Used to track format changes */
 } FilterPad;
@@ -59,6 +72,15 @@ typedef struct FilterContext {
     int dump_graph;
     int fifo_size;
 
+    /* Input pads stalled longer than this get frames generated for them,
+     * repeated video frames or audio silence, or get ended if set to */
+    int64_t input_timeout; // In microseconds, 0 to disable
+    int input_timeout_eos;
+
+    /* Signalled on any input, for graphs with more than one */
+    SPFIFONotify in_notify;
+    uint64_t frames_in;
+
     /* Derived from input device reference */
     enum AVHWDeviceType device_type;
     AVBufferRef *hw_device_ref;
@@ -78,6 +100,9 @@ typedef struct FilterContext {
     AVDictionary *graph_opts;
     int direct_filter;
 
+    /* Graph being rebuilt in the background for new input formats */
+    struct FilterRebuild *rebuild;
+
     /* I/O thread */
     pthread_t filter_thread;
     pthread_mutex_t lock;
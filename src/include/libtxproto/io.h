@@ -69,6 +69,9 @@ typedef struct IOSysEntry {
     /* Input/output FIFO */
     AVBufferRef *frames;
 
+    /* Clock which the pipeline can follow, if the entry can be a master */
+    AVBufferRef *clock;
+
     /* Command interface */
     int (*ctrl)(AVBufferRef *entry, SPEventType ctrl, void *arg);
     SPBufferList *events;
@@ -134,5 +134,6 @@ const char *sp_class_get_name(void *ctx);
 const char *sp_class_get_parent_name(void *ctx);
 int sp_class_set_name(void *ctx, const char *name);
 enum SPType sp_class_get_type(void *ctx);
+int sp_class_set_type(void *ctx, enum SPType type);
 const char *sp_class_type_string(void *ctx);
 enum SPType sp_avcategory_to_type(AVClassCategory category);
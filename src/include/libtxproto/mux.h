@@ -22,6 +22,7 @@
 #include <libavformat/avformat.h>
 
 #include "encode.h"
+#include "demux.h"
 #include "log.h"
 
 typedef struct MuxingContext {
@@ -43,6 +44,56 @@ typedef struct MuxingContext {
     int dump_info;
     char *dump_sdp_file;
 
+    /* Chunked (CMAF-style) output: fragments are cut and flushed every
+     * chunk_duration, or every packet if 0, instead of on keyframes */
+    int chunked;
+    int64_t chunk_duration; // In microseconds
+    int64_t chunk_start;
+
+    /* Buffered writer ring size for regular files, 0 (default) to disable */
+    int64_t writer_buffer_size;
+    struct SPAVIOWriter *writer;
+
+    /* Replay buffer mode, enabled if either limit is set. Packets are only
+     * kept in memory, and written to out_url on a "save" command. */
+    double replay_duration; // In seconds
+    int64_t replay_max_bytes;
+    int replay_mode;
+    struct SPReplayBuffer *replay;
+
+    /* Segmented output, enabled if either limit is set. out_url must contain
+     * a sequence number pattern (e.g. rec-%03d.mkv). Segments are cut on
+     * keyframes, written as .part files and renamed once finalised. */
+    double segment_duration; // In seconds
+    int64_t segment_size;
+    const char *segment_list;
+    char *segment_template;
+    char *segment_part_path;
+    char *segment_final_path;
+    int segment_idx;
+    int64_t segment_start;
+    int64_t segment_last_ts;
+    struct SPSegmentFinaliser *segment_finaliser;
+
+    /* Reopen the output with backoff when writing fails. Packets are queued
+     * meanwhile, and writing resumes on the newest queued keyframe. */
+    int reconnect;
+    double reconnect_delay_max; // In seconds
+    double reconnect_queue_duration; // In seconds
+    int64_t reconnect_queue_size;
+    int reconnecting;
+    int reconnect_attempts;
+    int64_t reconnect_next;
+    struct SPReplayBuffer *reconnect_queue;
+
+    /* Keyframes of this stream (the first video one) delimit GOPs */
+    int key_stream;
+
+    /* Bitstream filters for stream-copied packets, per media type */
+    char *video_bsf;
+    char *audio_bsf;
+    char *subtitle_bsf;
+
     AVBufferRef *src_packets;
 
     /* State */
@@ -58,4 +109,5 @@ typedef struct MuxingContext {
 AVBufferRef *sp_muxer_alloc(void);
 int  sp_muxer_init(AVBufferRef *ctx_ref);
 int  sp_muxer_add_stream(MuxingContext *ctx, EncodingContext *enc);
+int  sp_muxer_add_stream_copy(MuxingContext *ctx, DemuxingContext *demux, int stream_idx);
 int  sp_muxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg);
@@ -21,6 +21,7 @@
 #include <signal.h>
 #include <stdatomic.h>
 
+#include <libtxproto/clock.h>
 #include <libtxproto/log.h>
 #include <libtxproto/utils.h>
 
@@ -38,6 +39,7 @@ typedef struct TXMainContext {
     int source_update_cb_ref;
 
     atomic_int_fast64_t epoch_value;
+    SPClockSlot epoch_clock; /* Master clock, if the epoch was taken from one */
 
     AVBufferRef **io_api_ctx;
 
@@ -196,6 +196,64 @@ typedef struct SlidingWinCtx {
 int64_t sp_sliding_win(SlidingWinCtx *ctx, int64_t num, int64_t pts,
                        AVRational tb, int64_t len, int do_avg);
 
+/* Wakes up a consumer waiting on several FIFOs at once, see fifo_set_notify */
+typedef struct SPFIFONotify {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int seq;
+} SPFIFONotify;
+
+void sp_fifo_notify_init(SPFIFONotify *n);
+void sp_fifo_notify_uninit(SPFIFONotify *n);
+void sp_fifo_notify_signal(SPFIFONotify *n);
+unsigned int sp_fifo_notify_seq(SPFIFONotify *n);
+
+/* Waits until signalled past seq, or until deadline (in av_gettime_relative()
+ * time, INT64_MAX for none) */
+void sp_fifo_notify_wait(SPFIFONotify *n, unsigned int seq, int64_t deadline);
+
+/* Paces a timer-driven source against a fixed phase, so that processing
+ * time does not accumulate as drift. Missed ticks are skipped rather than
+ * caught up on in a burst. */
+typedef struct SPPacer {
+    int64_t period;   /* In microseconds, 0 to not pace */
+    int64_t phase;    /* Time of the first tick */
+    int64_t tick;     /* Index of the next tick */
+    int64_t overruns; /* Ticks skipped so far */
+} SPPacer;
+
+void sp_pacer_init(SPPacer *p, int64_t period);
+
+/* Sleeps until the next tick and returns the time of waking up, in
+ * av_gettime_relative() time. If the tick was missed by more than a period,
+ * the ones missed are counted as overruns, and it returns immediately. */
+int64_t sp_pacer_wait(SPPacer *p);
+
+/* Turns the jittery capture times of consecutive blocks of audio into
+ * monotonic timestamps which advance by the sample count, using a second
+ * order delay-locked loop. The loop also estimates the ratio between the
+ * device's clock and the system's. */
+typedef struct SPTimestampSmoother {
+    double period;    /* Nominal microseconds per sample */
+    double bandwidth; /* Of the loop, in Hz */
+    double time;      /* Expected time of the next block */
+    double scale;     /* Device clock rate over system clock rate */
+    double avg_scale; /* Averaged over around 10 seconds, for reporting */
+    int last_samples; /* Length of the previous block */
+    int64_t last_pts;
+    int64_t resets;
+} SPTimestampSmoother;
+
+void sp_ts_smoother_init(SPTimestampSmoother *s, int sample_rate, double bandwidth);
+
+/* Takes the raw time of the first sample of a block, in microseconds, or
+ * AV_NOPTS_VALUE to extrapolate, and returns the smoothed one. Errors above
+ * 100ms are treated as discontinuities, and resynchronise the loop. */
+int64_t sp_ts_smoother_update(SPTimestampSmoother *s, int64_t raw, int nb_samples);
+
+/* Estimated drift of the device clock, in parts per million */
+double sp_ts_smoother_drift_ppm(const SPTimestampSmoother *s);
+
 /* AVDictionary to AVOption */
 int sp_set_avopts_pos(void *log, void *avobj, void *posargs, AVDictionary *dict);
 int sp_set_avopts(void *log, void *avobj, AVDictionary *dict);
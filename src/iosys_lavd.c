@@ -25,7 +25,9 @@
 #include <libavutil/crc.h>
 
 #include "iosys_common.h"
+#include <libtxproto/fifo_packet.h>
 #include <libtxproto/utils.h>
+#include <libtxproto/clock.h>
 #include <libtxproto/log.h>
 #include "ctrl_template.h"
 #include "os_compat.h"
@@ -54,100 +56,253 @@ typedef struct LavdCaptureCtx {
     AVCodecContext *avctx;
 
     int64_t delay;
-    int64_t epoch;
+    SPClockFollower clock;
 
     int dropped_frames;
 
+    /* Packets between the device reading and decoding threads */
+    AVBufferRef *packets;
+    atomic_int dropped_packets;
+
+    /* Frames the device skipped, estimated from gaps in the packet timestamps */
+    int64_t frame_duration;
+    int64_t last_pkt_pts;
+    atomic_int device_drops;
+
+    /* Decoding time, reset with every stats event */
+    int64_t decode_time;
+    int decoded_packets;
+
+    /* Audio timestamp smoothing */
+    int smooth_ts;
+    SPTimestampSmoother ts;
+    int64_t last_stats;
+
     atomic_bool quit;
-    pthread_t pull_thread;
+    pthread_t read_thread;
+    pthread_t decode_thread;
 } LavdCaptureCtx;
 
-static void *lavd_thread(void *s)
+static void count_device_drops(LavdCaptureCtx *priv, AVPacket *pkt)
 {
-    int64_t pts;
-    int err = 0, flushed = 0;
+    if (pkt->pts == AV_NOPTS_VALUE)
+        return;
+
+    if (priv->frame_duration > 0 && priv->last_pkt_pts != AV_NOPTS_VALUE) {
+        int64_t gap = pkt->pts - priv->last_pkt_pts;
+        int64_t missed = (gap + priv->frame_duration/2)/priv->frame_duration - 1;
+        if (missed > 0)
+            atomic_fetch_add(&priv->device_drops, missed);
+    }
+
+    priv->last_pkt_pts = pkt->pts;
+}
+
+static void *lavd_read_thread(void *s)
+{
+    int err = 0;
     IOSysEntry *entry = s;
     LavdCaptureCtx *priv = entry->io_priv;
 
     sp_set_thread_name_self(sp_class_get_name(entry));
 
-    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT | SP_EVENT_ON_CONFIG, NULL);
-
-    while (!flushed) {
-        AVPacket *pkt = NULL;
-        if (atomic_load(&priv->quit))
-            goto send;
-
-        pkt = av_packet_alloc();
+    while (!atomic_load(&priv->quit)) {
+        AVPacket *pkt = av_packet_alloc();
 
         err = av_read_frame(priv->avf, pkt);
         if (err) {
             sp_log(entry, SP_LOG_ERROR, "Unable to read frame: %s!\n", av_err2str(err));
-            goto end;
+            av_packet_free(&pkt);
+            break;
         }
 
-        if (!priv->delay)
-            priv->delay = av_gettime_relative() - priv->epoch - pkt->pts;
-        pkt->pts += priv->delay;
+        count_device_drops(priv, pkt);
 
-send:
-        pts = pkt ? pkt->pts : AV_NOPTS_VALUE;
+        /* Device time to system time, then to the pipeline's */
+        if (!priv->delay)
+            priv->delay = av_gettime_relative() - pkt->pts;
+        int64_t pts = sp_clock_follower_time(&priv->clock, pkt->pts + priv->delay);
+        if (pts == AV_NOPTS_VALUE) {
+            av_packet_free(&pkt);
+            continue;
+        }
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts += pts - pkt->pts;
+        pkt->pts = pts;
 
-        /* Send frame for decoding */
-        err = avcodec_send_packet(priv->avctx, pkt);
+        /* Never wait on the decoder here, the device's own buffer queue is
+         * what overflows if we stop reading. */
+        err = sp_packet_fifo_push(priv->packets, pkt);
         av_packet_free(&pkt);
-        if (err == AVERROR_EOF) {
-            sp_log(entry, SP_LOG_INFO, "Decoder flushed!\n");
-            err = 0;
-            break; /* decoder flushed */
-        } else if (err && (err != AVERROR(EAGAIN))) {
-            sp_log(entry, SP_LOG_ERROR, "Unable to decode frame: %s!\n", av_err2str(err));
-            continue;
+        if (err == AVERROR(ENOBUFS)) {
+            int dropped = atomic_fetch_add(&priv->dropped_packets, 1) + 1;
+            sp_log(entry, SP_LOG_WARN, "Decoder too slow, dropping packet "
+                   "(%i dropped so far)!\n", dropped);
+        } else if (err) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to push packet to FIFO: %s!\n",
+                   av_err2str(err));
+            break;
         }
+    }
+
+    /* EOS, flushes the decoder */
+    sp_packet_fifo_push(priv->packets, NULL);
+
+    return NULL;
+}
+
+static void lavd_send_stats(IOSysEntry *entry, LavdCaptureCtx *priv)
+{
+    double decode_time = 0.0;
+    if (priv->decoded_packets)
+        decode_time = priv->decode_time / (priv->decoded_packets * 1000.0);
+
+    int dropped_packets = atomic_load(&priv->dropped_packets);
+    int device_drops = atomic_load(&priv->device_drops);
+
+    SPGenericData entries[] = {
+        D_TYPE("decode_time", NULL, decode_time),
+        D_TYPE("dropped_packets", NULL, dropped_packets),
+        D_TYPE("device_drops", NULL, device_drops),
+        { 0 },
+    };
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+
+    if (priv->smooth_ts) {
+        double drift_ppm = sp_ts_smoother_drift_ppm(&priv->ts);
+        SPGenericData ts_entries[] = {
+            D_TYPE("clock_drift_ppm", NULL, drift_ppm),
+            D_TYPE("clock_resyncs", NULL, priv->ts.resets),
+            { 0 },
+        };
+        sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, ts_entries);
+    }
+
+    sp_clock_follower_stats(&priv->clock, entry, entry->events);
+
+    priv->decode_time = 0;
+    priv->decoded_packets = 0;
+}
 
+static int lavd_push_frame(IOSysEntry *entry, LavdCaptureCtx *priv, AVFrame *frame)
+{
+    int err;
+
+    /* avcodec_open2 changes the timebase */
+    frame->pts = frame->best_effort_timestamp;
+    if (frame->pts != AV_NOPTS_VALUE)
+        frame->pts = av_rescale_q(frame->pts, priv->avctx->pkt_timebase,
+                                  priv->avctx->time_base);
+
+    if (priv->smooth_ts && frame->pts != AV_NOPTS_VALUE) {
+        int64_t raw = av_rescale_q(frame->pts, priv->avctx->time_base, AV_TIME_BASE_Q);
+        raw = sp_ts_smoother_update(&priv->ts, raw, frame->nb_samples);
+        frame->pts = av_rescale_q(raw, AV_TIME_BASE_Q, priv->avctx->time_base);
+    }
+
+    frame->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
+    FormatExtraData *fe = (FormatExtraData *)frame->opaque_ref->data;
+    fe->time_base       = priv->avctx->time_base;
+    fe->avg_frame_rate  = priv->avctx->framerate;
+
+    sp_log(entry, SP_LOG_TRACE, "Pushing frame to FIFO, pts = %f\n",
+           av_q2d(fe->time_base) * frame->pts);
+
+    err = sp_frame_fifo_push(entry->frames, frame);
+    if (err == AVERROR(ENOBUFS)) {
+        priv->dropped_frames++;
+        sp_log(entry, SP_LOG_WARN, "Dropping frame (%i dropped so far)!\n",
+               priv->dropped_frames);
+
+        SPGenericData entries[] = {
+            D_TYPE("dropped_frames", NULL, priv->dropped_frames),
+            { 0 },
+        };
+        sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+        err = 0;
+    } else if (err) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to push frame to FIFO: %s!\n",
+               av_err2str(err));
+    }
+
+    return err;
+}
+
+/* A packet may hold any number of frames, and with frame threading they come
+ * out delayed, so always drain everything available. Returns 0 once the
+ * decoder wants more input. */
+static int lavd_drain_frames(IOSysEntry *entry, LavdCaptureCtx *priv)
+{
+    while (1) {
         AVFrame *frame = av_frame_alloc();
-        err = avcodec_receive_frame(priv->avctx, frame);
+        int err = avcodec_receive_frame(priv->avctx, frame);
         if (err == AVERROR_EOF) {
             sp_log(entry, SP_LOG_INFO, "Decoder flushed!\n");
             av_frame_free(&frame);
-            err = 0;
-            break;
-        } else if (err && (err != AVERROR(EAGAIN))) {
-            sp_log(entry, SP_LOG_ERROR, "Unable to get decoded frame: %s!\n", av_err2str(err));
+            return err;
+        } else if (err == AVERROR(EAGAIN)) {
             av_frame_free(&frame);
-            goto end;
+            return 0;
+        } else if (err) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to get decoded frame: %s!\n",
+                   av_err2str(err));
+            av_frame_free(&frame);
+            return err;
         }
 
-        /* avcodec_open2 changes the timebase */
-        frame->pts = av_rescale_q(pts, priv->avf->streams[0]->time_base,
-                                  priv->avctx->time_base);
+        err = lavd_push_frame(entry, priv, frame);
+        av_frame_free(&frame);
+        if (err)
+            return err;
+    }
+}
 
-        frame->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
-        FormatExtraData *fe = (FormatExtraData *)frame->opaque_ref->data;
-        fe->time_base       = priv->avctx->time_base;
-        fe->avg_frame_rate  = priv->avctx->framerate;
+static void *lavd_decode_thread(void *s)
+{
+    int err = 0;
+    IOSysEntry *entry = s;
+    LavdCaptureCtx *priv = entry->io_priv;
 
-        sp_log(entry, SP_LOG_TRACE, "Pushing frame to FIFO, pts = %f\n",
-               av_q2d(fe->time_base) * frame->pts);
+    sp_set_thread_name_self(sp_class_get_name(entry));
 
-        /* We don't do this check at the start on since there's still some chance
-         * whatever's consuming the FIFO will be done by now. */
-        err = sp_frame_fifo_push(entry->frames, frame);
-        av_frame_free(&frame);
-        if (err == AVERROR(ENOBUFS)) {
-            priv->dropped_frames++;
-            sp_log(entry, SP_LOG_WARN, "Dropping frame (%i dropped so far)!\n",
-                   priv->dropped_frames);
-
-            SPGenericData entries[] = {
-                D_TYPE("dropped_frames", NULL, priv->dropped_frames),
-                { 0 },
-            };
-            sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_INIT | SP_EVENT_ON_CONFIG, NULL);
+
+    while (1) {
+        AVPacket *pkt = sp_packet_fifo_pop(priv->packets);
+        int flush = !pkt;
+
+        int64_t start = av_gettime_relative();
+
+        /* The decoder only refuses input while it has frames pending, so
+         * drain those and hand it the same packet again. */
+        while ((err = avcodec_send_packet(priv->avctx, pkt)) == AVERROR(EAGAIN)) {
+            err = lavd_drain_frames(entry, priv);
+            if (err) {
+                av_packet_free(&pkt);
+                goto end;
+            }
+        }
+        av_packet_free(&pkt);
+        if (err == AVERROR_EOF) {
+            break;
         } else if (err) {
-            sp_log(entry, SP_LOG_ERROR, "Unable to push frame to FIFO: %s!\n",
-                   av_err2str(err));
+            sp_log(entry, SP_LOG_ERROR, "Unable to decode frame: %s!\n", av_err2str(err));
+            if (flush)
+                break;
+            continue;
+        }
+
+        err = lavd_drain_frames(entry, priv);
+        if (err)
             goto end;
+
+        int64_t now = av_gettime_relative();
+        priv->decode_time += now - start;
+        priv->decoded_packets++;
+
+        if ((now - priv->last_stats) >= 1000000) {
+            lavd_send_stats(entry, priv);
+            priv->last_stats = now;
         }
     }
 
@@ -164,12 +319,14 @@ static int lavd_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *
     LavdCaptureCtx *priv = entry->io_priv;
 
     if (event->ctrl & SP_EVENT_CTRL_START) {
-        priv->epoch = atomic_load(event->epoch);
-        pthread_create(&priv->pull_thread, NULL, lavd_thread, entry);
+        sp_clock_follower_init(&priv->clock, event->clock, atomic_load(event->epoch));
+        pthread_create(&priv->decode_thread, NULL, lavd_decode_thread, entry);
+        pthread_create(&priv->read_thread, NULL, lavd_read_thread, entry);
         return 0;
     } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
         atomic_store(&priv->quit, 1);
-        pthread_join(priv->pull_thread, NULL);
+        pthread_join(priv->read_thread, NULL);
+        pthread_join(priv->decode_thread, NULL);
         return 0;
     } else {
         return AVERROR(ENOTSUP);
@@ -197,21 +354,35 @@ static int lavd_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
 
     priv->main = ctx;
     priv->quit = ATOMIC_VAR_INIT(0);
+    priv->dropped_packets = ATOMIC_VAR_INIT(0);
+    priv->device_drops = ATOMIC_VAR_INIT(0);
     priv->src = (AVInputFormat *)iosys_entry->api_priv;
     priv->src_name = av_strdup(priv->src->name);
 
+    /* Bandwidth of the audio timestamp smoothing loop, in Hz, 0 disables it */
+    double ts_bandwidth = 0.1;
+    const char *ts_smoothing = dict_get(opts, "ts_smoothing");
+    if (ts_smoothing && sp_is_number(ts_smoothing))
+        ts_bandwidth = strtod(ts_smoothing, NULL);
+
+    /* Decoding threads, 0 picks them automatically */
+    int decode_threads = 0;
+    const char *decode_threads_str = dict_get(opts, "decode_threads");
+    if (decode_threads_str && sp_is_number(decode_threads_str))
+        decode_threads = strtol(decode_threads_str, NULL, 10);
+
     err = avformat_open_input(&priv->avf, sp_class_get_name(iosys_entry), priv->src, &opts);
     if (err) {
         sp_log(ctx, SP_LOG_ERROR, "Unable to open context for source \"%s\": %s\n",
                priv->src->name, av_err2str(err));
-        return err;
+        goto fail;
     }
 
     err = avformat_find_stream_info(priv->avf, NULL);
     if (err) {
         sp_log(ctx, SP_LOG_ERROR, "Unable to get stream info for source \"%s\": %s\n",
                priv->src->name, av_err2str(err));
-        return err;
+        goto fail;
     }
 
     sp_class_set_name(iosys_entry, priv->avf->iformat->name);
@@ -225,13 +396,33 @@ static int lavd_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
     avcodec_parameters_to_context(priv->avctx, codecpar);
     priv->avctx->time_base = priv->avf->streams[0]->time_base;
     priv->avctx->framerate = priv->avf->streams[0]->avg_frame_rate;
+    priv->avctx->pkt_timebase = priv->avf->streams[0]->time_base;
+    priv->avctx->thread_count = decode_threads;
+    priv->avctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
     err = avcodec_open2(priv->avctx, codec, NULL);
 	if (err) {
 		sp_log(ctx, SP_LOG_ERROR, "Cannot open encoder: %s!\n", av_err2str(err));
-		return err;
+		goto fail;
 	}
 
+    priv->smooth_ts = priv->avctx->codec_type == AVMEDIA_TYPE_AUDIO &&
+                      priv->avctx->sample_rate > 0 && ts_bandwidth > 0.0;
+    if (priv->smooth_ts)
+        sp_ts_smoother_init(&priv->ts, priv->avctx->sample_rate, ts_bandwidth);
+
+    priv->last_pkt_pts = AV_NOPTS_VALUE;
+    if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+        priv->avf->streams[0]->avg_frame_rate.num > 0)
+        priv->frame_duration = av_rescale_q(1, av_inv_q(priv->avf->streams[0]->avg_frame_rate),
+                                            priv->avf->streams[0]->time_base);
+
+    priv->packets = sp_packet_fifo_create(iosys_entry, 16, PACKET_FIFO_BLOCK_NO_INPUT);
+    if (!priv->packets) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
     iosys_entry->io_priv = priv;
     iosys_entry->frames = sp_frame_fifo_create(iosys_entry, 0, 0);
     iosys_entry->ctrl = lavd_ioctx_ctrl;
@@ -240,6 +431,14 @@ static int lavd_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
     priv->main = (LavdCtx *)priv->main_ref->data;
 
     return 0;
+
+fail:
+    avcodec_free_context(&priv->avctx);
+    avformat_close_input(&priv->avf);
+    av_free(priv->src_name);
+    av_free(priv);
+
+    return err;
 }
 
 static const char *blacklist[] = {
@@ -262,12 +461,15 @@ static void destroy_entry(void *opaque, uint8_t *data)
         LavdCaptureCtx *priv = entry->io_priv;
 
         atomic_store(&priv->quit, 1);
-        pthread_join(priv->pull_thread, NULL);
+        pthread_join(priv->read_thread, NULL);
+        pthread_join(priv->decode_thread, NULL);
 
         /* EOS */
         sp_frame_fifo_push(entry->frames, NULL);
 
         /* Free */
+        av_buffer_unref(&priv->packets);
+        sp_clock_follower_uninit(&priv->clock);
         avcodec_free_context(&priv->avctx);
         avformat_flush(priv->avf);
         avformat_close_input(&priv->avf);
@@ -23,13 +23,18 @@
 #include <libavutil/channel_layout.h>
 #include <libavutil/crc.h>
 #include <libavutil/version.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
 
 #include <pulse/pulseaudio.h>
 
 #include "iosys_common.h"
 #include <libtxproto/utils.h>
+#include <libtxproto/clock.h>
 #include "ctrl_template.h"
 #include "utils.h"
+#include "os_compat.h"
+#include "sampleconv.h"
 #include "../config.h"
 
 const IOSysAPI src_pulse;
@@ -74,12 +79,43 @@ typedef struct PulsePriv {
     AVBufferPool *pool;
     int pool_entry_size;
 
+    /* Capture conversion, straight into the output frame */
+    enum AVSampleFormat out_fmt;
+    SPSampleConvFn conv;
+
     /* Stats */
     int dropped_samples;
 
     /* First frame delivered minus epoch */
     int64_t delay;
 
+    /* Capture timestamp smoothing */
+    int smooth_ts;
+    SPTimestampSmoother ts;
+
+    /* Pipeline's master clock. If it's ours, our timeline is the number of
+     * samples captured since the first. */
+    SPClockFollower follow;
+    int64_t clock_samples;
+
+    /* Playback */
+    int playback;
+    int quit;
+    int playback_running;
+    pthread_t playback_thread;
+    SwrContext *swr;
+    AVChannelLayout swr_in_layout;
+    int swr_in_rate;
+    int swr_in_format;
+    AVChannelLayout out_layout;
+    int out_rate;
+    int64_t latency;      /* Targeted, in microseconds */
+    int64_t play_offset;  /* Playback time minus frame time, on the first frame */
+    int64_t max_drift;
+    int64_t last_stats;
+    int underruns;
+    int corrections;
+
     /* Info */
     int sample_rate;
     enum AVSampleFormat sample_fmt;
@@ -191,8 +227,7 @@ static const AVChannelLayout pa_to_lavu_ch_map(const pa_channel_map *ch_map)
 
 static int frame_get_pool_buffer(PulsePriv *priv, AVFrame *f)
 {
-    int ret = av_samples_get_buffer_size(&f->linesize[0],
-                                         f->ch_layout.nb_channels,
+    int ret = av_samples_get_buffer_size(NULL, f->ch_layout.nb_channels,
                                          f->nb_samples, f->format, 0);
     if (ret < 0)
         return ret;
@@ -200,15 +235,20 @@ static int frame_get_pool_buffer(PulsePriv *priv, AVFrame *f)
     if (!priv->pool || ret > priv->pool_entry_size) {
         av_buffer_pool_uninit(&priv->pool);
         priv->pool = av_buffer_pool_init2(ret, NULL, NULL, NULL);
+        priv->pool_entry_size = ret;
     }
 
     AVBufferRef *buf = av_buffer_pool_get(priv->pool);
     if (!buf)
         return AVERROR(ENOMEM);
 
-    /* This assumes data is not planar */
+    /* Planes are contiguous within one buffer, we only ever have up to 2 */
     f->buf[0] = buf;
-    f->data[0] = f->buf[0]->data;
+    ret = av_samples_fill_arrays(f->data, &f->linesize[0], buf->data,
+                                 f->ch_layout.nb_channels, f->nb_samples,
+                                 f->format, 0);
+    if (ret < 0)
+        return ret;
     f->extended_data = f->data;
 
     return 0;
@@ -239,6 +279,8 @@ static void stream_read_cb(pa_stream *stream, size_t size, void *data)
     f->format           = format_map[ss->format].av_format;
     f->ch_layout        = pa_to_lavu_ch_map(ch_map);
     f->nb_samples       = (size / av_get_bytes_per_sample(f->format)) / f->ch_layout.nb_channels;
+    if (priv->conv)
+        f->format       = priv->out_fmt;
     f->opaque_ref       = av_buffer_allocz(sizeof(FormatExtraData));
 
     FormatExtraData *fe = (FormatExtraData *)f->opaque_ref->data;
@@ -248,22 +290,13 @@ static void stream_read_cb(pa_stream *stream, size_t size, void *data)
     /* Allocate the frame. */
     frame_get_pool_buffer(priv, f);
 
-    /* Copy samples */
+    /* Copy samples. Pulseaudio's definition of PA_SAMPLE_S24_32 is to have
+     * the padding in the MSB's, so that always needs converting. */
     if (buffer) {
-        if (fe->bits_per_sample == 24) {
-            /* *sigh*
-             * Pulseaudio's definition of PA_SAMPLE_S24_32 is to have the padding
-             * in the MSB's. This is completely stupid and against what everyone
-             * sane does. So we have an easy-to-SIMD copy that hopefully compilers
-             * get right and actually SIMD. */
-            size >>= 2;
-            const uint32_t *src = buffer;
-            int32_t *dst = (int32_t *)f->data[0];
-            for (int i = 0; i < size; i++)
-                dst[i] = src[i] << 8;
-        } else {
+        if (priv->conv)
+            priv->conv(f->data, buffer, f->nb_samples, f->ch_layout.nb_channels);
+        else
             memcpy(f->data[0], buffer, size);
-        }
     } else { /* There's a hole */
         av_samples_set_silence(f->data, 0, f->nb_samples, f->ch_layout.nb_channels, f->format);
     }
@@ -283,9 +316,42 @@ static void stream_read_cb(pa_stream *stream, size_t size, void *data)
         f->pts = AV_NOPTS_VALUE;
     }
 
+    /* The server's timing jitters by a few milliseconds between fragments */
+    if (priv->smooth_ts) {
+        f->pts = sp_ts_smoother_update(&priv->ts, f->pts, f->nb_samples);
+
+        int64_t now = av_gettime_relative();
+        if ((now - priv->last_stats) >= 1000000) {
+            double drift_ppm = sp_ts_smoother_drift_ppm(&priv->ts);
+            SPGenericData entries[] = {
+                D_TYPE("clock_drift_ppm", NULL, drift_ppm),
+                D_TYPE("clock_resyncs", NULL, priv->ts.resets),
+                { 0 },
+            };
+            sp_eventlist_dispatch(iosys_entry, iosys_entry->events, SP_EVENT_ON_STATS, entries);
+            priv->last_stats = now;
+        }
+    }
+
     /* Copied, and pts calculated, we can drop the buffer now */
     pa_stream_drop(stream);
 
+    if (sp_clock_is_active(iosys_entry->clock)) {
+        int64_t time = av_rescale(priv->clock_samples, 1000000, f->sample_rate);
+        if (f->pts != AV_NOPTS_VALUE)
+            sp_clock_update(iosys_entry->clock, f->pts + priv->epoch, time,
+                            priv->smooth_ts ? priv->ts.scale : 1.0);
+        f->pts = time;
+        priv->clock_samples += f->nb_samples;
+    } else if (f->pts != AV_NOPTS_VALUE) {
+        /* Without a master, this is the plain epoch subtraction again */
+        f->pts = sp_clock_follower_time(&priv->follow, f->pts + priv->epoch);
+        if (f->pts == AV_NOPTS_VALUE) {
+            av_frame_free(&f);
+            return;
+        }
+    }
+
     int nb_samples = f->nb_samples;
     sp_log(iosys_entry, SP_LOG_TRACE, "Pushing frame to FIFO, pts = %f, len = %.2f ms\n",
            av_q2d(fe->time_base) * f->pts, (1000.0f * nb_samples) / f->sample_rate);
@@ -298,6 +364,203 @@ static void stream_read_cb(pa_stream *stream, size_t size, void *data)
                av_err2str(err));
         /* Fatal error happens here */
     }
+
+    sp_clock_follower_stats(&priv->follow, iosys_entry, iosys_entry->events);
+}
+
+static void stream_write_cb(pa_stream *stream, size_t size, void *data)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)data;
+    PulsePriv *priv = iosys_entry->api_priv;
+    pa_threaded_mainloop_signal(priv->main->pa_mainloop, 0);
+}
+
+static void stream_underflow_cb(pa_stream *stream, void *data)
+{
+    IOSysEntry *iosys_entry = (IOSysEntry *)data;
+    PulsePriv *priv = iosys_entry->api_priv;
+    priv->underruns++;
+    sp_log(iosys_entry, SP_LOG_DEBUG, "Playback underrun!\n");
+}
+
+static int playback_swr_configure(IOSysEntry *iosys_entry, PulsePriv *priv, AVFrame *f)
+{
+    if (priv->swr && priv->swr_in_rate == f->sample_rate &&
+        priv->swr_in_format == f->format &&
+        !av_channel_layout_compare(&priv->swr_in_layout, &f->ch_layout))
+        return 0;
+
+    /* Anything left from the old configuration is lost */
+    swr_free(&priv->swr);
+    priv->swr = swr_alloc();
+    if (!priv->swr)
+        return AVERROR(ENOMEM);
+
+    av_opt_set_int       (priv->swr, "in_sample_rate",  f->sample_rate,      0);
+    av_opt_set_chlayout  (priv->swr, "in_chlayout",     &f->ch_layout,       0);
+    av_opt_set_sample_fmt(priv->swr, "in_sample_fmt",   f->format,           0);
+
+    av_opt_set_int       (priv->swr, "out_sample_rate", priv->out_rate,     0);
+    av_opt_set_chlayout  (priv->swr, "out_chlayout",    &priv->out_layout,   0);
+    av_opt_set_sample_fmt(priv->swr, "out_sample_fmt",  AV_SAMPLE_FMT_FLT,   0);
+
+    int err = swr_init(priv->swr);
+    if (err < 0) {
+        sp_log(iosys_entry, SP_LOG_ERROR, "Could not init swr context: %s!\n", av_err2str(err));
+        swr_free(&priv->swr);
+        return err;
+    }
+
+    av_channel_layout_uninit(&priv->swr_in_layout);
+    av_channel_layout_copy(&priv->swr_in_layout, &f->ch_layout);
+    priv->swr_in_rate = f->sample_rate;
+    priv->swr_in_format = f->format;
+
+    return 0;
+}
+
+/* Keeps playback at a constant offset from the pipeline epoch. Frames which
+ * arrive late have their start dropped, gaps in the input are filled with
+ * silence. Called with the mainloop locked. */
+static void playback_track_drift(IOSysEntry *iosys_entry, PulsePriv *priv, AVFrame *f)
+{
+    AVRational tb = f->time_base;
+    if (f->opaque_ref)
+        tb = ((FormatExtraData *)f->opaque_ref->data)->time_base;
+    if (f->pts == AV_NOPTS_VALUE || !tb.num)
+        return;
+
+    int neg = 0;
+    pa_usec_t latency = 0;
+    if (pa_stream_get_latency(priv->stream, &latency, &neg) != PA_OK)
+        return;
+
+    /* When the first sample of this frame will be heard */
+    int64_t play_t = av_gettime_relative() - priv->epoch +
+                     swr_get_delay(priv->swr, 1000000) +
+                     (neg ? -(int64_t)latency : (int64_t)latency);
+    int64_t frame_t = av_rescale_q(f->pts, tb, AV_TIME_BASE_Q);
+
+    if (priv->play_offset == INT64_MIN) {
+        priv->play_offset = play_t - frame_t;
+        return;
+    }
+
+    int64_t drift = play_t - frame_t - priv->play_offset;
+    if (FFABS(drift) <= priv->max_drift)
+        return;
+
+    int nb_samples = av_rescale(FFABS(drift), priv->out_rate, 1000000);
+    if (drift > 0)
+        swr_drop_output(priv->swr, nb_samples);
+    else
+        swr_inject_silence(priv->swr, nb_samples);
+
+    priv->corrections++;
+    sp_log(iosys_entry, SP_LOG_DEBUG, "Playback %s by %.2f ms, %s %i samples\n",
+           drift > 0 ? "late" : "early", drift / 1000.0,
+           drift > 0 ? "dropping" : "inserting", nb_samples);
+}
+
+static void playback_stats(IOSysEntry *iosys_entry, PulsePriv *priv)
+{
+    int64_t now = av_gettime_relative();
+    if ((now - priv->last_stats) < 1000000)
+        return;
+
+    int neg = 0;
+    pa_usec_t latency = 0;
+    pa_stream_get_latency(priv->stream, &latency, &neg);
+    double latency_ms = (neg ? -(double)latency : (double)latency) / 1000.0;
+
+    SPGenericData entries[] = {
+        D_TYPE("latency", NULL, latency_ms),
+        D_TYPE("underruns", NULL, priv->underruns),
+        D_TYPE("drift_corrections", NULL, priv->corrections),
+        { 0 },
+    };
+    sp_eventlist_dispatch(iosys_entry, iosys_entry->events, SP_EVENT_ON_STATS, entries);
+
+    priv->last_stats = now;
+}
+
+/* Writes everything swr has buffered, called with the mainloop locked */
+static int playback_write(IOSysEntry *iosys_entry, PulsePriv *priv)
+{
+    const int bpf = av_get_bytes_per_sample(AV_SAMPLE_FMT_FLT) * priv->out_layout.nb_channels;
+
+    while (!priv->quit && swr_get_out_samples(priv->swr, 0) > 0) {
+        size_t size = pa_stream_writable_size(priv->stream);
+        if (size == (size_t)-1)
+            return AVERROR_EXTERNAL;
+        if (size < bpf) {
+            pa_threaded_mainloop_wait(priv->main->pa_mainloop);
+            continue;
+        }
+
+        /* Convert straight into the server's buffer */
+        void *buf;
+        if (pa_stream_begin_write(priv->stream, &buf, &size) < 0)
+            return AVERROR_EXTERNAL;
+
+        uint8_t *dst = buf;
+        int nb_samples = swr_convert(priv->swr, &dst, size / bpf, NULL, 0);
+        if (nb_samples <= 0) {
+            pa_stream_cancel_write(priv->stream);
+            return nb_samples;
+        }
+
+        if (pa_stream_write(priv->stream, buf, nb_samples * bpf, NULL, 0,
+                            PA_SEEK_RELATIVE) < 0)
+            return AVERROR_EXTERNAL;
+    }
+
+    return 0;
+}
+
+static void *playback_thread(void *arg)
+{
+    int err = 0;
+    IOSysEntry *iosys_entry = arg;
+    PulsePriv *priv = iosys_entry->api_priv;
+    PulseCtx *ctx = priv->main;
+
+    sp_set_thread_name_self(sp_class_get_name(iosys_entry));
+
+    while (1) {
+        AVFrame *f = sp_frame_fifo_pop(iosys_entry->frames);
+        if (!f)
+            break;
+
+        pa_threaded_mainloop_lock(ctx->pa_mainloop);
+
+        err = playback_swr_configure(iosys_entry, priv, f);
+        if (err >= 0) {
+            playback_track_drift(iosys_entry, priv, f);
+            err = swr_convert(priv->swr, NULL, 0, (const uint8_t **)f->extended_data,
+                              f->nb_samples);
+        }
+        if (err >= 0)
+            err = playback_write(iosys_entry, priv);
+        if (err >= 0)
+            playback_stats(iosys_entry, priv);
+
+        int quit = priv->quit;
+        pa_threaded_mainloop_unlock(ctx->pa_mainloop);
+        av_frame_free(&f);
+
+        if (err < 0) {
+            sp_log(iosys_entry, SP_LOG_ERROR, "Playback failed: %s!\n", av_err2str(err));
+            sp_eventlist_dispatch(iosys_entry, iosys_entry->events, SP_EVENT_ON_ERROR, NULL);
+            break;
+        } else if (quit) {
+            break;
+        }
+    }
+
+    sp_log(iosys_entry, SP_LOG_VERBOSE, "Playback stopped!\n");
+
+    return NULL;
 }
 
 static void stream_status_cb(pa_stream *stream, void *data)
@@ -330,7 +593,7 @@ static void stream_status_cb(pa_stream *stream, void *data)
         return;
     case PA_STREAM_UNCONNECTED:
     case PA_STREAM_FAILED: /* Unclean termination */
-        sp_log(iosys_entry, SP_LOG_ERROR, "Capture stream failed: %s!\n",
+        sp_log(iosys_entry, SP_LOG_ERROR, "Stream failed: %s!\n",
                pa_strerror(pa_context_errno(priv->main->pa_context)));
         sp_eventlist_dispatch(iosys_entry, iosys_entry->events, SP_EVENT_ON_ERROR, NULL);
         return;
@@ -387,18 +650,47 @@ static int pulse_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry, AVDictionary
     const char *target_name = sp_class_get_name(iosys_entry);
 
     int is_sink = sp_class_get_type(iosys_entry) & SP_TYPE_AUDIO_SINK;
-    if (!is_sink)
+
+    /* Sinks are captured through their monitor, unless opened for playback */
+    const char *mode = dict_get(opts, "mode");
+    priv->playback = is_sink && mode && !strcmp(mode, "playback");
+    if (mode && strcmp(mode, "capture") && !priv->playback) {
+        sp_log(ctx, SP_LOG_ERROR, "Unsupported mode \"%s\" for \"%s\"!\n",
+               mode, sp_class_get_name(iosys_entry));
+        err = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    if (priv->playback) {
+        /* Frames are pulled at the rate the server plays them */
+        sp_class_set_type(iosys_entry, SP_TYPE_AUDIO_SINK);
+        iosys_entry->frames = sp_frame_fifo_create(iosys_entry, 16,
+                                                   FRAME_FIFO_BLOCK_NO_INPUT |
+                                                   FRAME_FIFO_BLOCK_MAX_OUTPUT);
+    } else if (!is_sink) {
         iosys_entry->frames = sp_frame_fifo_create(iosys_entry, 0, 0);
-    else
+    } else {
         iosys_entry->frames = sp_frame_fifo_create(iosys_entry, 16, FRAME_FIFO_BLOCK_NO_INPUT);
+    }
+
+    /* Captures can be the pipeline's master clock */
+    if (!priv->playback && !iosys_entry->clock) {
+        iosys_entry->clock = sp_clock_alloc(iosys_entry);
+        if (!iosys_entry->clock) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
 
     priv->main = (PulseCtx *)ctx_ref->data;
 
     pa_sample_spec req_ss = priv->ss;
     pa_channel_map req_map = priv->map;
 
-    /* Filter out useless formats */
+    /* Filter out useless formats, playback is converted to float by us */
     req_ss.format = pulse_remap_to_useful[req_ss.format];
+    if (priv->playback)
+        req_ss.format = PA_SAMPLE_FLOAT32NE;
 
     /* We don't care about the rate as we'll have to resample ourselves anyway */
     if (req_ss.rate <= 0) {
@@ -408,6 +700,43 @@ static int pulse_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry, AVDictionary
         goto fail;
     }
 
+    /* Convert in the capture callback, rather than leaving it to the
+     * consumer, if a format was asked for */
+    enum AVSampleFormat native_fmt = format_map[req_ss.format].av_format;
+    priv->out_fmt = native_fmt;
+    priv->conv = NULL;
+    if (!priv->playback && dict_get(opts, "sample_fmt")) {
+        const char *fmt_str = dict_get(opts, "sample_fmt");
+        priv->out_fmt = av_get_sample_fmt(fmt_str);
+        if (priv->out_fmt == AV_SAMPLE_FMT_NONE) {
+            sp_log(ctx, SP_LOG_ERROR, "Invalid sample format \"%s\"!\n", fmt_str);
+            err = AVERROR(EINVAL);
+            goto fail;
+        }
+    }
+
+    if (!priv->playback && (priv->out_fmt != native_fmt ||
+                            req_ss.format == PA_SAMPLE_S24_32NE)) {
+        const char *conv_impl = NULL;
+        int conv_src = req_ss.format == PA_SAMPLE_S16NE     ? SP_SAMPLE_SRC_S16    :
+                       req_ss.format == PA_SAMPLE_S24_32NE  ? SP_SAMPLE_SRC_S24_32 :
+                       req_ss.format == PA_SAMPLE_S32NE     ? SP_SAMPLE_SRC_S32    :
+                       req_ss.format == PA_SAMPLE_FLOAT32NE ? SP_SAMPLE_SRC_FLT    : -1;
+        if (conv_src >= 0)
+            priv->conv = sp_sampleconv_get(conv_src, priv->out_fmt, &conv_impl);
+        if (!priv->conv) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to convert from %s to %s!\n",
+                   pa_sample_format_to_string(req_ss.format),
+                   av_get_sample_fmt_name(priv->out_fmt));
+            err = AVERROR(ENOTSUP);
+            goto fail;
+        }
+
+        sp_log(iosys_entry, SP_LOG_VERBOSE, "Converting %s to %s while capturing (%s)\n",
+               pa_sample_format_to_string(req_ss.format),
+               av_get_sample_fmt_name(priv->out_fmt), conv_impl);
+    }
+
     /* Check for crazy layouts, TODO: FIXME */
     if (req_map.channels == 1)
         pa_channel_map_init_mono(&req_map);
@@ -437,9 +766,47 @@ static int pulse_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry, AVDictionary
     else
         attr.fragsize = -1;
 
+    /* Bandwidth of the timestamp smoothing loop, in Hz, 0 disables it */
+    double ts_bandwidth = 0.1;
+    const char *ts_smoothing = dict_get(opts, "ts_smoothing");
+    if (ts_smoothing && sp_is_number(ts_smoothing))
+        ts_bandwidth = strtod(ts_smoothing, NULL);
+    priv->smooth_ts = !priv->playback && ts_bandwidth > 0.0;
+    if (priv->smooth_ts)
+        sp_ts_smoother_init(&priv->ts, req_ss.rate, ts_bandwidth);
+
+    if (priv->playback) {
+        /* The server keeps latency_ms queued, and starts playing once half
+         * of that has been written */
+        priv->latency = 40 * 1000;
+        const char *latency_ms = dict_get(opts, "latency_ms");
+        if (latency_ms && sp_is_number(latency_ms))
+            priv->latency = SPMIN(lrintf(strtof(latency_ms, NULL) * 1000), UINT32_MAX);
+
+        attr.fragsize  = -1;
+        attr.tlength   = pa_usec_to_bytes((uint32_t)priv->latency, &req_ss);
+        attr.prebuf    = pa_usec_to_bytes((uint32_t)priv->latency / 2, &req_ss);
+        attr.minreq    = -1;
+        attr.maxlength = -1;
+
+        priv->max_drift = SPMAX(priv->latency, 20 * 1000);
+        const char *max_drift_ms = dict_get(opts, "max_drift_ms");
+        if (max_drift_ms && sp_is_number(max_drift_ms))
+            priv->max_drift = lrintf(strtof(max_drift_ms, NULL) * 1000);
+
+        priv->play_offset = INT64_MIN;
+        priv->out_layout = pa_to_lavu_ch_map(&req_map);
+        priv->out_rate = req_ss.rate;
+    }
+
     /* Set stream callbacks */
     pa_stream_set_state_callback(priv->stream, stream_status_cb, iosys_entry);
-    pa_stream_set_read_callback(priv->stream, stream_read_cb, iosys_entry);
+    if (priv->playback) {
+        pa_stream_set_write_callback(priv->stream, stream_write_cb, iosys_entry);
+        pa_stream_set_underflow_callback(priv->stream, stream_underflow_cb, iosys_entry);
+    } else {
+        pa_stream_set_read_callback(priv->stream, stream_read_cb, iosys_entry);
+    }
 
     if (priv->type == PULSE_SINK_INPUT) {
         /* First, find the sink to which the sink input is connected to */
@@ -481,16 +848,27 @@ static int pulse_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry, AVDictionary
     }
 
     /* Start stream */
-    err = pa_stream_connect_record(priv->stream, target_name, &attr,
-                                   PA_STREAM_ADJUST_LATENCY     |
-                                   PA_STREAM_NOT_MONOTONIC      |
-                                   PA_STREAM_AUTO_TIMING_UPDATE |
-                                   PA_STREAM_INTERPOLATE_TIMING |
-                                   PA_STREAM_DONT_MOVE          |
-                                   PA_STREAM_START_CORKED       |
-                                   PA_STREAM_NOFLAGS);
+    if (priv->playback)
+        err = pa_stream_connect_playback(priv->stream, target_name, &attr,
+                                         PA_STREAM_ADJUST_LATENCY     |
+                                         PA_STREAM_NOT_MONOTONIC      |
+                                         PA_STREAM_AUTO_TIMING_UPDATE |
+                                         PA_STREAM_INTERPOLATE_TIMING |
+                                         PA_STREAM_DONT_MOVE          |
+                                         PA_STREAM_START_CORKED,
+                                         NULL, NULL);
+    else
+        err = pa_stream_connect_record(priv->stream, target_name, &attr,
+                                       PA_STREAM_ADJUST_LATENCY     |
+                                       PA_STREAM_NOT_MONOTONIC      |
+                                       PA_STREAM_AUTO_TIMING_UPDATE |
+                                       PA_STREAM_INTERPOLATE_TIMING |
+                                       PA_STREAM_DONT_MOVE          |
+                                       PA_STREAM_START_CORKED       |
+                                       PA_STREAM_NOFLAGS);
     if (err) {
-        sp_log(ctx, SP_LOG_ERROR, "pa_stream_connect_record() failed: %s!\n",
+        sp_log(ctx, SP_LOG_ERROR, "pa_stream_connect_%s() failed: %s!\n",
+               priv->playback ? "playback" : "record",
                pa_strerror(pa_context_errno(ctx->pa_context)));
         err = AVERROR(EINVAL);
         goto fail;
@@ -519,6 +897,28 @@ fail:
     return err;
 }
 
+static void stop_playback(IOSysEntry *iosys_entry, PulsePriv *priv)
+{
+    if (!priv->playback_running)
+        return;
+
+    pa_threaded_mainloop_lock(priv->main->pa_mainloop);
+    priv->quit = 1;
+    pa_threaded_mainloop_signal(priv->main->pa_mainloop, 0);
+    pa_threaded_mainloop_unlock(priv->main->pa_mainloop);
+
+    sp_frame_fifo_push(iosys_entry->frames, NULL);
+    pthread_join(priv->playback_thread, NULL);
+    priv->playback_running = 0;
+
+    /* Nothing pulls frames anymore, so whatever pushes them must not block
+     * on a full FIFO. Blocking is restored when playback restarts. */
+    AVFrame *f;
+    sp_frame_fifo_set_block_flags(iosys_entry->frames, FRAME_FIFO_BLOCK_NO_INPUT);
+    while (sp_frame_fifo_pop_flags(iosys_entry->frames, &f, FRAME_FIFO_PULL_NO_BLOCK) >= 0)
+        av_frame_free(&f);
+}
+
 static int pulse_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *ctx,
                                void *dep_ctx, void *data)
 {
@@ -530,11 +930,27 @@ static int pulse_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void
     if (event->ctrl & SP_EVENT_CTRL_START) {
         pa_threaded_mainloop_lock(priv->main->pa_mainloop);
         priv->epoch = atomic_load(event->epoch);
+        priv->clock_samples = 0;
+        sp_clock_follower_init(&priv->follow, event->clock, priv->epoch);
+        priv->quit = 0;
         int ret = waitop(priv->main, pa_stream_cork(priv->stream, 0, stream_success_cb, priv));
+        if (ret >= 0 && priv->playback && !priv->playback_running) {
+            sp_frame_fifo_set_block_flags(iosys_entry->frames,
+                                          FRAME_FIFO_BLOCK_NO_INPUT |
+                                          FRAME_FIFO_BLOCK_MAX_OUTPUT);
+            ret = AVERROR(pthread_create(&priv->playback_thread, NULL,
+                                         playback_thread, iosys_entry));
+            if (ret < 0)
+                sp_log(iosys_entry, SP_LOG_ERROR, "Unable to start playback: %s!\n",
+                       av_err2str(ret));
+            else
+                priv->playback_running = 1;
+        }
         if (ret >= 0)
             sp_eventlist_dispatch(iosys_entry, iosys_entry->events, SP_EVENT_ON_INIT, NULL);
         return ret;
     } else if (event->ctrl & SP_EVENT_CTRL_STOP) {
+        stop_playback(iosys_entry, priv);
         pa_threaded_mainloop_lock(priv->main->pa_mainloop);
         return waitop(priv->main, pa_stream_cork(priv->stream, 1, stream_success_cb, priv));
     } else {
@@ -555,6 +971,8 @@ static void destroy_entry(void *opaque, uint8_t *data)
     PulsePriv *priv = entry->api_priv;
     PulseCtx *ctx = priv->main;
 
+    stop_playback(entry, priv);
+
     if (priv->stream) {
         /* Drain it */
         pa_threaded_mainloop_lock(ctx->pa_mainloop);
@@ -579,6 +997,13 @@ static void destroy_entry(void *opaque, uint8_t *data)
     sp_bufferlist_free(&entry->events);
     av_buffer_pool_uninit(&priv->pool);
 
+    sp_clock_follower_uninit(&priv->follow);
+    av_buffer_unref(&entry->clock);
+
+    swr_free(&priv->swr);
+    av_channel_layout_uninit(&priv->swr_in_layout);
+    av_channel_layout_uninit(&priv->out_layout);
+
     av_free(priv);
     av_free(entry->desc);
     sp_class_free(entry);
@@ -27,11 +27,17 @@
 #include <libavutil/bprint.h>
 #include <libavutil/buffer.h>
 #include <libavutil/time.h>
+#include <libavutil/version.h>
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(58, 33, 100)
+#include <libavutil/video_hint.h>
+#define HAVE_VIDEO_HINT 1
+#endif
 
 #include "wayland_common.h"
 
 #include <libtxproto/utils.h>
 #include <libtxproto/log.h>
+#include <libtxproto/clock.h>
 #include "iosys_common.h"
 #include "ctrl_template.h"
 #include "utils.h"
@@ -57,24 +63,35 @@ enum WaylandCaptureMode {
     CAP_MODE_SCRCPY_DMABUF,
 };
 
+#define MAX_DAMAGE_RECTS 32
+
 typedef struct WaylandCapturePriv {
     WaylandCaptureCtx *main;
     AVBufferRef *main_ref;
 
-    int64_t epoch;
+    SPClockFollower clock;
     int oneshot;
 
     /* Stats */
     int dropped_frames;
+    int64_t last_stats;
+    int64_t stats_frames;
+    int64_t stats_damaged; /* In pixels */
 
     /* Framerate limiting */
     AVRational frame_rate;
-    int64_t next_frame_ts;
+    SPPacer pacer;
     int64_t frame_delay;
 
     /* Capture options */
     enum WaylandCaptureMode capture_mode;
     int capture_cursor;
+    int copy_with_damage;
+
+    /* Damage of the frame being copied, merged into one rectangle
+     * if there are too many */
+    SPRect damage[MAX_DAMAGE_RECTS];
+    int nb_damage;
 
     /* Frame being signalled */
     AVFrame *frame;
@@ -186,6 +203,21 @@ static void cleanup_state(IOSysEntry *entry, struct zwlr_export_dmabuf_frame_v1
 
 static void schedule_frame(IOSysEntry *entry);
 
+static void pace_frame(IOSysEntry *entry, WaylandCapturePriv *priv)
+{
+    int64_t overruns = priv->pacer.overruns;
+
+    sp_pacer_wait(&priv->pacer);
+
+    if (priv->pacer.overruns != overruns) {
+        SPGenericData entries[] = {
+            D_TYPE("tick_overruns", NULL, priv->pacer.overruns),
+            { 0 },
+        };
+        sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+    }
+}
+
 static void dmabuf_frame_free(void *opaque, uint8_t *data)
 {
     AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)data;
@@ -378,8 +410,13 @@ static void dmabuf_frame_ready(void *data, struct zwlr_export_dmabuf_frame_v1 *f
     /* Delay */
     int64_t delay = presented - ((tsp.tv_sec * 1000000000) + tsp.tv_nsec);
 
-    priv->frame->pts = av_add_stable(fe->time_base, delay, av_make_q(1, 1000000),
-                                     av_gettime_relative() - priv->epoch);
+    int64_t now = sp_clock_follower_time(&priv->clock, av_gettime_relative());
+    if (now == AV_NOPTS_VALUE) {
+        av_frame_free(&priv->frame);
+        goto next;
+    }
+
+    priv->frame->pts = av_add_stable(fe->time_base, delay, av_make_q(1, 1000000), now);
 
 	/* Attach the hardware frame context to the frame */
     if ((err = attach_drm_frames_ref(entry, priv->frame, sw_fmt)))
@@ -408,21 +445,12 @@ static void dmabuf_frame_ready(void *data, struct zwlr_export_dmabuf_frame_v1 *f
         goto fail;
     }
 
+    sp_clock_follower_stats(&priv->clock, entry, entry->events);
+
+next:
     /* Framerate limiting */
-    if (priv->frame_delay) {
-        int64_t now = av_gettime_relative();
-        if (priv->next_frame_ts && (now < priv->next_frame_ts)) {
-            int64_t wait_time;
-            while (1) {
-                wait_time = priv->next_frame_ts - now;
-                if (wait_time <= 0)
-                    break;
-                av_usleep(wait_time);
-                now = av_gettime_relative();
-            }
-        }
-        priv->next_frame_ts = now + priv->frame_delay;
-    }
+    if (priv->frame_delay)
+        pace_frame(entry, priv);
 
     schedule_frame(entry);
 
@@ -755,7 +783,12 @@ static void scrcpy_frame_info_done(void *data, struct zwlr_screencopy_frame_v1 *
 
     priv->frame->sample_aspect_ratio = av_make_q(1, 1);
 
-    zwlr_screencopy_frame_v1_copy(frame, dst);
+    /* The compositor only answers once something has changed */
+    priv->nb_damage = 0;
+    if (priv->copy_with_damage)
+        zwlr_screencopy_frame_v1_copy_with_damage(frame, dst);
+    else
+        zwlr_screencopy_frame_v1_copy(frame, dst);
 
     pthread_mutex_unlock(&priv->frame_obj_lock);
 
@@ -789,7 +822,90 @@ static void scrcpy_frame_flags(void *data, struct zwlr_screencopy_frame_v1 *fram
 static void scrcpy_frame_damages(void *data, struct zwlr_screencopy_frame_v1 *frame,
                                  uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
+    IOSysEntry *entry = (IOSysEntry *)data;
+    WaylandCapturePriv *priv = entry->io_priv;
+
+    pthread_mutex_lock(&priv->frame_obj_lock);
 
+    if (priv->nb_damage == MAX_DAMAGE_RECTS) {
+        SPRect *b = &priv->damage[0];
+        for (int i = 1; i < priv->nb_damage; i++) {
+            SPRect *r = &priv->damage[i];
+            int x1 = FFMAX(b->x + b->w, r->x + r->w);
+            int y1 = FFMAX(b->y + b->h, r->y + r->h);
+            b->x = FFMIN(b->x, r->x);
+            b->y = FFMIN(b->y, r->y);
+            b->w = x1 - b->x;
+            b->h = y1 - b->y;
+        }
+        priv->nb_damage = 1;
+    }
+
+    priv->damage[priv->nb_damage++] = (SPRect){ x, y, w, h, 1.0f };
+
+    pthread_mutex_unlock(&priv->frame_obj_lock);
+}
+
+/* Damage is in buffer coordinates, so it has to follow Y inversion */
+static int attach_damage(IOSysEntry *entry, WaylandCapturePriv *priv)
+{
+    AVFrame *f = priv->frame;
+
+    for (int i = 0; i < priv->nb_damage; i++) {
+        SPRect *r = &priv->damage[i];
+        if (f->linesize[0] < 0)
+            r->y = f->height - r->y - r->h;
+        priv->stats_damaged += (int64_t)r->w * r->h;
+    }
+
+#ifdef HAVE_VIDEO_HINT
+    if (!priv->nb_damage)
+        return 0;
+
+    AVVideoHint *hint = av_video_hint_create_side_data(f, priv->nb_damage);
+    if (!hint)
+        return AVERROR(ENOMEM);
+
+    hint->type = AV_VIDEO_HINT_TYPE_CHANGED;
+
+    AVVideoRect *rects = av_video_hint_rects(hint);
+    for (int i = 0; i < priv->nb_damage; i++) {
+        rects[i].x      = priv->damage[i].x;
+        rects[i].y      = priv->damage[i].y;
+        rects[i].width  = priv->damage[i].w;
+        rects[i].height = priv->damage[i].h;
+    }
+#endif
+
+    return 0;
+}
+
+static void damage_stats(IOSysEntry *entry, WaylandCapturePriv *priv)
+{
+    int64_t now = av_gettime_relative();
+
+    priv->stats_frames++;
+    if (!priv->last_stats) {
+        priv->last_stats = now;
+        return;
+    } else if ((now - priv->last_stats) < 1000000) {
+        return;
+    }
+
+    double capture_rate = priv->stats_frames * 1000000.0 / (now - priv->last_stats);
+    int64_t area = (int64_t)priv->frame->width * priv->frame->height * priv->stats_frames;
+    double damaged_area = area ? (double)priv->stats_damaged / area : 0.0;
+
+    SPGenericData entries[] = {
+        D_TYPE("capture_rate", NULL, capture_rate),
+        D_TYPE("damaged_area", NULL, damaged_area),
+        { 0 },
+    };
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+
+    priv->last_stats = now;
+    priv->stats_frames = 0;
+    priv->stats_damaged = 0;
 }
 
 static void scrcpy_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
@@ -816,15 +932,28 @@ static void scrcpy_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *fram
     /* Delay */
     int64_t delay = presented - ((tsp.tv_sec * 1000000000) + tsp.tv_nsec);
 
-    priv->frame->pts = av_add_stable(fe->time_base, delay, av_make_q(1, 1000000),
-                                     av_gettime_relative() - priv->epoch);
+    int err = 0;
+    int64_t now = sp_clock_follower_time(&priv->clock, av_gettime_relative());
+    if (now == AV_NOPTS_VALUE) {
+        av_frame_free(&priv->frame);
+        goto next;
+    }
 
-    sp_log(entry, SP_LOG_TRACE, "Pushing frame to FIFO, pts = %f\n",
-           av_q2d(fe->time_base) * priv->frame->pts);
+    priv->frame->pts = av_add_stable(fe->time_base, delay, av_make_q(1, 1000000), now);
+
+    if (priv->copy_with_damage) {
+        err = attach_damage(entry, priv);
+        if (err < 0)
+            goto fail;
+        damage_stats(entry, priv);
+    }
+
+    sp_log(entry, SP_LOG_TRACE, "Pushing frame to FIFO, pts = %f, %i damaged regions\n",
+           av_q2d(fe->time_base) * priv->frame->pts, priv->nb_damage);
 
     /* We don't do this check at the start on since there's still some chance
      * whatever's consuming the FIFO will be done by now. */
-    int err = sp_frame_fifo_push(entry->frames, priv->frame);
+    err = sp_frame_fifo_push(entry->frames, priv->frame);
     av_frame_free(&priv->frame);
     if (err == AVERROR(ENOBUFS)) {
         priv->dropped_frames++;
@@ -842,23 +971,14 @@ static void scrcpy_frame_ready(void *data, struct zwlr_screencopy_frame_v1 *fram
         goto fail;
     }
 
+    sp_clock_follower_stats(&priv->clock, entry, entry->events);
+
+next:
     zwlr_screencopy_frame_v1_destroy(frame);
 
     /* Framerate limiting */
-    if (priv->frame_delay) {
-        int64_t now = av_gettime_relative();
-        if (priv->next_frame_ts && (now < priv->next_frame_ts)) {
-            int64_t wait_time;
-            while (1) {
-                wait_time = priv->next_frame_ts - now;
-                if (wait_time <= 0)
-                    break;
-                av_usleep(wait_time);
-                now = av_gettime_relative();
-            }
-        }
-        priv->next_frame_ts = now + priv->frame_delay;
-    }
+    if (priv->frame_delay)
+        pace_frame(entry, priv);
 
     schedule_frame(entry);
 
@@ -963,6 +1083,7 @@ static void destroy_capture(WaylandCapturePriv *priv)
     av_buffer_pool_uninit(&priv->scrcpy.shm.pool);
     av_buffer_unref(&priv->scrcpy.dmabuf.frames_ref);
     av_buffer_unref(&priv->dmabuf.frames_ref);
+    sp_clock_follower_uninit(&priv->clock);
 #ifdef HAVE_GBM
     gbm_device_destroy(priv->scrcpy.dmabuf.gbm_dev);
     priv->scrcpy.dmabuf.gbm_dev = NULL;
@@ -978,7 +1099,7 @@ static int wlcapture_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, v
     WaylandCapturePriv *priv = entry->io_priv;
 
     if (event->ctrl & SP_EVENT_CTRL_START) {
-        priv->epoch = atomic_load(event->epoch);
+        sp_clock_follower_init(&priv->clock, event->clock, atomic_load(event->epoch));
         schedule_frame(entry);
         wl_display_flush(priv->main->wl->display);
         return sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
@@ -1044,6 +1165,23 @@ static int wlcapture_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
         }
     }
 
+    /* Screencopy version 2 can wait for damage before copying */
+    priv->copy_with_damage = 1;
+    if (dict_get(opts, "damage")) {
+        const char *damage_str = dict_get(opts, "damage");
+        if (!strcmp(damage_str, "none")) {
+            priv->copy_with_damage = 0;
+        } else if (strcmp(damage_str, "vfr")) {
+            sp_log(iosys_entry, SP_LOG_ERROR, "Unsupported damage mode \"%s\"!\n", damage_str);
+            av_free(priv);
+            err = AVERROR(EINVAL);
+            goto end;
+        }
+    }
+    if (ctx->wl->screencopy_export_manager &&
+        wl_proxy_get_version((struct wl_proxy *)ctx->wl->screencopy_export_manager) < 2)
+        priv->copy_with_damage = 0;
+
     AVRational framerate_req = av_make_q(0, 0);
     if (dict_get(opts, "framerate_num"))
         framerate_req.num = strtol(dict_get(opts, "framerate_num"), NULL, 10);
@@ -1073,6 +1211,7 @@ static int wlcapture_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
                (av_cmp_q(framerate_req, iosys_entry->framerate) != 0)) {
         priv->frame_rate = framerate_req;
         priv->frame_delay = av_rescale_q(1, av_inv_q(framerate_req), AV_TIME_BASE_Q);
+        sp_pacer_init(&priv->pacer, priv->frame_delay);
     }
 
     iosys_entry->io_priv = priv;
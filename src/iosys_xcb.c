@@ -23,15 +23,30 @@
 #include <xcb/randr.h>
 #include <sys/shm.h>
 
+#include "../config.h"
+
+#ifdef HAVE_XCB_DAMAGE
+#include <xcb/damage.h>
+#endif
+#ifdef HAVE_XCB_XFIXES
+#include <xcb/xfixes.h>
+#endif
+
+#if defined(HAVE_XCB_DAMAGE) || defined(HAVE_XCB_XFIXES)
+#define HAVE_XCB_EVENTS 1
+#endif
+
 #include <libavutil/time.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/intreadwrite.h>
 
 #include "iosys_common.h"
 #include <libtxproto/utils.h>
+#include <libtxproto/clock.h>
 #include "ctrl_template.h"
 #include "utils.h"
+#include "colorspace.h"
 #include "os_compat.h"
-#include "../config.h"
 
 const IOSysAPI src_xcb;
 
@@ -55,6 +70,30 @@ typedef struct XCBPriv {
     xcb_screen_t *root;
 } XCBPriv;
 
+#define MAX_DAMAGE_BANDS 32
+#define MAX_PIPELINE_DEPTH 4
+
+enum XCBDamageMode {
+    DAMAGE_OFF = 0,
+    DAMAGE_REPEAT,  /* Unchanged frames are the previous one, by reference */
+    DAMAGE_VFR,     /* Unchanged frames are not output */
+};
+
+/* A grab whose requests have been sent */
+typedef struct XCBGrab {
+    AVBufferRef *buf;
+    enum AVPixelFormat pixfmt;
+    int width, height, linesize;
+    int partial;
+    int64_t pts;
+    int nb_cookies;
+    xcb_shm_get_image_cookie_t cookies[MAX_DAMAGE_BANDS];
+
+    /* Cursor to blend once the grab is done */
+    AVBufferRef *cursor;
+    int cursor_x, cursor_y, cursor_w, cursor_h;
+} XCBGrab;
+
 typedef struct XCBCapture {
     atomic_int quit;
     pthread_t pull_thread;
@@ -68,8 +107,64 @@ typedef struct XCBCapture {
 
     int dropped_frames;
 
-    int64_t epoch;
-    int64_t next_frame_ts;
+    /* Damage and cursor events come on their own connection, so that they
+     * don't go to whichever other thread reads the main one */
+#ifdef HAVE_XCB_EVENTS
+    xcb_connection_t *event_con;
+#endif
+
+    /* Damage tracking */
+    enum XCBDamageMode damage_mode;
+#ifdef HAVE_XCB_DAMAGE
+    xcb_damage_damage_t damage;
+    uint8_t damage_event;
+#endif
+    int full_grab;
+    int nb_bands;
+    struct { int y0, y1; } bands[MAX_DAMAGE_BANDS]; /* Sorted, disjoint rows */
+    AVBufferRef *last_buf; /* SHM buffer of the last grab */
+    enum AVPixelFormat last_pixfmt;
+    AVFrame *last_frame;   /* Last frame output, to repeat in DAMAGE_REPEAT mode */
+    int64_t grabbed_frames;
+    int64_t partial_frames;
+    int64_t skipped_frames;
+
+    /* Grabs in flight, oldest first. While one is being waited on, the
+     * X server is already filling the next. */
+    int pipeline_depth;
+    XCBGrab grabs[MAX_PIPELINE_DEPTH];
+    int grabs_start;
+    int nb_grabs;
+
+    /* Cursor, premultiplied, in the byte order of cursor_fmt */
+    int capture_cursor;
+#ifdef HAVE_XCB_XFIXES
+    uint8_t cursor_event;
+#endif
+    int cursor_stale;
+    AVBufferRef *cursor_buf;
+    enum AVPixelFormat cursor_fmt;
+    int cursor_w, cursor_h;
+    int cursor_xhot, cursor_yhot;
+    int cursor_x, cursor_y; /* Relative to the captured region */
+
+    /* Reset every stats interval */
+    int64_t last_stats;
+    int64_t stats_grabs;
+    int64_t stats_wait;
+    int64_t stats_jitter;
+    int64_t stats_cursor;
+    int64_t last_grab_ts;
+
+    /* Optional conversion in the capture thread */
+    enum AVPixelFormat out_format;
+    enum AVColorSpace out_colorspace;
+    enum AVColorRange out_range;
+    enum AVPixelFormat conv_src;
+    SPColorConv *conv;
+
+    SPClockFollower clock;
+    SPPacer pacer;
     int64_t frame_delay;
 } XCBCapture;
 
@@ -182,57 +277,337 @@ static int pixfmt_from_pixmap_format(XCBCtx *ctx, int depth,
     return AVERROR(EINVAL);
 }
 
-static void *xcb_thread(void *s)
+static int convert_frame(IOSysEntry *entry, XCBCapture *priv, AVFrame **frame)
 {
-    int err = 0;
-    IOSysEntry *entry = s;
-    XCBPriv *api_priv = entry->api_priv;
-    XCBCapture *priv = entry->io_priv;
-    XCBCtx *ctx = api_priv->main_ctx;
+    int err;
+    AVFrame *out;
 
-    sp_set_thread_name_self(sp_class_get_name(entry));
+    if (priv->conv && priv->conv_src != (*frame)->format)
+        sp_colorconv_free(&priv->conv);
 
-    xcb_get_geometry_cookie_t geo_c;
-    xcb_get_geometry_reply_t *geo_r;
-    geo_c = xcb_get_geometry(ctx->con, priv->win);
+    if (!priv->conv) {
+        err = sp_colorconv_alloc(&priv->conv, (*frame)->format, priv->out_format,
+                                 priv->out_colorspace, priv->out_range);
+        if (err < 0) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to convert from %s to %s: %s!\n",
+                   av_get_pix_fmt_name((*frame)->format),
+                   av_get_pix_fmt_name(priv->out_format), av_err2str(err));
+            return err;
+        }
 
-    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+        priv->conv_src = (*frame)->format;
+        sp_log(entry, SP_LOG_VERBOSE, "Converting %s to %s in the capture thread (%s)\n",
+               av_get_pix_fmt_name(priv->conv_src),
+               av_get_pix_fmt_name(priv->out_format),
+               sp_colorconv_impl(priv->conv));
+    }
 
-    while (!atomic_load(&ctx->quit)) {
-        geo_r = xcb_get_geometry_reply(ctx->con, geo_c, NULL);
+    err = sp_colorconv_convert(priv->conv, &out, *frame);
+    if (err < 0) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to convert frame: %s!\n",
+               av_err2str(err));
+        return err;
+    }
 
-        AVFrame *frame = av_frame_alloc();
+    /* Releases the SHM buffer back to the pool right away */
+    av_frame_free(frame);
+    *frame = out;
 
-        int bpp;
-        size_t fsize;
-        enum AVPixelFormat pixfmt;
-        AVBufferRef *out_buf = NULL;
+    return 0;
+}
 
-        err = pixfmt_from_pixmap_format(ctx, geo_r->depth, &pixfmt, &bpp);
-        if (err < 0) {
-            sp_log(entry, SP_LOG_ERROR, "Unable to map bit depth to pixel format!\n");
-            goto end;
+/* Adds damaged rows, merging bands closer than a few rows, as a band
+ * costs a request. If there are too many, everything becomes one band. */
+static void add_damage_band(XCBCapture *priv, int y0, int y1)
+{
+    const int gap = 8;
+    int i, j;
+
+    for (i = 0; i < priv->nb_bands && priv->bands[i].y1 + gap < y0; i++);
+
+    /* Absorb every band this one touches */
+    for (j = i; j < priv->nb_bands && priv->bands[j].y0 <= y1 + gap; j++) {
+        y0 = FFMIN(y0, priv->bands[j].y0);
+        y1 = FFMAX(y1, priv->bands[j].y1);
+    }
+
+    if (j == i && priv->nb_bands == MAX_DAMAGE_BANDS) {
+        priv->bands[0].y0 = FFMIN(y0, priv->bands[0].y0);
+        priv->bands[0].y1 = FFMAX(y1, priv->bands[priv->nb_bands - 1].y1);
+        priv->nb_bands = 1;
+        return;
+    }
+
+    memmove(&priv->bands[i + 1], &priv->bands[j],
+            (priv->nb_bands - j)*sizeof(*priv->bands));
+    priv->nb_bands += 1 - (j - i);
+    priv->bands[i].y0 = y0;
+    priv->bands[i].y1 = y1;
+}
+
+static void set_full_grab(IOSysEntry *entry, XCBCapture *priv)
+{
+    priv->full_grab = 1;
+    priv->nb_bands = 1;
+    priv->bands[0].y0 = 0;
+    priv->bands[0].y1 = entry->height;
+}
+
+#ifdef HAVE_XCB_EVENTS
+static int event_con_open(XCBCapture *priv)
+{
+    if (priv->event_con)
+        return 0;
+
+    xcb_connection_t *con = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(con)) {
+        xcb_disconnect(con);
+        return AVERROR(EIO);
+    }
+
+    priv->event_con = con;
+
+    return 0;
+}
+#endif
+
+#ifdef HAVE_XCB_DAMAGE
+static int damage_init(IOSysEntry *entry, XCBCapture *priv)
+{
+    int err = event_con_open(priv);
+    if (err < 0)
+        return err;
+
+    xcb_connection_t *con = priv->event_con;
+
+    const xcb_query_extension_reply_t *ext = xcb_get_extension_data(con, &xcb_damage_id);
+    if (!ext || !ext->present)
+        return AVERROR(ENOTSUP);
+
+    xcb_damage_query_version_cookie_t ver_c;
+    xcb_damage_query_version_reply_t *ver_r;
+    ver_c = xcb_damage_query_version(con, XCB_DAMAGE_MAJOR_VERSION, XCB_DAMAGE_MINOR_VERSION);
+    ver_r = xcb_damage_query_version_reply(con, ver_c, NULL);
+    if (!ver_r)
+        return AVERROR(ENOTSUP);
+    free(ver_r);
+
+    /* Raw rectangles keep no state on the server, so no damage is lost
+     * between reading events and grabbing */
+    priv->damage = xcb_generate_id(con);
+    xcb_damage_create(con, priv->damage, priv->drawable,
+                      XCB_DAMAGE_REPORT_LEVEL_RAW_RECTANGLES);
+    xcb_flush(con);
+
+    priv->damage_event = ext->first_event + XCB_DAMAGE_NOTIFY;
+
+    return 0;
+}
+#endif
+
+#ifdef HAVE_XCB_XFIXES
+static int cursor_init(IOSysEntry *entry, XCBCapture *priv)
+{
+    int err = event_con_open(priv);
+    if (err < 0)
+        return err;
+
+    xcb_connection_t *con = priv->event_con;
+
+    const xcb_query_extension_reply_t *ext = xcb_get_extension_data(con, &xcb_xfixes_id);
+    if (!ext || !ext->present)
+        return AVERROR(ENOTSUP);
+
+    xcb_xfixes_query_version_cookie_t ver_c;
+    xcb_xfixes_query_version_reply_t *ver_r;
+    ver_c = xcb_xfixes_query_version(con, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+    ver_r = xcb_xfixes_query_version_reply(con, ver_c, NULL);
+    if (!ver_r)
+        return AVERROR(ENOTSUP);
+    free(ver_r);
+
+    /* Only image changes are signalled, the position is queried */
+    xcb_xfixes_select_cursor_input(con, priv->win,
+                                   XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
+    xcb_flush(con);
+
+    priv->cursor_event = ext->first_event + XCB_XFIXES_CURSOR_NOTIFY;
+    priv->cursor_stale = 1;
+
+    return 0;
+}
+
+/* Rows under the cursor, which must be fetched again for it to be blended
+ * in or to disappear */
+static void add_cursor_band(IOSysEntry *entry, XCBCapture *priv)
+{
+    int y0 = FFMAX(priv->cursor_y, 0);
+    int y1 = FFMIN(priv->cursor_y + priv->cursor_h, entry->height);
+    int x0 = FFMAX(priv->cursor_x, 0);
+    int x1 = FFMIN(priv->cursor_x + priv->cursor_w, entry->width);
+
+    if (priv->cursor_buf && y0 < y1 && x0 < x1)
+        add_damage_band(priv, y0, y1);
+}
+
+static void cursor_update(IOSysEntry *entry, XCBCapture *priv,
+                          enum AVPixelFormat pixfmt)
+{
+    int x, y, changed = 0;
+    xcb_connection_t *con = priv->event_con;
+
+    if (priv->cursor_stale || priv->cursor_fmt != pixfmt) {
+        xcb_xfixes_get_cursor_image_cookie_t img_c;
+        xcb_xfixes_get_cursor_image_reply_t *img_r;
+        img_c = xcb_xfixes_get_cursor_image(con);
+        img_r = xcb_xfixes_get_cursor_image_reply(con, img_c, NULL);
+        if (!img_r)
+            return;
+
+        AVBufferRef *buf = av_buffer_alloc(img_r->width * img_r->height * 4 + 1);
+        if (buf) {
+            const uint32_t *src = xcb_xfixes_get_cursor_image_cursor_image(img_r);
+            for (int i = 0; i < img_r->width * img_r->height; i++) {
+                uint32_t p = src[i];
+                uint8_t *d = &buf->data[4*i];
+                if (pixfmt == AV_PIX_FMT_BGR0)
+                    AV_WL32(d, p);
+                else
+                    AV_WB32(d, p);
+            }
+
+            av_buffer_unref(&priv->cursor_buf);
+            priv->cursor_buf = buf;
+            priv->cursor_fmt = pixfmt;
+            priv->cursor_w = img_r->width;
+            priv->cursor_h = img_r->height;
+            priv->cursor_xhot = img_r->xhot;
+            priv->cursor_yhot = img_r->yhot;
+            priv->cursor_stale = 0;
+            changed = 1;
         }
 
-        fsize = (entry->width * entry->height * bpp) / 8;
+        x = img_r->x;
+        y = img_r->y;
+        free(img_r);
+    } else {
+        xcb_query_pointer_cookie_t ptr_c;
+        xcb_query_pointer_reply_t *ptr_r;
+        ptr_c = xcb_query_pointer(con, priv->win);
+        ptr_r = xcb_query_pointer_reply(con, ptr_c, NULL);
+        if (!ptr_r)
+            return;
+
+        x = ptr_r->root_x;
+        y = ptr_r->root_y;
+        free(ptr_r);
+    }
 
-        err = alloc_buffer_pool(ctx, priv, fsize, &out_buf);
-        if (err < 0)
-            goto end;
+    x -= priv->cursor_xhot + entry->x;
+    y -= priv->cursor_yhot + entry->y;
 
-        xcb_shm_seg_t seg;
-        xcb_shm_get_image_cookie_t img_c;
-        xcb_shm_get_image_reply_t *img_r;
-        xcb_generic_error_t *xerr = NULL;
+    if (changed || x != priv->cursor_x || y != priv->cursor_y) {
+        add_cursor_band(entry, priv);
+        priv->cursor_x = x;
+        priv->cursor_y = y;
+        add_cursor_band(entry, priv);
+    }
+}
+
+static void cursor_blend(XCBGrab *g)
+{
+    int x0 = FFMAX(g->cursor_x, 0);
+    int y0 = FFMAX(g->cursor_y, 0);
+    int x1 = FFMIN(g->cursor_x + g->cursor_w, g->width);
+    int y1 = FFMIN(g->cursor_y + g->cursor_h, g->height);
+
+    if (x0 >= x1 || y0 >= y1)
+        return;
 
-        seg = (xcb_shm_seg_t)(uintptr_t)av_buffer_pool_buffer_get_opaque(out_buf);
+    sp_blend_premult(g->buf->data + y0*g->linesize + x0*4, g->linesize,
+                     g->cursor->data + ((y0 - g->cursor_y)*g->cursor_w + (x0 - g->cursor_x))*4,
+                     g->cursor_w*4, x1 - x0, y1 - y0,
+                     g->pixfmt == AV_PIX_FMT_BGR0 ? 3 : 0);
+}
+#endif
+
+#ifdef HAVE_XCB_EVENTS
+static void events_uninit(XCBCapture *priv)
+{
+    if (!priv->event_con)
+        return;
 
-        img_c = xcb_shm_get_image(ctx->con, priv->drawable,
-                                  entry->x, entry->y, entry->width, entry->height, ~0,
-                                  XCB_IMAGE_FORMAT_Z_PIXMAP, seg, 0);
-        img_r = xcb_shm_get_image_reply(ctx->con, img_c, &xerr);
+#ifdef HAVE_XCB_DAMAGE
+    if (priv->damage_mode != DAMAGE_OFF)
+        xcb_damage_destroy(priv->event_con, priv->damage);
+#endif
 
-        xcb_flush(ctx->con);
+    xcb_disconnect(priv->event_con);
+    priv->event_con = NULL;
+}
+
+static void events_poll(IOSysEntry *entry, XCBCapture *priv)
+{
+    xcb_generic_event_t *ev;
+
+    if (!priv->event_con)
+        return;
+
+    while ((ev = xcb_poll_for_event(priv->event_con))) {
+        uint8_t type = ev->response_type & ~0x80;
+#ifdef HAVE_XCB_DAMAGE
+        if (priv->damage_mode != DAMAGE_OFF && type == priv->damage_event) {
+            xcb_damage_notify_event_t *dev = (xcb_damage_notify_event_t *)ev;
+            int x0 = FFMAX(dev->area.x, entry->x);
+            int x1 = FFMIN(dev->area.x + dev->area.width, entry->x + entry->width);
+            int y0 = FFMAX(dev->area.y, entry->y);
+            int y1 = FFMIN(dev->area.y + dev->area.height, entry->y + entry->height);
+            if (x0 < x1 && y0 < y1)
+                add_damage_band(priv, y0 - entry->y, y1 - entry->y);
+        }
+#endif
+#ifdef HAVE_XCB_XFIXES
+        if (priv->capture_cursor && type == priv->cursor_event)
+            priv->cursor_stale = 1;
+#endif
+        free(ev);
+    }
+
+    if (xcb_connection_has_error(priv->event_con)) {
+        sp_log(entry, SP_LOG_WARN, "Event connection lost, grabbing every frame "
+               "without the cursor!\n");
+        events_uninit(priv);
+        priv->damage_mode = DAMAGE_OFF;
+        priv->capture_cursor = 0;
+    }
+}
+#endif
+
+/* Sends the requests for the damaged bands of a grab, without waiting */
+static void grab_send(XCBCtx *ctx, IOSysEntry *entry, XCBCapture *priv,
+                      XCBGrab *g)
+{
+    xcb_shm_seg_t seg = (xcb_shm_seg_t)(uintptr_t)av_buffer_pool_buffer_get_opaque(g->buf);
+
+    for (int i = 0; i < priv->nb_bands; i++)
+        g->cookies[i] = xcb_shm_get_image(ctx->con, priv->drawable,
+                                          entry->x, entry->y + priv->bands[i].y0,
+                                          entry->width, priv->bands[i].y1 - priv->bands[i].y0,
+                                          ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, seg,
+                                          priv->bands[i].y0*g->linesize);
+    g->nb_cookies = priv->nb_bands;
+
+    xcb_flush(ctx->con);
+}
+
+static int grab_wait(XCBCtx *ctx, IOSysEntry *entry, XCBGrab *g)
+{
+    int err = 0;
+
+    for (int i = 0; i < g->nb_cookies; i++) {
+        xcb_generic_error_t *xerr = NULL;
+        xcb_shm_get_image_reply_t *img_r;
+        img_r = xcb_shm_get_image_reply(ctx->con, g->cookies[i], &xerr);
 
         if (xerr) {
             sp_log(entry, SP_LOG_ERROR,
@@ -244,69 +619,368 @@ static void *xcb_thread(void *s)
                    xerr->minor_code, xerr->major_code);
 
             free(xerr);
-            av_frame_free(&frame);
             err = AVERROR(EACCES);
-            goto end;
         }
 
         free(img_r);
+    }
+
+    g->nb_cookies = 0;
+
+    return err;
+}
+
+/* Returns a buffer holding the last grab, so only damage needs fetching.
+ * The last buffer is reused in place if nothing else references it. */
+static int get_grab_buffer(XCBCtx *ctx, XCBCapture *priv, size_t fsize,
+                           AVBufferRef **buf_out)
+{
+    int err;
+
+    /* Grabs aren't pipelined with damage tracking, so the frame to repeat
+     * gets replaced once this grab retires, before it could be repeated */
+    if (!priv->full_grab && priv->last_frame &&
+        priv->last_frame->buf[0]->data == priv->last_buf->data)
+        av_frame_free(&priv->last_frame);
+
+    if (!priv->full_grab && av_buffer_is_writable(priv->last_buf)) {
+        *buf_out = av_buffer_ref(priv->last_buf);
+        return *buf_out ? 0 : AVERROR(ENOMEM);
+    }
+
+    err = alloc_buffer_pool(ctx, priv, fsize, buf_out);
+    if (err < 0)
+        return err;
+
+    if (!priv->full_grab)
+        memcpy((*buf_out)->data, priv->last_buf->data, fsize);
+
+    return 0;
+}
 
-        frame->width       = entry->width;
-        frame->height      = entry->height;
-        frame->format      = pixfmt;
-        frame->pts         = av_gettime_relative() - priv->epoch;
-        frame->time_base   = AV_TIME_BASE_Q;
-        frame->data[0]     = (uint8_t *)out_buf->data;
-        frame->linesize[0] = entry->width * bpp / 8;
-        frame->buf[0]      = out_buf;
+static int push_frame(IOSysEntry *entry, XCBCapture *priv, AVFrame *frame)
+{
+    /* Grabbed before the master clock started */
+    if (frame->pts == AV_NOPTS_VALUE)
+        return 0;
 
-        frame->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
+    sp_log(entry, SP_LOG_TRACE, "Pushing frame to FIFO, pts = %f\n",
+           av_q2d(frame->time_base) * frame->pts);
+
+    /* We don't do this check at the start on since there's still some chance
+     * whatever's consuming the FIFO will be done by now. */
+    int err = sp_frame_fifo_push(entry->frames, frame);
+    if (err == AVERROR(ENOBUFS)) {
+        priv->dropped_frames++;
+        sp_log(entry, SP_LOG_WARN, "Dropping frame (%i dropped so far)!\n",
+               priv->dropped_frames);
+
+        SPGenericData entries[] = {
+            D_TYPE("dropped_frames", NULL, priv->dropped_frames),
+            { 0 },
+        };
+        sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+    } else if (err) {
+        sp_log(entry, SP_LOG_ERROR, "Unable to push frame to FIFO: %s!\n",
+               av_err2str(err));
+        return err;
+    }
 
-        FormatExtraData *fe = (FormatExtraData *)frame->opaque_ref->data;
-        fe->time_base       = AV_TIME_BASE_Q;
-        fe->avg_frame_rate  = entry->framerate;
-        fe->rotation        = entry->rotation;
+    sp_clock_follower_stats(&priv->clock, entry, entry->events);
 
-        sp_log(entry, SP_LOG_TRACE, "Pushing frame to FIFO, pts = %f\n",
-               av_q2d(fe->time_base) * frame->pts);
+    return 0;
+}
+
+/* Waits for the oldest grab in flight and outputs it */
+static int retire_grab(XCBCtx *ctx, IOSysEntry *entry, XCBCapture *priv)
+{
+    int err;
+    XCBGrab *g = &priv->grabs[priv->grabs_start];
+
+    priv->grabs_start = (priv->grabs_start + 1) % MAX_PIPELINE_DEPTH;
+    priv->nb_grabs--;
+
+    int64_t wait_start = av_gettime_relative();
+    err = grab_wait(ctx, entry, g);
+    priv->stats_wait += av_gettime_relative() - wait_start;
+    if (err < 0) {
+        av_buffer_unref(&g->buf);
+        av_buffer_unref(&g->cursor);
+        return err;
+    }
+
+#ifdef HAVE_XCB_XFIXES
+    if (g->cursor) {
+        int64_t blend_start = av_gettime_relative();
+        cursor_blend(g);
+        priv->stats_cursor += av_gettime_relative() - blend_start;
+        av_buffer_unref(&g->cursor);
+    }
+#endif
+
+    priv->grabbed_frames++;
+    priv->partial_frames += g->partial;
+    priv->stats_grabs++;
+
+    if (priv->damage_mode != DAMAGE_OFF) {
+        av_buffer_unref(&priv->last_buf);
+        priv->last_buf = av_buffer_ref(g->buf);
+        priv->last_pixfmt = g->pixfmt;
+        if (!priv->last_buf) {
+            av_buffer_unref(&g->buf);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        av_buffer_unref(&g->buf);
+        return AVERROR(ENOMEM);
+    }
 
-        /* We don't do this check at the start on since there's still some chance
-         * whatever's consuming the FIFO will be done by now. */
-        err = sp_frame_fifo_push(entry->frames, frame);
+    frame->width       = g->width;
+    frame->height      = g->height;
+    frame->format      = g->pixfmt;
+    frame->pts         = g->pts;
+    frame->time_base   = AV_TIME_BASE_Q;
+    frame->data[0]     = (uint8_t *)g->buf->data;
+    frame->linesize[0] = g->linesize;
+    frame->buf[0]      = g->buf;
+    g->buf = NULL;
+
+    frame->opaque_ref = av_buffer_allocz(sizeof(FormatExtraData));
+    if (!frame->opaque_ref) {
         av_frame_free(&frame);
-        if (err == AVERROR(ENOBUFS)) {
-            priv->dropped_frames++;
-            sp_log(entry, SP_LOG_WARN, "Dropping frame (%i dropped so far)!\n",
-                   priv->dropped_frames);
-
-            SPGenericData entries[] = {
-                D_TYPE("dropped_frames", NULL, priv->dropped_frames),
-                { 0 },
-            };
-            sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
-        } else if (err) {
-            sp_log(entry, SP_LOG_ERROR, "Unable to push frame to FIFO: %s!\n",
-                   av_err2str(err));
+        return AVERROR(ENOMEM);
+    }
+
+    FormatExtraData *fe = (FormatExtraData *)frame->opaque_ref->data;
+    fe->time_base       = AV_TIME_BASE_Q;
+    fe->avg_frame_rate  = entry->framerate;
+    fe->rotation        = entry->rotation;
+
+    if (priv->out_format != AV_PIX_FMT_NONE) {
+        err = convert_frame(entry, priv, &frame);
+        if (err < 0) {
+            av_frame_free(&frame);
+            return err;
+        }
+    }
+
+    if (priv->damage_mode == DAMAGE_REPEAT) {
+        av_frame_free(&priv->last_frame);
+        priv->last_frame = av_frame_clone(frame);
+        if (!priv->last_frame) {
+            av_frame_free(&frame);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    err = push_frame(entry, priv, frame);
+    av_frame_free(&frame);
+
+    return err;
+}
+
+/* Starts a grab of whatever bands are damaged */
+static int start_grab(XCBCtx *ctx, IOSysEntry *entry, XCBCapture *priv,
+                      enum AVPixelFormat pixfmt, int bpp, int64_t pts)
+{
+    int err;
+    size_t fsize = (entry->width * entry->height * bpp) / 8;
+    XCBGrab *g = &priv->grabs[(priv->grabs_start + priv->nb_grabs) % MAX_PIPELINE_DEPTH];
+
+    err = get_grab_buffer(ctx, priv, fsize, &g->buf);
+    if (err < 0)
+        return err;
+
+    g->pixfmt   = pixfmt;
+    g->width    = entry->width;
+    g->height   = entry->height;
+    g->linesize = entry->width * bpp / 8;
+    g->partial  = !priv->full_grab;
+    g->pts      = pts;
+
+    if (priv->capture_cursor && priv->cursor_buf && priv->cursor_fmt == pixfmt) {
+        g->cursor = av_buffer_ref(priv->cursor_buf);
+        g->cursor_x = priv->cursor_x;
+        g->cursor_y = priv->cursor_y;
+        g->cursor_w = priv->cursor_w;
+        g->cursor_h = priv->cursor_h;
+    }
+
+    grab_send(ctx, entry, priv, g);
+    priv->nb_grabs++;
+
+    priv->full_grab = 0;
+    priv->nb_bands = 0;
+
+    if (pts != AV_NOPTS_VALUE) {
+        if (priv->last_grab_ts)
+            priv->stats_jitter += FFABS(pts - priv->last_grab_ts - priv->frame_delay);
+        priv->last_grab_ts = pts;
+    }
+
+    return 0;
+}
+
+static void capture_stats(IOSysEntry *entry, XCBCapture *priv, int64_t now)
+{
+    if (!priv->last_stats) {
+        priv->last_stats = now;
+        return;
+    } else if ((now - priv->last_stats) < 1000000) {
+        return;
+    }
+
+    double capture_rate = priv->stats_grabs * 1000000.0 / (now - priv->last_stats);
+    int64_t grab_wait = priv->stats_grabs ? priv->stats_wait / priv->stats_grabs : 0;
+    int64_t jitter = priv->stats_grabs ? priv->stats_jitter / priv->stats_grabs : 0;
+    int64_t cursor_time = priv->stats_grabs ? priv->stats_cursor / priv->stats_grabs : 0;
+
+    SPGenericData entries[] = {
+        D_TYPE("capture_rate", NULL, capture_rate),
+        D_TYPE("tick_overruns", NULL, priv->pacer.overruns),
+        D_TYPE("grab_wait", NULL, grab_wait),
+        D_TYPE("jitter", NULL, jitter),
+        D_TYPE("cursor_time", NULL, cursor_time),
+        D_TYPE("grabbed_frames", NULL, priv->grabbed_frames),
+        D_TYPE("partial_frames", NULL, priv->partial_frames),
+        D_TYPE("skipped_frames", NULL, priv->skipped_frames),
+        { 0 },
+    };
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_STATS, entries);
+
+    priv->last_stats = now;
+    priv->stats_grabs = 0;
+    priv->stats_wait = 0;
+    priv->stats_jitter = 0;
+    priv->stats_cursor = 0;
+}
+
+static void *xcb_thread(void *s)
+{
+    int err = 0;
+    IOSysEntry *entry = s;
+    XCBPriv *api_priv = entry->api_priv;
+    XCBCapture *priv = entry->io_priv;
+    XCBCtx *ctx = api_priv->main_ctx;
+
+    sp_set_thread_name_self(sp_class_get_name(entry));
+
+#ifdef HAVE_XCB_DAMAGE
+    if (priv->damage_mode != DAMAGE_OFF && (err = damage_init(entry, priv)) < 0) {
+        sp_log(entry, SP_LOG_WARN, "Damage tracking unavailable (%s), "
+               "grabbing every frame!\n", av_err2str(err));
+        priv->damage_mode = DAMAGE_OFF;
+    }
+#else
+    if (priv->damage_mode != DAMAGE_OFF) {
+        sp_log(entry, SP_LOG_WARN, "Compiled without damage tracking, "
+               "grabbing every frame!\n");
+        priv->damage_mode = DAMAGE_OFF;
+    }
+#endif
+
+#ifdef HAVE_XCB_XFIXES
+    if (priv->capture_cursor && (err = cursor_init(entry, priv)) < 0) {
+        sp_log(entry, SP_LOG_WARN, "Cursor capture unavailable: %s!\n",
+               av_err2str(err));
+        priv->capture_cursor = 0;
+    }
+#else
+    if (priv->capture_cursor) {
+        sp_log(entry, SP_LOG_WARN, "Compiled without XFixes, not capturing the cursor!\n");
+        priv->capture_cursor = 0;
+    }
+#endif
+
+    /* Partial grabs start from the previous one, which must be complete */
+    if (priv->damage_mode != DAMAGE_OFF && priv->pipeline_depth > 1) {
+        sp_log(entry, SP_LOG_VERBOSE, "Damage tracking enabled, not pipelining grabs\n");
+        priv->pipeline_depth = 1;
+    }
+
+    xcb_get_geometry_cookie_t geo_c;
+    xcb_get_geometry_reply_t *geo_r = NULL;
+    geo_c = xcb_get_geometry(ctx->con, priv->win);
+
+    sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
+
+    while (!atomic_load(&ctx->quit) && !atomic_load(&priv->quit)) {
+        /* Framerate limiting */
+        int64_t now = sp_pacer_wait(&priv->pacer);
+
+        capture_stats(entry, priv, now);
+
+        geo_r = xcb_get_geometry_reply(ctx->con, geo_c, NULL);
+
+        int bpp;
+        size_t fsize;
+        enum AVPixelFormat pixfmt;
+
+        err = pixfmt_from_pixmap_format(ctx, geo_r->depth, &pixfmt, &bpp);
+        if (err < 0) {
+            sp_log(entry, SP_LOG_ERROR, "Unable to map bit depth to pixel format!\n");
             goto end;
         }
 
         free(geo_r);
+        geo_r = NULL;
 
-        geo_c = xcb_get_geometry(ctx->con, priv->win);
+        fsize = (entry->width * entry->height * bpp) / 8;
 
-        /* Framerate limiting */
-        int64_t now = av_gettime_relative();
-        if (priv->next_frame_ts && (now < priv->next_frame_ts)) {
-            int64_t wait_time;
-            while (1) {
-                wait_time = priv->next_frame_ts - now;
-                if (wait_time <= 0)
-                    break;
-                av_usleep(wait_time);
-                now = av_gettime_relative();
+#ifdef HAVE_XCB_EVENTS
+        events_poll(entry, priv);
+#endif
+
+#ifdef HAVE_XCB_XFIXES
+        if (priv->capture_cursor && (pixfmt == AV_PIX_FMT_BGR0 ||
+                                     pixfmt == AV_PIX_FMT_0RGB)) {
+            int64_t cursor_start = av_gettime_relative();
+            cursor_update(entry, priv, pixfmt);
+            priv->stats_cursor += av_gettime_relative() - cursor_start;
+        }
+#endif
+
+        if (priv->damage_mode == DAMAGE_OFF || !priv->last_buf ||
+            priv->last_buf->size != fsize || priv->last_pixfmt != pixfmt)
+            set_full_grab(entry, priv);
+
+        if (!priv->nb_bands) {
+            priv->skipped_frames++;
+            if (priv->damage_mode == DAMAGE_REPEAT) {
+                AVFrame *frame = av_frame_clone(priv->last_frame);
+                if (!frame) {
+                    err = AVERROR(ENOMEM);
+                    goto end;
+                }
+                frame->pts = sp_clock_follower_time(&priv->clock, now);
+                err = push_frame(entry, priv, frame);
+                av_frame_free(&frame);
+                if (err < 0)
+                    goto end;
             }
+        } else {
+#ifdef HAVE_XCB_XFIXES
+            /* The cursor is blended in place, so its rows must be fresh */
+            if (priv->capture_cursor && !priv->full_grab)
+                add_cursor_band(entry, priv);
+#endif
+            err = start_grab(ctx, entry, priv, pixfmt, bpp,
+                             sp_clock_follower_time(&priv->clock, now));
+            if (err < 0)
+                goto end;
+        }
+
+        /* Sent early, so its reply is there by the next iteration */
+        geo_c = xcb_get_geometry(ctx->con, priv->win);
+
+        while (priv->nb_grabs >= priv->pipeline_depth) {
+            err = retire_grab(ctx, entry, priv);
+            if (err < 0)
+                goto end;
         }
-        priv->next_frame_ts = now + priv->frame_delay;
     }
 
     err = AVERROR(EOF);
@@ -315,6 +989,25 @@ end:
     if (err < 0)
         sp_eventlist_dispatch(entry, entry->events, SP_EVENT_ON_ERROR, NULL);
 
+    free(geo_r);
+
+    /* The server may still be writing into buffers in flight */
+    while (priv->nb_grabs) {
+        XCBGrab *g = &priv->grabs[priv->grabs_start];
+        grab_wait(ctx, entry, g);
+        av_buffer_unref(&g->buf);
+        av_buffer_unref(&g->cursor);
+        priv->grabs_start = (priv->grabs_start + 1) % MAX_PIPELINE_DEPTH;
+        priv->nb_grabs--;
+    }
+
+#ifdef HAVE_XCB_EVENTS
+    events_uninit(priv);
+#endif
+    av_buffer_unref(&priv->cursor_buf);
+    av_buffer_unref(&priv->last_buf);
+    av_frame_free(&priv->last_frame);
+
     sp_event_send_eos_frame(entry, entry->events, entry->frames, err);
     priv->err = err;
     return NULL;
@@ -329,7 +1022,7 @@ static int xcb_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx, void *c
     XCBCapture *io_priv = entry->io_priv;
 
     if (event->ctrl & SP_EVENT_CTRL_START) {
-        io_priv->epoch = atomic_load(event->epoch);
+        sp_clock_follower_init(&io_priv->clock, event->clock, atomic_load(event->epoch));
         pthread_create(&io_priv->pull_thread, NULL, xcb_thread, entry);
         sp_log(entry, SP_LOG_VERBOSE, "Started capture thread\n");
         return 0;
@@ -362,6 +1055,67 @@ static int xcb_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
 
     cap_priv->quit = ATOMIC_VAR_INIT(0);
 
+    cap_priv->out_format = AV_PIX_FMT_NONE;
+    cap_priv->out_colorspace = AVCOL_SPC_UNSPECIFIED;
+    cap_priv->out_range = AVCOL_RANGE_UNSPECIFIED;
+
+    if (dict_get(opts, "pixel_format")) {
+        const char *fmt_str = dict_get(opts, "pixel_format");
+        cap_priv->out_format = av_get_pix_fmt(fmt_str);
+        if (!sp_colorconv_supported(AV_PIX_FMT_BGR0, cap_priv->out_format)) {
+            sp_log(iosys_entry, SP_LOG_ERROR, "Unsupported output pixel format \"%s\", "
+                   "only nv12 and yuv420p are!\n", fmt_str);
+            av_free(cap_priv);
+            return AVERROR(ENOTSUP);
+        }
+    }
+    if (dict_get(opts, "colorspace")) {
+        const char *cs_str = dict_get(opts, "colorspace");
+        cap_priv->out_colorspace = av_color_space_from_name(cs_str);
+        if (cap_priv->out_colorspace != AVCOL_SPC_BT709 &&
+            cap_priv->out_colorspace != AVCOL_SPC_BT470BG &&
+            cap_priv->out_colorspace != AVCOL_SPC_SMPTE170M) {
+            sp_log(iosys_entry, SP_LOG_ERROR, "Unsupported colorspace \"%s\"!\n", cs_str);
+            av_free(cap_priv);
+            return AVERROR(ENOTSUP);
+        }
+    }
+    if (dict_get(opts, "capture_cursor"))
+        cap_priv->capture_cursor = strtol(dict_get(opts, "capture_cursor"), NULL, 10);
+
+    cap_priv->pipeline_depth = 2;
+    if (dict_get(opts, "pipeline_depth")) {
+        const char *depth_str = dict_get(opts, "pipeline_depth");
+        cap_priv->pipeline_depth = strtol(depth_str, NULL, 10);
+        if (cap_priv->pipeline_depth < 1 || cap_priv->pipeline_depth > MAX_PIPELINE_DEPTH) {
+            sp_log(iosys_entry, SP_LOG_ERROR, "Invalid pipeline depth \"%s\", "
+                   "must be between 1 and %i!\n", depth_str, MAX_PIPELINE_DEPTH);
+            av_free(cap_priv);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (dict_get(opts, "damage")) {
+        const char *mode_str = dict_get(opts, "damage");
+        if (!strcmp(mode_str, "repeat")) {
+            cap_priv->damage_mode = DAMAGE_REPEAT;
+        } else if (!strcmp(mode_str, "vfr")) {
+            cap_priv->damage_mode = DAMAGE_VFR;
+        } else if (strcmp(mode_str, "none")) {
+            sp_log(iosys_entry, SP_LOG_ERROR, "Invalid damage mode \"%s\"!\n", mode_str);
+            av_free(cap_priv);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (dict_get(opts, "color_range")) {
+        const char *range_str = dict_get(opts, "color_range");
+        cap_priv->out_range = av_color_range_from_name(range_str);
+        if (cap_priv->out_range < 0) {
+            sp_log(iosys_entry, SP_LOG_ERROR, "Invalid color range \"%s\"!\n", range_str);
+            av_free(cap_priv);
+            return AVERROR(EINVAL);
+        }
+    }
+
     iosys_entry->ctrl = xcb_ioctx_ctrl;
     iosys_entry->events = sp_bufferlist_new();
 
@@ -370,6 +1124,7 @@ static int xcb_init_io(AVBufferRef *ctx_ref, AVBufferRef *entry,
 
     cap_priv->frame_delay = av_rescale_q(1, av_inv_q(iosys_entry->framerate),
                                          AV_TIME_BASE_Q);
+    sp_pacer_init(&cap_priv->pacer, cap_priv->frame_delay);
 
     iosys_entry->io_priv = cap_priv;
     return 0;
@@ -390,6 +1145,8 @@ static void destroy_entry(void *opaque, uint8_t *data)
         sp_frame_fifo_push(entry->frames, NULL);
 
         av_buffer_pool_uninit(&io_priv->pool);
+        sp_colorconv_free(&io_priv->conv);
+        sp_clock_follower_uninit(&io_priv->clock);
     }
 
     av_free(priv);
@@ -158,8 +158,43 @@ typedef struct SPLinkCtx {
 
     int src_stream_id;
     char *src_stream_desc;
+
+    /* The demuxer is waiting on this link to get connected */
+    int demux_pending;
 } SPLinkCtx;
 
+static int link_demuxer(SPLinkCtx *cb_ctx, DemuxingContext *src_demux_ctx,
+                        void *dst_ctx)
+{
+    int err;
+    enum SPType d_type = sp_class_get_type(dst_ctx);
+
+    if (d_type == SP_TYPE_DECODER) {
+        err = sp_decoding_connect((DecodingContext *)dst_ctx, src_demux_ctx,
+                                  cb_ctx->src_stream_id, cb_ctx->src_stream_desc);
+    } else {
+        MuxingContext *dst_mux_ctx = dst_ctx;
+
+        err = sp_demuxer_find_stream(src_demux_ctx, dst_ctx, cb_ctx->src_stream_id,
+                                     cb_ctx->src_stream_desc);
+        if (err >= 0) {
+            int idx = err;
+            err = sp_muxer_add_stream_copy(dst_mux_ctx, src_demux_ctx, idx);
+            if (err >= 0) {
+                AVBufferRef *src_fifo = sp_demuxer_enable_stream(src_demux_ctx, idx);
+                err = !src_fifo ? AVERROR(ENOMEM) :
+                      sp_packet_fifo_mirror(dst_mux_ctx->src_packets, src_fifo);
+            }
+        }
+    }
+
+    /* Even on failure, the demuxer should not wait on us any longer */
+    cb_ctx->demux_pending = 0;
+    sp_demuxer_pending_link_done(src_demux_ctx);
+
+    return err;
+}
+
 static int link_fn(AVBufferRef *event_ref, void *callback_ctx, void *dst_ctx,
                    void *src_ctx, void *data)
 {
@@ -203,12 +238,9 @@ static int link_fn(AVBufferRef *event_ref, void *callback_ctx, void *dst_ctx,
             return err;
 
         return sp_packet_fifo_mirror(dst_fifo, src_fifo);
-    } else if ((s_type == SP_TYPE_DEMUXER) && (d_type == SP_TYPE_DECODER)) {
-        DemuxingContext *src_mux_ctx = src_ctx;
-        DecodingContext *dst_dec_ctx = dst_ctx;
-
-        return sp_decoding_connect(dst_dec_ctx, src_mux_ctx,
-                                   cb_ctx->src_stream_id, cb_ctx->src_stream_desc);
+    } else if ((s_type == SP_TYPE_DEMUXER) && (d_type == SP_TYPE_DECODER ||
+                                               d_type == SP_TYPE_MUXER)) {
+        return link_demuxer(cb_ctx, (DemuxingContext *)src_ctx, dst_ctx);
     } else if ((s_type & SP_TYPE_DECODER) && (d_type == SP_TYPE_ENCODER)) {
         sp_assert(dst_fifo && src_fifo);
 
@@ -243,6 +275,15 @@ static int link_fn(AVBufferRef *event_ref, void *callback_ctx, void *dst_ctx,
             return AVERROR(EINVAL);
         }
 
+        return sp_frame_fifo_mirror(dst_fifo, src_fifo);
+    } else if ((s_type == SP_TYPE_FILTER) && (d_type == SP_TYPE_AUDIO_SINK)) {
+        sp_assert(!!dst_fifo);
+
+        return sp_map_fifo_to_pad((FilterContext *)src_ctx, dst_fifo,
+                                  cb_ctx->src_filt_pad, 1);
+    } else if ((s_type == SP_TYPE_DECODER) && (d_type == SP_TYPE_AUDIO_SINK)) {
+        sp_assert(dst_fifo && src_fifo);
+
         return sp_frame_fifo_mirror(dst_fifo, src_fifo);
     } else {
         sp_assert(1); /* Should never happen */
@@ -256,6 +297,8 @@ static int link_fn(AVBufferRef *event_ref, void *callback_ctx, void *dst_ctx,
 static void link_free(void *callback_ctx, void *dst_ctx, void *src_ctx)
 {
     SPLinkCtx *cb_ctx = callback_ctx;
+    if (cb_ctx->demux_pending)
+        sp_demuxer_pending_link_done((DemuxingContext *)src_ctx);
     av_free(cb_ctx->src_filt_pad);
     av_free(cb_ctx->dst_filt_pad);
     av_free(cb_ctx->src_stream_desc);
@@ -329,6 +372,13 @@ int sp_generic_link(TXMainContext *ctx,
         dst_filt_pad = av_strdup(dst_pad_name);
         src_ctrl_fn = ((IOSysEntry *)src_ref->data)->ctrl;
         dst_ctrl_fn = sp_filter_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_FILTER, SP_TYPE_AUDIO_SINK)) {
+        /* Playback, only entries opened as outputs are pure sinks */
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_FILTER);
+        dst_ref = PICK_REF_INV(obj1, obj2, SP_TYPE_FILTER);
+        src_filt_pad = av_strdup(src_pad_name);
+        src_ctrl_fn = sp_filter_ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
     } else if ((sp_class_get_type(obj1->data) == SP_TYPE_FILTER) &&
                (sp_class_get_type(obj2->data) == SP_TYPE_FILTER)) {
         /* NOTE: we're unable to determine order for filter to filter connections.
@@ -363,6 +413,11 @@ int sp_generic_link(TXMainContext *ctx,
         dst_ref = PICK_REF(obj1, obj2, SP_TYPE_ENCODER);
         src_ctrl_fn = sp_decoder_ctrl;
         dst_ctrl_fn = sp_encoder_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_DECODER, SP_TYPE_AUDIO_SINK)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_DECODER);
+        dst_ref = PICK_REF_INV(obj1, obj2, SP_TYPE_DECODER);
+        src_ctrl_fn = sp_decoder_ctrl;
+        dst_ctrl_fn = ((IOSysEntry *)dst_ref->data)->ctrl;
     } else if (EITHER(obj1, obj2, SP_TYPE_DEMUXER, SP_TYPE_DECODER)) {
         src_ref = PICK_REF(obj1, obj2, SP_TYPE_DEMUXER);
         dst_ref = PICK_REF(obj1, obj2, SP_TYPE_DECODER);
@@ -370,6 +425,13 @@ int sp_generic_link(TXMainContext *ctx,
         stream_desc = av_strdup(src_stream_desc);
         src_ctrl_fn = sp_demuxer_ctrl;
         dst_ctrl_fn = sp_decoder_ctrl;
+    } else if (EITHER(obj1, obj2, SP_TYPE_DEMUXER, SP_TYPE_MUXER)) {
+        src_ref = PICK_REF(obj1, obj2, SP_TYPE_DEMUXER);
+        dst_ref = PICK_REF(obj1, obj2, SP_TYPE_MUXER);
+        stream_id = src_stream_id;
+        stream_desc = av_strdup(src_stream_desc);
+        src_ctrl_fn = sp_demuxer_ctrl;
+        dst_ctrl_fn = sp_muxer_ctrl;
     } else {
         sp_log(ctx, SP_LOG_ERROR, "Unable to link \"%s\" (%s) to \"%s\" (%s)!\n",
                sp_class_get_name(obj1->data), sp_class_type_string(obj1->data),
@@ -408,6 +470,11 @@ int sp_generic_link(TXMainContext *ctx,
     if (!src_post_init)
         flags |= SP_EVENT_FLAG_DEPENDENCY;
 
+    /* Muxers may take multiple streams from a single demuxer */
+    if (sp_class_get_type(sctx) == SP_TYPE_DEMUXER &&
+        sp_class_get_type(dctx) == SP_TYPE_MUXER)
+        flags |= SP_EVENT_FLAG_UNIQUE;
+
     AVBufferRef *link_event = sp_event_create(link_fn, link_free,
                                               sizeof(SPLinkCtx), NULL, flags,
                                               dctx, sctx);
@@ -420,6 +487,12 @@ int sp_generic_link(TXMainContext *ctx,
     link_event_ctx->src_stream_id = stream_id;
     link_event_ctx->src_stream_desc = stream_desc;
 
+    /* Demuxers hold off reading until all their consumers are connected */
+    if (sp_class_get_type(sctx) == SP_TYPE_DEMUXER) {
+        link_event_ctx->demux_pending = 1;
+        sp_demuxer_add_pending_link((DemuxingContext *)sctx);
+    }
+
     /* Add event to destination context */
     dst_ctrl_fn(dst_ref, SP_EVENT_CTRL_NEW_EVENT, link_event);
 
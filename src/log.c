@@ -752,6 +752,17 @@ enum SPType sp_class_get_type(void *ctx)
     return SP_TYPE_NONE;
 }
 
+int sp_class_set_type(void *ctx, enum SPType type)
+{
+    SPClass *class = get_class(ctx);
+    if (!class)
+        return AVERROR(EINVAL);
+
+    class->type = type;
+
+    return 0;
+}
+
 const char *sp_class_type_string(void *ctx)
 {
     SPClass *class = get_class(ctx);
@@ -354,6 +354,12 @@ static int lua_generic_schedule(lua_State *L)
     case SP_TYPE_MUXER:
         fn = sp_muxer_ctrl;
         break;
+    case SP_TYPE_DEMUXER:
+        fn = sp_demuxer_ctrl;
+        break;
+    case SP_TYPE_DECODER:
+        fn = sp_decoder_ctrl;
+        break;
     case SP_TYPE_FILTER:
         fn = sp_filter_ctrl;
         break;
@@ -527,6 +533,12 @@ static int lua_create_muxer(lua_State *L)
     GET_OPT_STR(mctx->name, "name");
     GET_OPT_STR(mctx->out_url, "out_url");
     GET_OPT_STR(mctx->out_format, "out_format");
+    GET_OPT_NUM(mctx->writer_buffer_size, "writer_buffer_size");
+    GET_OPT_NUM(mctx->replay_duration, "replay_duration");
+    GET_OPT_NUM(mctx->replay_max_bytes, "replay_max_bytes");
+    GET_OPT_NUM(mctx->segment_duration, "segment_duration");
+    GET_OPT_NUM(mctx->segment_size, "segment_size");
+    GET_OPT_STR(mctx->segment_list, "segment_list");
 
     err = sp_muxer_init(mctx_ref);
     if (err < 0)
@@ -575,6 +587,7 @@ static int lua_create_demuxer(lua_State *L)
     GET_OPT_STR(mctx->name, "name");
     GET_OPT_STR(mctx->in_url, "in_url");
     GET_OPT_STR(mctx->in_format, "in_format");
+    GET_OPT_NUM(mctx->readahead_size, "readahead_size");
     GET_OPTS_DICT(mctx->start_options, "options");
 
     err = sp_demuxer_init(mctx_ref);
@@ -1085,7 +1098,7 @@ static int lua_set_epoch(lua_State *L)
         AVBufferRef *obj = lua_touserdata(L, -1);
         err = sp_epoch_event_set_source(epoch_event, obj);
         if (err < 0)
-            LUA_ERROR("Invalid reference category, expected \"clock source\", got \"%s\"!",
+            LUA_ERROR("Invalid reference, expected a \"clock source\" or an I/O with one, got \"%s\"!",
                       sp_class_type_string(obj->data));
     } else if (lua_isnumber(L, -1) || lua_isinteger(L, -1)) {
         int64_t value = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : lua_tonumber(L, -1);
@@ -16,8 +16,17 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include <libavutil/time.h>
 #include <libavutil/avstring.h>
+#include <libavutil/opt.h>
+#include <libavcodec/bsf.h>
 
 #include <libtxproto/mux.h>
 
@@ -25,21 +34,474 @@
 #include "utils.h"
 #include "ctrl_template.h"
 #include "os_compat.h"
+#include "avio_async.h"
+#include "replay.h"
+#include "segment.h"
 
 typedef struct MuxEncoderMap {
     intptr_t encoder_id;
+    int src_stream_index; /* Demuxer stream for stream copies, -1 for encoders */
     int stream_index;
     char *name;
+    AVBSFContext *bsf;
 } MuxEncoderMap;
 
-static MuxEncoderMap *enc_id_lookup(MuxingContext *ctx, intptr_t enc_id)
+static MuxEncoderMap *enc_id_lookup(MuxingContext *ctx, intptr_t enc_id,
+                                    int src_stream_index)
 {
     for (int i = 0; i < ctx->enc_map_size; i++)
-        if (ctx->enc_map[i].encoder_id == enc_id)
+        if (ctx->enc_map[i].encoder_id == enc_id &&
+            (ctx->enc_map[i].src_stream_index < 0 ||
+             ctx->enc_map[i].src_stream_index == src_stream_index))
             return &ctx->enc_map[i];
     return NULL;
 }
 
+/* Writes to the output, or in replay mode or while reconnecting, to a queue.
+ * Takes ownership of the packet's data, NULL flushes the interleaving queue. */
+static int mux_write_packet(MuxingContext *ctx, AVPacket *pkt)
+{
+    SPReplayBuffer *queue = ctx->replay ? ctx->replay :
+                            ctx->reconnecting ? ctx->reconnect_queue : NULL;
+
+    if (!queue && ctx->chunked)
+        return av_write_frame(ctx->avf, pkt); /* Interleaving would delay chunks */
+    else if (!queue)
+        return av_interleaved_write_frame(ctx->avf, pkt);
+    else if (!pkt)
+        return 0;
+
+    AVPacket *rpkt = av_packet_alloc();
+    if (!rpkt)
+        return AVERROR(ENOMEM);
+
+    av_packet_move_ref(rpkt, pkt);
+    rpkt->time_base = ctx->avf->streams[rpkt->stream_index]->time_base;
+
+    int is_key = (rpkt->stream_index == ctx->key_stream) &&
+                 (rpkt->flags & AV_PKT_FLAG_KEY);
+
+    return sp_replay_add(queue, rpkt, is_key);
+}
+
+/* Takes ownership of the packet's data, NULL flushes the filter */
+static int write_bsf_packet(MuxingContext *ctx, MuxEncoderMap *src_enc, AVPacket *pkt)
+{
+    int err = av_bsf_send_packet(src_enc->bsf, pkt);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Error filtering packet from \"%s\": %s!\n",
+               src_enc->name, av_err2str(err));
+        return err;
+    }
+
+    AVPacket *out_pkt = av_packet_alloc();
+    if (!out_pkt)
+        return AVERROR(ENOMEM);
+
+    AVRational dst_tb = ctx->avf->streams[src_enc->stream_index]->time_base;
+
+    while (1) {
+        err = av_bsf_receive_packet(src_enc->bsf, out_pkt);
+        if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+            err = 0;
+            break;
+        } else if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Error filtering packet from \"%s\": %s!\n",
+                   src_enc->name, av_err2str(err));
+            break;
+        }
+
+        out_pkt->stream_index = src_enc->stream_index;
+        av_packet_rescale_ts(out_pkt, src_enc->bsf->time_base_out, dst_tb);
+
+        err = mux_write_packet(ctx, out_pkt);
+        if (err < 0)
+            break;
+    }
+
+    av_packet_free(&out_pkt);
+
+    return err;
+}
+
+static int write_header(MuxingContext *ctx, AVFormatContext *avf,
+                        SPAVIOWriter **writer)
+{
+    int ret;
+
+    /* Packets skip interleaving, and fragments are cut with frag_custom,
+     * which only movenc has */
+    if (ctx->chunked && !av_match_name(avf->oformat->name, "mp4,mov,ipod,ismv")) {
+        sp_log(ctx, SP_LOG_ERROR, "Chunked output is not supported for format \"%s\"!\n",
+               avf->oformat->name);
+        return AVERROR(EINVAL);
+    }
+
+    avf->flags |= AVFMT_FLAG_AUTO_BSF;
+
+    /* movenc reopens the output to move the index to the front, which needs
+     * everything on disk. Nothing's been written yet, so swap to lavf I/O. */
+    if (*writer && av_opt_flag_is_set(avf->priv_data, "movflags", "faststart")) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Output is read back, not using the buffered writer\n");
+        sp_avio_writer_close(writer);
+        avf->pb = NULL;
+        ret = avio_open(&avf->pb, avf->url, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", avf->url, av_err2str(ret));
+            return ret;
+        }
+    }
+
+    if (ctx->low_latency) {
+        avf->flags |= AVFMT_FLAG_FLUSH_PACKETS | AVFMT_FLAG_NOBUFFER;
+        avf->pb->min_packet_size = 0;
+    }
+
+    if (ctx->chunked) {
+        avf->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        avf->pb->min_packet_size = 0;
+
+        /* Fragments are only cut when we flush them */
+        if (av_opt_set(avf->priv_data, "movflags",
+                       "+frag_custom+empty_moov+default_base_moof+cmaf", 0) < 0)
+            av_opt_set(avf->priv_data, "movflags",
+                       "+frag_custom+empty_moov+default_base_moof", 0);
+    }
+
+    ret = avformat_write_header(avf, NULL);
+    if (ret < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Could not write header: %s!\n", av_err2str(ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+static int open_output(MuxingContext *ctx, AVFormatContext *avf,
+                       SPAVIOWriter **writer, const char *url)
+{
+    int err = AVERROR(ENOTSUP);
+
+    if (ctx->writer_buffer_size > 0 && !(avf->oformat->flags & AVFMT_NOFILE)) {
+        err = sp_avio_writer_open(writer, &avf->pb, ctx, url,
+                                  ctx->writer_buffer_size);
+        if (err < 0 && err != AVERROR(ENOTSUP))
+            sp_log(ctx, SP_LOG_WARN, "Unable to open buffered writer: %s, "
+                   "falling back to lavf I/O\n", av_err2str(err));
+    }
+    if (err < 0)
+        err = avio_open(&avf->pb, url, AVIO_FLAG_WRITE);
+    if (err < 0)
+        sp_log(ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", url, av_err2str(err));
+
+    return err;
+}
+
+static int segment_paths(MuxingContext *ctx)
+{
+    char buf[4096];
+
+    if (av_get_frame_filename2(buf, sizeof(buf), ctx->segment_template,
+                               ctx->segment_idx, 0) < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Segment output URL \"%s\" has no sequence "
+               "number pattern!\n", ctx->segment_template);
+        return AVERROR(EINVAL);
+    }
+
+    av_free(ctx->segment_final_path);
+    av_free(ctx->segment_part_path);
+    ctx->segment_final_path = av_strdup(buf);
+    ctx->segment_part_path = av_asprintf("%s.part", buf);
+    if (!ctx->segment_final_path || !ctx->segment_part_path)
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+/* Creates a new, unopened output context with the same streams and options */
+static int clone_output(AVFormatContext *old, AVFormatContext **out,
+                        const char *url)
+{
+    int err;
+    AVFormatContext *avf = NULL;
+    char *opts = NULL;
+
+    err = avformat_alloc_output_context2(&avf, old->oformat, NULL, url);
+    if (err < 0)
+        return err;
+
+    avf->flags = old->flags;
+    avf->strict_std_compliance = old->strict_std_compliance;
+    av_dict_copy(&avf->metadata, old->metadata, 0);
+
+    /* Carry over user-set muxer options */
+    if (old->oformat->priv_class &&
+        av_opt_serialize(old->priv_data, 0, AV_OPT_SERIALIZE_SKIP_DEFAULTS,
+                         &opts, '=', ':') >= 0 && opts && opts[0])
+        av_set_options_string(avf->priv_data, opts, "=", ":");
+
+    for (int i = 0; i < old->nb_streams; i++) {
+        AVStream *in_st = old->streams[i];
+        AVStream *st = avformat_new_stream(avf, NULL);
+        if (!st) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+
+        err = avcodec_parameters_copy(st->codecpar, in_st->codecpar);
+        if (err < 0)
+            goto fail;
+
+        st->time_base           = in_st->time_base;
+        st->avg_frame_rate      = in_st->avg_frame_rate;
+        st->r_frame_rate        = in_st->r_frame_rate;
+        st->sample_aspect_ratio = in_st->sample_aspect_ratio;
+        st->disposition         = in_st->disposition;
+        av_dict_copy(&st->metadata, in_st->metadata, 0);
+    }
+
+    av_free(opts);
+    *out = avf;
+
+    return 0;
+
+fail:
+    av_free(opts);
+    avformat_free_context(avf);
+    return err;
+}
+
+/* Cuts the current chunk and pushes it out, measuring how long the oldest
+ * packet of each stream in it waited since reaching the muxer */
+static int flush_chunk(MuxingContext *ctx, int64_t *arrival,
+                       SlidingWinCtx *sctx_delay, int64_t *delay)
+{
+    int err = av_write_frame(ctx->avf, NULL);
+    if (err < 0)
+        return err;
+
+    avio_flush(ctx->avf->pb);
+
+    int64_t now = av_gettime_relative();
+    for (int i = 0; i < ctx->avf->nb_streams; i++) {
+        if (arrival[i] == AV_NOPTS_VALUE)
+            continue;
+        delay[i] = sp_sliding_win(&sctx_delay[i], now - arrival[i], now,
+                                  av_make_q(1, 1000000), 1000000, 1);
+        arrival[i] = AV_NOPTS_VALUE;
+    }
+
+    ctx->chunk_start = AV_NOPTS_VALUE;
+
+    return 0;
+}
+
+/* Makes MP4 segments fragmented, so they stay playable if cut short */
+static void segment_set_format_opts(AVFormatContext *avf)
+{
+    if (av_match_name(avf->oformat->name, "mp4,mov,ipod,ismv"))
+        av_opt_set(avf->priv_data, "movflags",
+                   "+frag_keyframe+empty_moov+default_base_moof", 0);
+}
+
+/* Closes the current segment, hands it to the finaliser and opens the next */
+static int next_segment(MuxingContext *ctx)
+{
+    int err;
+    AVFormatContext *old = ctx->avf, *avf = NULL;
+    SPAVIOWriter *writer = NULL;
+
+    ctx->segment_idx++;
+    char *old_part = ctx->segment_part_path;
+    char *old_final = ctx->segment_final_path;
+    ctx->segment_part_path = ctx->segment_final_path = NULL;
+
+    err = segment_paths(ctx);
+    if (err < 0)
+        goto end;
+
+    err = clone_output(old, &avf, ctx->segment_part_path);
+    if (err < 0)
+        goto end;
+
+    segment_set_format_opts(avf);
+
+    err = open_output(ctx, avf, &writer, ctx->segment_part_path);
+    if (err < 0)
+        goto end;
+
+    err = write_header(ctx, avf, &writer);
+    if (err < 0)
+        goto end;
+
+    err = av_write_trailer(old);
+    if (err < 0)
+        sp_log(ctx, SP_LOG_ERROR, "Error writing segment trailer: %s!\n",
+               av_err2str(err));
+
+    double duration = (ctx->segment_last_ts - ctx->segment_start) / (double)AV_TIME_BASE;
+    err = sp_segment_finaliser_add(ctx->segment_finaliser, old, ctx->writer,
+                                   old_part, old_final, duration);
+    if (err < 0)
+        goto end;
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Started segment \"%s\"\n", ctx->segment_final_path);
+
+    ctx->avf = avf;
+    ctx->writer = writer;
+    avf = NULL;
+    writer = NULL;
+
+end:
+    if (avf) {
+        if (writer)
+            sp_avio_writer_close(&writer);
+        else
+            avio_closep(&avf->pb);
+        avf->pb = NULL;
+        avformat_free_context(avf);
+    }
+    av_free(old_part);
+    av_free(old_final);
+    return err;
+}
+
+/* Drops a broken output, packets get queued until it's reopened */
+static void output_lost(MuxingContext *ctx, int err)
+{
+    sp_log(ctx, SP_LOG_ERROR, "Output lost: %s, reconnecting...\n", av_err2str(err));
+
+    if (ctx->writer) {
+        sp_avio_writer_close(&ctx->writer);
+        ctx->avf->pb = NULL;
+    } else {
+        avio_closep(&ctx->avf->pb);
+    }
+
+    /* The old context stays around as a template for the new one */
+    ctx->reconnecting = 1;
+    ctx->reconnect_attempts = 0;
+    ctx->reconnect_next = av_gettime_relative();
+    ctx->chunk_start = AV_NOPTS_VALUE;
+}
+
+/* How often to check whether a FIFO output has a reader again, in us */
+#define FIFO_POLL_INTERVAL 250000
+
+/* Opening a FIFO for writing blocks until it has a reader. Opens it without
+ * blocking instead, which fails with ENXIO if there's none. The descriptor
+ * is kept until the output is open, so the real open can't block either. */
+static int fifo_probe_reader(const char *url, int *fd)
+{
+    struct stat st;
+    const char *proto = avio_find_protocol_name(url);
+
+    *fd = -1;
+
+    if (!proto || strcmp(proto, "file"))
+        return 0;
+    if (!strncmp(url, "file:", strlen("file:")))
+        url += strlen("file:");
+    if (stat(url, &st) || !S_ISFIFO(st.st_mode))
+        return 0;
+
+    *fd = open(url, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (*fd < 0)
+        return AVERROR(errno);
+
+    return 0;
+}
+
+/* Reopens the output once the backoff has passed, and writes out the queue
+ * from its newest keyframe. Returns 1 if reconnected. Called with ctx->lock
+ * held, which is released while opening the output. */
+static int try_reconnect(MuxingContext *ctx)
+{
+    int err, fifo_fd;
+    AVFormatContext *avf = NULL;
+    SPAVIOWriter *writer = NULL;
+
+    if (av_gettime_relative() < ctx->reconnect_next)
+        return 0;
+
+    /* Nothing decodable to resume with yet */
+    if (sp_replay_seek_last_key(ctx->reconnect_queue) < 0)
+        return 0;
+
+    err = fifo_probe_reader(ctx->out_url, &fifo_fd);
+    if (err == AVERROR(ENXIO)) {
+        /* Nobody's reading yet, poll without backing off */
+        ctx->reconnect_next = av_gettime_relative() + FIFO_POLL_INTERVAL;
+        return 0;
+    } else if (err < 0) {
+        goto fail;
+    }
+
+    err = clone_output(ctx->avf, &avf, ctx->out_url);
+    if (err < 0)
+        goto fail;
+
+    /* Network outputs may take a while, don't stall ctrl calls meanwhile */
+    pthread_mutex_unlock(&ctx->lock);
+    err = open_output(ctx, avf, &writer, ctx->out_url);
+    pthread_mutex_lock(&ctx->lock);
+    if (fifo_fd >= 0)
+        close(fifo_fd);
+    fifo_fd = -1;
+    if (err < 0)
+        goto fail;
+
+    err = write_header(ctx, avf, &writer);
+    if (err < 0)
+        goto fail;
+
+    sp_log(ctx, SP_LOG_INFO, "Reconnected after %i attempt(s)\n",
+           ctx->reconnect_attempts + 1);
+
+    avformat_free_context(ctx->avf);
+    ctx->avf = avf;
+    ctx->writer = writer;
+    ctx->reconnecting = 0;
+
+    AVPacket *pkt;
+    while ((pkt = sp_replay_pop(ctx->reconnect_queue))) {
+        AVRational tb = avf->streams[pkt->stream_index]->time_base;
+        av_packet_rescale_ts(pkt, pkt->time_base, tb);
+        pkt->time_base = tb;
+
+        err = mux_write_packet(ctx, pkt);
+        av_packet_free(&pkt);
+        if (err < 0) {
+            output_lost(ctx, err);
+            return 0;
+        }
+    }
+
+    return 1;
+
+fail:
+    if (fifo_fd >= 0)
+        close(fifo_fd);
+    if (avf) {
+        if (writer)
+            sp_avio_writer_close(&writer);
+        else
+            avio_closep(&avf->pb);
+        avf->pb = NULL;
+        avformat_free_context(avf);
+    }
+
+    int64_t delay = FFMIN(500000LL << FFMIN(ctx->reconnect_attempts, 16),
+                          llrint(ctx->reconnect_delay_max * AV_TIME_BASE));
+    ctx->reconnect_attempts++;
+    ctx->reconnect_next = av_gettime_relative() + delay;
+
+    sp_log(ctx, SP_LOG_WARN, "Reconnect attempt %i failed: %s, retrying in %.1f s\n",
+           ctx->reconnect_attempts, av_err2str(err), delay / (double)AV_TIME_BASE);
+
+    return 0;
+}
+
 static void *muxing_thread(void *arg)
 {
     int err = 0;
@@ -52,9 +514,22 @@ static void *muxing_thread(void *arg)
     SlidingWinCtx *sctx_latency = av_mallocz(ctx->avf->nb_streams * sizeof(*sctx_latency));
     int64_t *rate = av_mallocz(ctx->avf->nb_streams * sizeof(*rate));
     int64_t *latency = av_mallocz(ctx->avf->nb_streams * sizeof(*latency));
+    SlidingWinCtx *sctx_chunk_delay = av_mallocz(ctx->avf->nb_streams * sizeof(*sctx_chunk_delay));
+    int64_t *chunk_delay = av_mallocz(ctx->avf->nb_streams * sizeof(*chunk_delay));
+    int64_t *chunk_arrival = av_malloc(ctx->avf->nb_streams * sizeof(*chunk_arrival));
+    for (int i = 0; i < ctx->avf->nb_streams; i++)
+        chunk_arrival[i] = AV_NOPTS_VALUE;
 
     sp_set_thread_name_self(sp_class_get_name(ctx));
 
+    /* Let writes to a closed pipe or socket fail rather than kill us */
+    if (ctx->reconnect_queue) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+
     if (ctx->dump_sdp_file) {
         char sdp_data[16384];
         err = av_sdp_create(&ctx->avf, 1, sdp_data, sizeof(sdp_data));
@@ -85,8 +560,20 @@ static void *muxing_thread(void *arg)
     SlidingWinCtx sctx_mux = { 0 };
     int64_t last_pos_update = av_gettime_relative();
     int64_t mux_rate = 0;
-    int64_t last_pos = ctx->avf->pb->pos;
+    int64_t last_pos = ctx->avf->pb ? ctx->avf->pb->pos : 0;
     int64_t buf_bytes = 0;
+    SPAVIOWriterStats writer_stats = { 0 };
+    int64_t replay_duration = 0;
+    int64_t replay_bytes = 0;
+
+    /* Keyframes of the first video stream delimit GOPs */
+    ctx->key_stream = 0;
+    for (int i = 0; i < ctx->avf->nb_streams; i++) {
+        if (ctx->avf->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            ctx->key_stream = i;
+            break;
+        }
+    }
 
     sp_log(ctx, SP_LOG_VERBOSE, "Muxer initialized!\n");
 
@@ -94,6 +581,9 @@ static void *muxing_thread(void *arg)
 
     while (1) {
         AVPacket *in_pkt = NULL;
+        MuxEncoderMap *src_enc = NULL;
+        int chunk_sidx = -1;
+        int64_t chunk_pts = AV_NOPTS_VALUE, chunk_end = AV_NOPTS_VALUE;
         pthread_mutex_lock(&ctx->lock);
 
         sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_CONFIG | SP_EVENT_ON_INIT, NULL);
@@ -109,16 +599,77 @@ static void *muxing_thread(void *arg)
             }
         }
 
-        if (flush)
+        if (flush) {
+            /* Drain any stream-copy bitstream filters before the muxer */
+            for (int i = 0; i < ctx->enc_map_size; i++) {
+                if (!ctx->enc_map[i].bsf)
+                    continue;
+                err = write_bsf_packet(ctx, &ctx->enc_map[i], NULL);
+                if (err < 0) {
+                    pthread_mutex_unlock(&ctx->lock);
+                    goto fail;
+                }
+            }
             goto send;
+        }
 
         AVRational src_tb = in_pkt->time_base;
 
-        MuxEncoderMap *src_enc = enc_id_lookup(ctx, (intptr_t)in_pkt->opaque);
+        src_enc = enc_id_lookup(ctx, (intptr_t)in_pkt->opaque, in_pkt->stream_index);
+        if (!src_enc) {
+            sp_log(ctx, SP_LOG_WARN, "Got packet from an unknown source, dropping!\n");
+            av_packet_free(&in_pkt);
+            pthread_mutex_unlock(&ctx->lock);
+            continue;
+        }
+
         int sidx = src_enc->stream_index;
 
         in_pkt->stream_index = sidx;
 
+        /* Cut segments on keyframes, before timestamps get rescaled to
+         * what may be a new context */
+        if (ctx->segment_finaliser && sidx == ctx->key_stream &&
+            in_pkt->pts != AV_NOPTS_VALUE) {
+            int64_t ts = av_rescale_q(in_pkt->pts, src_tb, AV_TIME_BASE_Q);
+            if (ctx->segment_start == AV_NOPTS_VALUE)
+                ctx->segment_start = ts;
+
+            int cut = (ctx->segment_duration > 0 &&
+                       (ts - ctx->segment_start) >= ctx->segment_duration * AV_TIME_BASE) ||
+                      (ctx->segment_size > 0 && avio_tell(ctx->avf->pb) >= ctx->segment_size);
+
+            if (cut && (in_pkt->flags & AV_PKT_FLAG_KEY)) {
+                err = next_segment(ctx);
+                if (err < 0) {
+                    sp_log(ctx, SP_LOG_ERROR, "Unable to start a new segment: %s!\n",
+                           av_err2str(err));
+                    av_packet_free(&in_pkt);
+                    pthread_mutex_unlock(&ctx->lock);
+                    goto fail;
+                }
+                ctx->segment_start = ts;
+                last_pos = ctx->avf->pb->pos;
+
+                /* The trailer flushed any pending chunk */
+                ctx->chunk_start = AV_NOPTS_VALUE;
+                for (int i = 0; i < ctx->avf->nb_streams; i++)
+                    chunk_arrival[i] = AV_NOPTS_VALUE;
+            }
+
+            ctx->segment_last_ts = ts;
+        }
+
+        if (ctx->chunked && !ctx->replay) {
+            if (chunk_arrival[sidx] == AV_NOPTS_VALUE)
+                chunk_arrival[sidx] = av_gettime_relative();
+            chunk_sidx = sidx;
+            if (in_pkt->pts != AV_NOPTS_VALUE) {
+                chunk_pts = av_rescale_q(in_pkt->pts, src_tb, AV_TIME_BASE_Q);
+                chunk_end = av_rescale_q(in_pkt->pts + in_pkt->duration, src_tb, AV_TIME_BASE_Q);
+            }
+        }
+
         AVRational dst_tb = ctx->avf->streams[sidx]->time_base;
         SlidingWinCtx *rate_c = &sctx_rate[sidx];
         SlidingWinCtx *latency_c = &sctx_latency[sidx];
@@ -129,19 +680,27 @@ static void *muxing_thread(void *arg)
         latency[sidx] -= av_rescale_q(in_pkt->pts, src_tb, av_make_q(1, 1000000));
         latency[sidx]  = sp_sliding_win(latency_c, latency[sidx], in_pkt->pts, src_tb, src_tb.den, 1);
 
-        /* Rescale timestamps */
-        in_pkt->pts = av_rescale_q(in_pkt->pts, src_tb, dst_tb);
-        in_pkt->dts = av_rescale_q(in_pkt->dts, src_tb, dst_tb);
-        in_pkt->duration = av_rescale_q(in_pkt->duration, src_tb, dst_tb);
+        /* Rescale timestamps, filtered packets get rescaled on output */
+        if (!src_enc->bsf) {
+            in_pkt->pts = av_rescale_q(in_pkt->pts, src_tb, dst_tb);
+            in_pkt->dts = av_rescale_q(in_pkt->dts, src_tb, dst_tb);
+            in_pkt->duration = av_rescale_q(in_pkt->duration, src_tb, dst_tb);
+
+            sp_log(ctx, SP_LOG_TRACE, "Got packet from \"%s\", sidx = %i, out pts = %f, out_dts = %f\n",
+                   src_enc->name,
+                   sidx,
+                   av_q2d(dst_tb) * in_pkt->pts,
+                   av_q2d(dst_tb) * in_pkt->dts);
+        }
 
-        sp_log(ctx, SP_LOG_TRACE, "Got packet from \"%s\", sidx = %i, out pts = %f, out_dts = %f\n",
-               src_enc->name,
-               sidx,
-               av_q2d(dst_tb) * in_pkt->pts,
-               av_q2d(dst_tb) * in_pkt->dts);
+        if (ctx->replay)
+            sp_replay_get_stats(ctx->replay, &replay_duration, &replay_bytes);
+        else if (ctx->reconnecting)
+            sp_replay_get_stats(ctx->reconnect_queue, &replay_duration, &replay_bytes);
 
-        buf_bytes = ctx->avf->pb->buf_ptr - ctx->avf->pb->buffer;
-        if (last_pos != ctx->avf->pb->pos) {
+        buf_bytes = ctx->avf->pb ? ctx->avf->pb->buf_ptr - ctx->avf->pb->buffer : 0;
+
+        if (ctx->avf->pb && last_pos != ctx->avf->pb->pos) {
             int64_t t_delta, cur_time = av_gettime_relative();
             mux_rate = (ctx->avf->pb->pos - last_pos) << 3;
             t_delta = cur_time - last_pos_update;
@@ -153,10 +712,15 @@ static void *muxing_thread(void *arg)
         }
 
 send:
-        err = av_interleaved_write_frame(ctx->avf, in_pkt);
+        if (src_enc && src_enc->bsf)
+            err = write_bsf_packet(ctx, src_enc, in_pkt);
+        else
+            err = mux_write_packet(ctx, in_pkt);
         av_packet_free(&in_pkt);
 
-        if (err == AVERROR(ETIMEDOUT)) {
+        if (err < 0 && ctx->reconnect_queue && !flush) {
+            output_lost(ctx, err);
+        } else if (err == AVERROR(ETIMEDOUT)) {
             sp_log(ctx, SP_LOG_ERROR, "Error muxing, operation timed out!\n");
             pthread_mutex_unlock(&ctx->lock);
             continue;
@@ -171,18 +735,58 @@ send:
             break;
         }
 
-        int entries = 2 + 2*ctx->avf->nb_streams;
+        /* Retry a lost output, the position restarts with the new one */
+        if (ctx->reconnecting && try_reconnect(ctx))
+            last_pos = 0;
+
+        /* Chunks are cut on the key stream once they span chunk_duration */
+        if (chunk_sidx >= 0 && chunk_sidx == ctx->key_stream && !ctx->reconnecting) {
+            if (ctx->chunk_start == AV_NOPTS_VALUE)
+                ctx->chunk_start = chunk_pts;
+            if (chunk_end == AV_NOPTS_VALUE || ctx->chunk_start == AV_NOPTS_VALUE ||
+                (chunk_end - ctx->chunk_start) >= ctx->chunk_duration) {
+                err = flush_chunk(ctx, chunk_arrival, sctx_chunk_delay, chunk_delay);
+                if (err < 0 && ctx->reconnect_queue) {
+                    output_lost(ctx, err);
+                } else if (err < 0) {
+                    sp_log(ctx, SP_LOG_ERROR, "Error flushing chunk: %s!\n", av_err2str(err));
+                    pthread_mutex_unlock(&ctx->lock);
+                    goto fail;
+                }
+            }
+        }
+
+        /* The reconnect queue reports like a replay buffer while in use */
+        int queue_stats = ctx->replay || ctx->reconnecting;
+        int nb_base = 2 + (ctx->writer ? 3 : 0) + (queue_stats ? 2 : 0);
+        int per_stream = ctx->chunked ? 3 : 2;
+        int entries = nb_base + per_stream*ctx->avf->nb_streams + 1;
         stat_entries = av_fast_realloc(stat_entries, &nb_stat_entries, sizeof(*stat_entries) * entries);
 
-        stat_entries[0] = D_TYPE("bitrate", NULL, mux_rate);
-        stat_entries[1] = D_TYPE("cached", NULL, buf_bytes);
+        int nb = 0;
+        stat_entries[nb++] = D_TYPE("bitrate", NULL, mux_rate);
+        stat_entries[nb++] = D_TYPE("cached", NULL, buf_bytes);
+
+        if (ctx->writer) {
+            sp_avio_writer_get_stats(ctx->writer, &writer_stats);
+            stat_entries[nb++] = D_TYPE("ring_fill", NULL, writer_stats.queued);
+            stat_entries[nb++] = D_TYPE("ring_size", NULL, writer_stats.capacity);
+            stat_entries[nb++] = D_TYPE("write_latency", NULL, writer_stats.last_latency);
+        }
+
+        if (queue_stats) {
+            stat_entries[nb++] = D_TYPE("replay_duration", NULL, replay_duration);
+            stat_entries[nb++] = D_TYPE("replay_bytes", NULL, replay_bytes);
+        }
 
         for (int i = 0; i < ctx->avf->nb_streams; i++) {
-            stat_entries[2 + 2*i + 0] = D_TYPE("bitrate", src_enc->name, rate[i]);
-            stat_entries[2 + 2*i + 1] = D_TYPE("latency", src_enc->name, latency[i]);
+            stat_entries[nb_base + per_stream*i + 0] = D_TYPE("bitrate", src_enc->name, rate[i]);
+            stat_entries[nb_base + per_stream*i + 1] = D_TYPE("latency", src_enc->name, latency[i]);
+            if (ctx->chunked)
+                stat_entries[nb_base + per_stream*i + 2] = D_TYPE("chunk_delay", src_enc->name, chunk_delay[i]);
         }
 
-        stat_entries[2 + 2*ctx->avf->nb_streams] = (SPGenericData){ 0 };
+        stat_entries[nb_base + per_stream*ctx->avf->nb_streams] = (SPGenericData){ 0 };
 
         sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_STATS, stat_entries);
 
@@ -196,6 +800,9 @@ fail:
     av_free(sctx_latency);
     av_free(rate);
     av_free(latency);
+    av_free(sctx_chunk_delay);
+    av_free(chunk_delay);
+    av_free(chunk_arrival);
     av_free(stat_entries);
 
     pthread_mutex_unlock(&ctx->lock);
@@ -231,6 +838,8 @@ int sp_muxer_add_stream(MuxingContext *ctx, EncodingContext *enc)
     }
 
     enc_map_entry->encoder_id = (intptr_t)sp_class_get_id(enc);
+    enc_map_entry->src_stream_index = -1;
+    enc_map_entry->bsf = NULL;
 
     if (0) {
 
@@ -282,6 +891,114 @@ end:
     return err;
 }
 
+int sp_muxer_add_stream_copy(MuxingContext *ctx, DemuxingContext *demux, int stream_idx)
+{
+    int err = 0;
+    AVStream *in_st = demux->avf->streams[stream_idx];
+    const AVCodecParameters *par = in_st->codecpar;
+    AVRational tb = in_st->time_base;
+    AVBSFContext *bsf = NULL;
+    const char *bsf_str = NULL;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    intptr_t demux_id = (intptr_t)sp_class_get_id(demux);
+    if (enc_id_lookup(ctx, demux_id, stream_idx)) {
+        sp_log(ctx, SP_LOG_ERROR, "Stream %i of \"%s\" is already linked!\n",
+               stream_idx, sp_class_get_name(demux));
+        err = AVERROR(EINVAL);
+        goto end;
+    }
+
+    switch (par->codec_type) {
+    case AVMEDIA_TYPE_VIDEO:    bsf_str = ctx->video_bsf;    break;
+    case AVMEDIA_TYPE_AUDIO:    bsf_str = ctx->audio_bsf;    break;
+    case AVMEDIA_TYPE_SUBTITLE: bsf_str = ctx->subtitle_bsf; break;
+    default:                                                 break;
+    }
+
+    if (bsf_str) {
+        err = av_bsf_list_parse_str(bsf_str, &bsf);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to parse bitstream filters \"%s\": %s!\n",
+                   bsf_str, av_err2str(err));
+            goto end;
+        }
+
+        err = avcodec_parameters_copy(bsf->par_in, par);
+        if (err < 0)
+            goto end;
+
+        bsf->time_base_in = in_st->time_base;
+
+        err = av_bsf_init(bsf);
+        if (err < 0) {
+            sp_log(ctx, SP_LOG_ERROR, "Unable to init bitstream filters \"%s\": %s!\n",
+                   bsf_str, av_err2str(err));
+            goto end;
+        }
+
+        par = bsf->par_out;
+        tb = bsf->time_base_out;
+    }
+
+    MuxEncoderMap *enc_map = av_realloc(ctx->enc_map, sizeof(*enc_map) * (ctx->enc_map_size + 1));
+    if (!enc_map) {
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+    ctx->enc_map = enc_map;
+
+    ctx->stream_has_link = av_realloc(ctx->stream_has_link, sizeof(*ctx->stream_has_link) * (ctx->avf->nb_streams + 1));
+    ctx->stream_codec_id = av_realloc(ctx->stream_codec_id, sizeof(*ctx->stream_codec_id) * (ctx->avf->nb_streams + 1));
+
+    AVStream *st = avformat_new_stream(ctx->avf, NULL);
+    if (!st) {
+        sp_log(ctx, SP_LOG_ERROR, "Unable to allocate stream!\n");
+        err = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    err = avcodec_parameters_copy(st->codecpar, par);
+    if (err < 0) {
+        sp_log(ctx, SP_LOG_ERROR, "Could not copy codec params: %s!\n", av_err2str(err));
+        goto end;
+    }
+
+    /* Let the muxer pick a tag, unless it knows the one we have */
+    if (ctx->avf->oformat->codec_tag &&
+        av_codec_get_id(ctx->avf->oformat->codec_tag, par->codec_tag) != par->codec_id)
+        st->codecpar->codec_tag = 0;
+
+    st->time_base           = tb;
+    st->avg_frame_rate      = in_st->avg_frame_rate;
+    st->r_frame_rate        = in_st->r_frame_rate;
+    st->sample_aspect_ratio = in_st->sample_aspect_ratio;
+    st->disposition         = in_st->disposition;
+    av_dict_copy(&st->metadata, in_st->metadata, 0);
+
+    MuxEncoderMap *enc_map_entry = &ctx->enc_map[ctx->enc_map_size++];
+    enc_map_entry->encoder_id = demux_id;
+    enc_map_entry->src_stream_index = stream_idx;
+    enc_map_entry->stream_index = st->index;
+    enc_map_entry->name = av_asprintf("%s:%i", sp_class_get_name(demux), stream_idx);
+    enc_map_entry->bsf = bsf;
+    bsf = NULL;
+
+    ctx->stream_has_link[st->index] = 1;
+    ctx->stream_codec_id[st->index] = par->codec_id;
+
+    sp_log(ctx, SP_LOG_VERBOSE, "Stream copy from \"%s\" registered%s%s, stream index %i!\n",
+           enc_map_entry->name, bsf_str ? ", bsf: " : "", bsf_str ? bsf_str : "",
+           st->index);
+
+end:
+    av_bsf_free(&bsf);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return err;
+}
+
 static int configure_muxer(MuxingContext *ctx)
 {
     int ret;
@@ -292,15 +1009,22 @@ static int configure_muxer(MuxingContext *ctx)
 
     ctx->avf->flags |= AVFMT_FLAG_AUTO_BSF;
 
-    if (ctx->low_latency) {
-        ctx->avf->flags |= AVFMT_FLAG_FLUSH_PACKETS | AVFMT_FLAG_NOBUFFER;
-        ctx->avf->pb->min_packet_size = 0;
+    /* Replay buffers only write through temporary muxers */
+    if (ctx->replay) {
+        sp_log(ctx, SP_LOG_VERBOSE, "Muxer configured as a replay buffer!\n");
+        return 0;
     }
 
-    ret = avformat_write_header(ctx->avf, NULL);
-    if (ret) {
-        sp_log(ctx, SP_LOG_ERROR, "Could not write header: %s!\n", av_err2str(ret));
+    ret = write_header(ctx, ctx->avf, &ctx->writer);
+    if (ret < 0)
         return ret;
+
+    /* Segments are separate files, each one opened once */
+    if (ctx->reconnect && !ctx->segment_finaliser) {
+        ctx->reconnect_queue = sp_replay_alloc(ctx, ctx->reconnect_queue_duration * AV_TIME_BASE,
+                                               ctx->reconnect_queue_size);
+        if (!ctx->reconnect_queue)
+            return AVERROR(ENOMEM);
     }
 
     sp_log(ctx, SP_LOG_VERBOSE, "Muxer configured!\n");
@@ -335,11 +1059,42 @@ static int muxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
         if ((tmp_val = dict_get(event->opts, "low_latency")))
             if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
                 ctx->low_latency = 1;
+        if ((tmp_val = dict_get(event->opts, "chunked")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                ctx->chunked = 1;
+        if ((tmp_val = dict_get(event->opts, "chunk_duration"))) {
+            double dur = strtod(tmp_val, NULL);
+            if (dur < 0)
+                sp_log(ctx, SP_LOG_ERROR, "Invalid chunk duration \"%s\"!\n", tmp_val);
+            else
+                ctx->chunk_duration = llrint(dur * 1000);
+        }
+        if ((tmp_val = dict_get(event->opts, "reconnect")))
+            if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
+                ctx->reconnect = 1;
+        if ((tmp_val = dict_get(event->opts, "reconnect_delay_max")))
+            ctx->reconnect_delay_max = strtod(tmp_val, NULL);
+        if ((tmp_val = dict_get(event->opts, "reconnect_queue_duration")))
+            ctx->reconnect_queue_duration = strtod(tmp_val, NULL);
+        if ((tmp_val = dict_get(event->opts, "reconnect_queue_size")))
+            ctx->reconnect_queue_size = strtoll(tmp_val, NULL, 10);
         if ((tmp_val = dict_get(event->opts, "dump_info")))
             if (!strcmp(tmp_val, "true") || strtol(tmp_val, NULL, 10) != 0)
                 ctx->dump_info = 1;
         if ((tmp_val = dict_get(event->opts, "sdp_file")))
             ctx->dump_sdp_file = av_strdup(tmp_val);
+        if ((tmp_val = dict_get(event->opts, "video_bsf"))) {
+            av_free(ctx->video_bsf);
+            ctx->video_bsf = av_strdup(tmp_val);
+        }
+        if ((tmp_val = dict_get(event->opts, "audio_bsf"))) {
+            av_free(ctx->audio_bsf);
+            ctx->audio_bsf = av_strdup(tmp_val);
+        }
+        if ((tmp_val = dict_get(event->opts, "subtitle_bsf"))) {
+            av_free(ctx->subtitle_bsf);
+            ctx->subtitle_bsf = av_strdup(tmp_val);
+        }
         if ((tmp_val = dict_get(event->opts, "fifo_size"))) {
             long int len = strtol(tmp_val, NULL, 10);
             if (len < 0)
@@ -358,11 +1113,45 @@ static int muxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
             }
         }
         pthread_mutex_unlock(&ctx->lock);
+    } else if (event->ctrl & SP_EVENT_CTRL_COMMAND) {
+        const char *command = dict_get(event->cmd, "command");
+
+        if (command && !strcmp(command, "save")) {
+            if (!ctx->replay) {
+                sp_log(ctx, SP_LOG_ERROR, "Muxer is not a replay buffer, cannot save!\n");
+                return AVERROR(EINVAL);
+            }
+
+            const char *url = dict_get(event->cmd, "out_url");
+            char url_buf[4096];
+            if (!url) {
+                /* Output URL may contain strftime sequences */
+                time_t now = time(NULL);
+                struct tm tm;
+                localtime_r(&now, &tm);
+                if (!strftime(url_buf, sizeof(url_buf), ctx->out_url, &tm)) {
+                    sp_log(ctx, SP_LOG_ERROR, "Invalid output URL template!\n");
+                    return AVERROR(EINVAL);
+                }
+                url = url_buf;
+            }
+
+            return sp_replay_save(ctx->replay, ctx->avf, url, ctx->out_format);
+        } else {
+            sp_log(ctx, SP_LOG_WARN, "Got unknown command %s\n",
+                   command ? command : "(none)");
+        }
     } else if (event->ctrl & SP_EVENT_CTRL_FLUSH) {
+        int err = 0;
         sp_log(ctx, SP_LOG_VERBOSE, "Flushing buffer\n");
         pthread_mutex_lock(&ctx->lock);
-        avio_flush(ctx->avf->pb);
+        if (ctx->writer)
+            err = sp_avio_writer_flush(ctx->writer);
+        else if (ctx->avf->pb)
+            avio_flush(ctx->avf->pb);
         pthread_mutex_unlock(&ctx->lock);
+        if (err < 0)
+            return err;
     } else {
         return AVERROR(ENOTSUP);
     }
@@ -373,7 +1162,8 @@ static int muxer_ioctx_ctrl_cb(AVBufferRef *event_ref, void *callback_ctx,
 int sp_muxer_ctrl(AVBufferRef *ctx_ref, SPEventType ctrl, void *arg)
 {
     MuxingContext *ctx = (MuxingContext *)ctx_ref->data;
-    return sp_ctrl_template(ctx, ctx->events, 0x0, muxer_ioctx_ctrl_cb, ctrl, arg);
+    return sp_ctrl_template(ctx, ctx->events, SP_EVENT_CTRL_COMMAND,
+                            muxer_ioctx_ctrl_cb, ctrl, arg);
 }
 
 int sp_muxer_init(AVBufferRef *ctx_ref)
@@ -418,13 +1208,56 @@ int sp_muxer_init(AVBufferRef *ctx_ref)
 
     ctx->avf->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 
+    if (ctx->replay_duration > 0 || ctx->replay_max_bytes > 0) {
+        ctx->replay = sp_replay_alloc(ctx, ctx->replay_duration * AV_TIME_BASE,
+                                      ctx->replay_max_bytes);
+        if (!ctx->replay) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ctx->replay_mode = 1;
+
+        /* out_url is the template for saved replays, not opened here */
+        ctx->out_format = ctx->avf->oformat->name;
+        ctx->out_url = ctx->avf->url;
+
+        return 0;
+    }
+
+    if (ctx->segment_duration > 0 || ctx->segment_size > 0) {
+        ctx->segment_template = av_strdup(ctx->out_url);
+        if (!ctx->segment_template) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+
+        err = segment_paths(ctx);
+        if (err < 0)
+            goto fail;
+
+        ctx->segment_finaliser = sp_segment_finaliser_alloc(ctx, ctx->segment_list);
+        if (!ctx->segment_finaliser) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+
+        segment_set_format_opts(ctx->avf);
+
+        /* Segment contexts come and go, the template stays */
+        err = open_output(ctx, ctx->avf, &ctx->writer, ctx->segment_part_path);
+        if (err < 0)
+            goto fail;
+
+        ctx->out_format = ctx->avf->oformat->name;
+        ctx->out_url = ctx->segment_template;
+
+        return 0;
+    }
+
     /* Open for writing */
-    err = avio_open(&ctx->avf->pb, ctx->out_url, AVIO_FLAG_WRITE);
-    if (err) {
-        sp_log(ctx, SP_LOG_ERROR, "Couldn't open %s: %s!\n", ctx->out_url,
-               av_err2str(err));
+    err = open_output(ctx, ctx->avf, &ctx->writer, ctx->out_url);
+    if (err < 0)
         goto fail;
-    }
 
     /* Both fields alive for the duration of the avf context */
     ctx->out_format = ctx->avf->oformat->name;
@@ -433,6 +1266,9 @@ int sp_muxer_init(AVBufferRef *ctx_ref)
     return 0;
 
 fail:
+    sp_segment_finaliser_free(&ctx->segment_finaliser);
+    sp_replay_free(&ctx->replay);
+    sp_avio_writer_close(&ctx->writer);
     avformat_free_context(ctx->avf);
     return err;
 }
@@ -448,16 +1284,27 @@ static void muxer_free(void *opaque, uint8_t *data)
         pthread_join(ctx->muxing_thread, NULL);
     }
 
-    for (int i = 0; i < ctx->enc_map_size; i++)
+    for (int i = 0; i < ctx->enc_map_size; i++) {
         av_free(ctx->enc_map[i].name);
+        av_bsf_free(&ctx->enc_map[i].bsf);
+    }
     av_free(ctx->enc_map);
 
     av_buffer_unref(&ctx->src_packets);
     av_free(ctx->stream_has_link);
     av_free(ctx->stream_codec_id);
     av_free(ctx->dump_sdp_file);
+    av_free(ctx->video_bsf);
+    av_free(ctx->audio_bsf);
+    av_free(ctx->subtitle_bsf);
+
+    sp_replay_free(&ctx->replay);
+    sp_replay_free(&ctx->reconnect_queue);
+
+    int wrote_header = !ctx->replay_mode && !ctx->reconnecting &&
+                       sp_eventlist_has_dispatched(ctx->events, SP_EVENT_ON_INIT);
 
-    if (sp_eventlist_has_dispatched(ctx->events, SP_EVENT_ON_INIT)) {
+    if (wrote_header) {
         int err = av_write_trailer(ctx->avf);
         if (err < 0)
             sp_log(ctx, SP_LOG_ERROR, "Error writing trailer: %s!\n",
@@ -470,11 +1317,34 @@ static void muxer_free(void *opaque, uint8_t *data)
         sp_log(ctx, SP_LOG_VERBOSE, "Wrote trailer!\n");
     }
 
+    if (ctx->segment_finaliser) {
+        if (wrote_header) {
+            double duration = (ctx->segment_last_ts - ctx->segment_start) / (double)AV_TIME_BASE;
+            int err = sp_segment_finaliser_add(ctx->segment_finaliser, ctx->avf, ctx->writer,
+                                               ctx->segment_part_path,
+                                               ctx->segment_final_path, duration);
+            if (err >= 0) {
+                ctx->avf = NULL;
+                ctx->writer = NULL;
+            }
+        }
+        sp_segment_finaliser_free(&ctx->segment_finaliser);
+    }
+    av_free(ctx->segment_template);
+    av_free(ctx->segment_part_path);
+    av_free(ctx->segment_final_path);
+
     sp_eventlist_dispatch(ctx, ctx->events, SP_EVENT_ON_DESTROY, NULL);
     sp_bufferlist_free(&ctx->events);
 
-    if (ctx->avf)
+    if (ctx->writer) {
+        int err = sp_avio_writer_close(&ctx->writer);
+        if (err < 0)
+            sp_log(ctx, SP_LOG_ERROR, "Error writing output: %s!\n", av_err2str(err));
+        ctx->avf->pb = NULL;
+    } else if (ctx->avf) {
         avio_closep(&ctx->avf->pb);
+    }
 
     avformat_free_context(ctx->avf);
 
@@ -503,6 +1373,10 @@ AVBufferRef *sp_muxer_alloc(void)
     pthread_mutex_init(&ctx->lock, NULL);
     ctx->events = sp_bufferlist_new();
     ctx->src_packets = sp_packet_fifo_create(ctx, 256, PACKET_FIFO_BLOCK_NO_INPUT);
+    ctx->segment_start = AV_NOPTS_VALUE;
+    ctx->chunk_start = AV_NOPTS_VALUE;
+    ctx->reconnect_delay_max = 30.0;
+    ctx->reconnect_queue_duration = 10.0;
 
     return ctx_ref;
 }
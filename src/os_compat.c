@@ -178,3 +178,36 @@ void* sp_dlsym(void* handle, const char *sym_name)
 }
 
 #endif
+
+/* ================================================ */
+/* SLEEP SECTION                                    */
+/* ================================================ */
+#include <libavutil/time.h>
+
+#ifdef HAVE_CLOCK_NANOSLEEP
+#include <time.h>
+#include <errno.h>
+
+void sp_sleep_until(int64_t deadline)
+{
+    /* av_gettime_relative() is CLOCK_MONOTONIC based, but may be offset */
+    struct timespec ts;
+    int64_t now = av_gettime_relative();
+    if (now >= deadline)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t wake = ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec + (deadline - now) * 1000;
+    ts.tv_sec = wake / 1000000000;
+    ts.tv_nsec = wake % 1000000000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+#else
+void sp_sleep_until(int64_t deadline)
+{
+    int64_t now;
+    while ((now = av_gettime_relative()) < deadline)
+        av_usleep(deadline - now);
+}
+#endif
@@ -35,6 +35,9 @@ void sp_set_thread_name_self(const char *name);
 #define noreturn
 #endif
 
+/* Sleeps until an absolute av_gettime_relative() time */
+void sp_sleep_until(int64_t deadline);
+
 /* Dynamic library API */
 void* sp_dlopen(const char *path);
 void sp_dlclose(void* handle);
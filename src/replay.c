@@ -0,0 +1,415 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <stdatomic.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
+
+#include <libtxproto/log.h>
+
+#include "replay.h"
+#include "os_compat.h"
+
+typedef struct ReplayEntry {
+    AVPacket *pkt;
+    int64_t ts; /* DTS in AV_TIME_BASE */
+    int key;
+} ReplayEntry;
+
+typedef struct ReplaySaveCtx {
+    SPReplayBuffer *rb;
+    char *url;
+    char *format;
+    int nb_streams;
+    AVCodecParameters **par;
+    AVRational *tb;
+    AVPacket **pkts;
+    int nb_pkts;
+} ReplaySaveCtx;
+
+struct SPReplayBuffer {
+    void *log_ctx;
+    pthread_mutex_t lock;
+
+    int64_t max_duration;
+    int64_t max_bytes;
+
+    /* Circular array of entries */
+    ReplayEntry *entries;
+    int cap;
+    int start;
+    int nb;
+    int nb_keys;
+    int64_t bytes;
+    int64_t last_ts;
+
+    pthread_t save_thread;
+    int save_started;
+    atomic_int saving;
+};
+
+#define ENTRY(rb, i) (&(rb)->entries[((rb)->start + (i)) % (rb)->cap])
+
+SPReplayBuffer *sp_replay_alloc(void *log_ctx, int64_t max_duration, int64_t max_bytes)
+{
+    SPReplayBuffer *rb = av_mallocz(sizeof(*rb));
+    if (!rb)
+        return NULL;
+
+    rb->log_ctx = log_ctx;
+    rb->max_duration = max_duration;
+    rb->max_bytes = max_bytes;
+    rb->last_ts = AV_NOPTS_VALUE;
+    pthread_mutex_init(&rb->lock, NULL);
+
+    return rb;
+}
+
+static int grow_entries(SPReplayBuffer *rb)
+{
+    int new_cap = FFMAX(2*rb->cap, 256);
+    ReplayEntry *new_entries = av_malloc_array(new_cap, sizeof(*new_entries));
+    if (!new_entries)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0; i < rb->nb; i++)
+        new_entries[i] = *ENTRY(rb, i);
+
+    av_free(rb->entries);
+    rb->entries = new_entries;
+    rb->cap = new_cap;
+    rb->start = 0;
+
+    return 0;
+}
+
+static void pop_front(SPReplayBuffer *rb)
+{
+    ReplayEntry *e = ENTRY(rb, 0);
+    rb->bytes -= e->pkt->size;
+    rb->nb_keys -= e->key;
+    av_packet_free(&e->pkt);
+    rb->start = (rb->start + 1) % rb->cap;
+    rb->nb--;
+}
+
+static int over_limits(SPReplayBuffer *rb)
+{
+    if (rb->max_bytes && rb->bytes > rb->max_bytes)
+        return 1;
+    if (rb->max_duration && rb->nb &&
+        (rb->last_ts - ENTRY(rb, 0)->ts) > rb->max_duration)
+        return 1;
+    return 0;
+}
+
+int sp_replay_add(SPReplayBuffer *rb, AVPacket *pkt, int is_key)
+{
+    int err = 0;
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    pthread_mutex_lock(&rb->lock);
+
+    if (rb->nb == rb->cap && (err = grow_entries(rb)) < 0) {
+        av_packet_free(&pkt);
+        goto end;
+    }
+
+    ts = ts == AV_NOPTS_VALUE ? rb->last_ts :
+         av_rescale_q(ts, pkt->time_base, AV_TIME_BASE_Q);
+
+    ReplayEntry *e = ENTRY(rb, rb->nb);
+    e->pkt = pkt;
+    e->ts = ts;
+    e->key = !!is_key;
+
+    rb->nb++;
+    rb->nb_keys += e->key;
+    rb->bytes += pkt->size;
+    if (ts != AV_NOPTS_VALUE)
+        rb->last_ts = rb->last_ts == AV_NOPTS_VALUE ? ts : FFMAX(rb->last_ts, ts);
+
+    /* Packets before the first keyframe can never be saved */
+    while (rb->nb && rb->nb_keys && !ENTRY(rb, 0)->key)
+        pop_front(rb);
+
+    /* Evict whole GOPs, always keeping the newest one */
+    while (over_limits(rb) && rb->nb_keys > 1) {
+        do {
+            pop_front(rb);
+        } while (!ENTRY(rb, 0)->key);
+    }
+
+end:
+    pthread_mutex_unlock(&rb->lock);
+
+    return err;
+}
+
+int sp_replay_seek_last_key(SPReplayBuffer *rb)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&rb->lock);
+
+    if (!rb->nb_keys) {
+        err = AVERROR(EAGAIN);
+        goto end;
+    }
+
+    while (rb->nb_keys > 1 || !ENTRY(rb, 0)->key)
+        pop_front(rb);
+
+end:
+    pthread_mutex_unlock(&rb->lock);
+
+    return err;
+}
+
+AVPacket *sp_replay_pop(SPReplayBuffer *rb)
+{
+    AVPacket *pkt = NULL;
+
+    pthread_mutex_lock(&rb->lock);
+
+    if (rb->nb) {
+        ReplayEntry *e = ENTRY(rb, 0);
+        FFSWAP(AVPacket *, pkt, e->pkt);
+        rb->bytes -= pkt->size;
+        rb->nb_keys -= e->key;
+        rb->start = (rb->start + 1) % rb->cap;
+        rb->nb--;
+    }
+
+    if (!rb->nb)
+        rb->last_ts = AV_NOPTS_VALUE;
+
+    pthread_mutex_unlock(&rb->lock);
+
+    return pkt;
+}
+
+void sp_replay_get_stats(SPReplayBuffer *rb, int64_t *duration, int64_t *bytes)
+{
+    pthread_mutex_lock(&rb->lock);
+    *duration = rb->nb ? rb->last_ts - ENTRY(rb, 0)->ts : 0;
+    *bytes = rb->bytes;
+    pthread_mutex_unlock(&rb->lock);
+}
+
+static void free_save_ctx(ReplaySaveCtx *s)
+{
+    for (int i = 0; i < s->nb_pkts; i++)
+        av_packet_free(&s->pkts[i]);
+    for (int i = 0; i < s->nb_streams; i++)
+        avcodec_parameters_free(&s->par[i]);
+    av_free(s->pkts);
+    av_free(s->par);
+    av_free(s->tb);
+    av_free(s->url);
+    av_free(s->format);
+    av_free(s);
+}
+
+static void *replay_save_thread(void *arg)
+{
+    int err;
+    ReplaySaveCtx *s = arg;
+    SPReplayBuffer *rb = s->rb;
+    AVFormatContext *avf = NULL;
+    int64_t t_start = av_gettime_relative();
+
+    sp_set_thread_name_self("replay_save");
+
+    err = avformat_alloc_output_context2(&avf, NULL, s->format, s->url);
+    if (err < 0)
+        goto end;
+
+    for (int i = 0; i < s->nb_streams; i++) {
+        AVStream *st = avformat_new_stream(avf, NULL);
+        if (!st) {
+            err = AVERROR(ENOMEM);
+            goto end;
+        }
+        err = avcodec_parameters_copy(st->codecpar, s->par[i]);
+        if (err < 0)
+            goto end;
+        st->time_base = s->tb[i];
+    }
+
+    if (!(avf->oformat->flags & AVFMT_NOFILE)) {
+        err = avio_open(&avf->pb, s->url, AVIO_FLAG_WRITE);
+        if (err < 0)
+            goto end;
+    }
+
+    err = avformat_write_header(avf, NULL);
+    if (err < 0)
+        goto end;
+
+    /* Start the clip at 0 */
+    AVPacket *first = s->pkts[0];
+    int64_t offset = av_rescale_q(first->dts != AV_NOPTS_VALUE ? first->dts : first->pts,
+                                  first->time_base, AV_TIME_BASE_Q);
+
+    for (int i = 0; i < s->nb_pkts; i++) {
+        AVPacket *pkt = s->pkts[i];
+        AVRational tb = avf->streams[pkt->stream_index]->time_base;
+        int64_t off = av_rescale_q(offset, AV_TIME_BASE_Q, pkt->time_base);
+
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts -= off;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts -= off;
+        av_packet_rescale_ts(pkt, pkt->time_base, tb);
+        pkt->time_base = tb;
+
+        err = av_interleaved_write_frame(avf, pkt);
+        if (err < 0)
+            goto end;
+    }
+
+    err = av_write_trailer(avf);
+
+end:
+    if (err < 0)
+        sp_log(rb->log_ctx, SP_LOG_ERROR, "Unable to save replay to \"%s\": %s!\n",
+               s->url, av_err2str(err));
+    else
+        sp_log(rb->log_ctx, SP_LOG_INFO, "Replay saved to \"%s\" (%i packets, took %.2f s)\n",
+               s->url, s->nb_pkts, (av_gettime_relative() - t_start) / 1000000.0f);
+
+    if (avf && !(avf->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&avf->pb);
+    avformat_free_context(avf);
+    free_save_ctx(s);
+
+    atomic_store(&rb->saving, 0);
+
+    return NULL;
+}
+
+int sp_replay_save(SPReplayBuffer *rb, AVFormatContext *ref_avf,
+                   const char *url, const char *format)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&rb->lock);
+    if (atomic_load(&rb->saving)) {
+        pthread_mutex_unlock(&rb->lock);
+        sp_log(rb->log_ctx, SP_LOG_ERROR, "Replay save already in progress!\n");
+        return AVERROR(EBUSY);
+    }
+
+    if (rb->save_started) {
+        pthread_join(rb->save_thread, NULL);
+        rb->save_started = 0;
+    }
+
+    /* Reserve, so concurrent saves get rejected */
+    atomic_store(&rb->saving, 1);
+    pthread_mutex_unlock(&rb->lock);
+
+    ReplaySaveCtx *s = av_mallocz(sizeof(*s));
+    if (!s) {
+        atomic_store(&rb->saving, 0);
+        return AVERROR(ENOMEM);
+    }
+
+    s->rb = rb;
+    s->url = av_strdup(url);
+    s->format = format ? av_strdup(format) : NULL;
+    s->nb_streams = ref_avf->nb_streams;
+    s->par = av_calloc(s->nb_streams, sizeof(*s->par));
+    s->tb = av_calloc(s->nb_streams, sizeof(*s->tb));
+    if (!s->url || (format && !s->format) || !s->par || !s->tb) {
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (int i = 0; i < s->nb_streams; i++) {
+        s->par[i] = avcodec_parameters_alloc();
+        if (!s->par[i]) {
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+        err = avcodec_parameters_copy(s->par[i], ref_avf->streams[i]->codecpar);
+        if (err < 0)
+            goto fail;
+        s->tb[i] = ref_avf->streams[i]->time_base;
+    }
+
+    /* Packets are refcounted, so the snapshot is cheap */
+    pthread_mutex_lock(&rb->lock);
+    int first = 0;
+    while (first < rb->nb && !ENTRY(rb, first)->key)
+        first++;
+
+    s->pkts = av_calloc(FFMAX(rb->nb - first, 1), sizeof(*s->pkts));
+    if (!s->pkts) {
+        pthread_mutex_unlock(&rb->lock);
+        err = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    for (int i = first; i < rb->nb; i++) {
+        s->pkts[s->nb_pkts] = av_packet_clone(ENTRY(rb, i)->pkt);
+        if (!s->pkts[s->nb_pkts]) {
+            pthread_mutex_unlock(&rb->lock);
+            err = AVERROR(ENOMEM);
+            goto fail;
+        }
+        s->nb_pkts++;
+    }
+    pthread_mutex_unlock(&rb->lock);
+
+    if (!s->nb_pkts) {
+        sp_log(rb->log_ctx, SP_LOG_WARN, "Nothing to save, replay buffer is empty!\n");
+        err = AVERROR(EAGAIN);
+        goto fail;
+    }
+
+    pthread_create(&rb->save_thread, NULL, replay_save_thread, s);
+    rb->save_started = 1;
+
+    return 0;
+
+fail:
+    free_save_ctx(s);
+    atomic_store(&rb->saving, 0);
+    return err;
+}
+
+void sp_replay_free(SPReplayBuffer **rb)
+{
+    SPReplayBuffer *ctx = *rb;
+    if (!ctx)
+        return;
+
+    if (ctx->save_started)
+        pthread_join(ctx->save_thread, NULL);
+
+    while (ctx->nb)
+        pop_front(ctx);
+
+    av_free(ctx->entries);
+    pthread_mutex_destroy(&ctx->lock);
+    av_freep(rb);
+}
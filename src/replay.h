@@ -0,0 +1,52 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+/* In-memory replay buffer, holds the most recent packets of a muxer,
+ * bounded by duration and size, and evicts whole GOPs at a time. */
+typedef struct SPReplayBuffer SPReplayBuffer;
+
+/* Either limit may be 0 for none */
+SPReplayBuffer *sp_replay_alloc(void *log_ctx, int64_t max_duration, int64_t max_bytes);
+
+/* Takes ownership of the packet, whose time_base must be set. Keyframes
+ * of the key stream (the first video stream) delimit GOPs. */
+int  sp_replay_add(SPReplayBuffer *rb, AVPacket *pkt, int is_key);
+
+/* Writes everything buffered, starting at the oldest keyframe, to url on
+ * a separate thread. Stream parameters are taken from ref_avf. */
+int  sp_replay_save(SPReplayBuffer *rb, AVFormatContext *ref_avf,
+                    const char *url, const char *format);
+
+/* Drops everything before the newest keyframe, so draining starts at it.
+ * Returns AVERROR(EAGAIN) if no keyframe is buffered. */
+int  sp_replay_seek_last_key(SPReplayBuffer *rb);
+
+/* Removes and returns the oldest packet, NULL if empty */
+AVPacket *sp_replay_pop(SPReplayBuffer *rb);
+
+void sp_replay_get_stats(SPReplayBuffer *rb, int64_t *duration, int64_t *bytes);
+
+/* Waits for any save in progress */
+void sp_replay_free(SPReplayBuffer **rb);
@@ -0,0 +1,228 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <libavutil/attributes.h>
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+
+#include "sampleconv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+#define S16_SCALE (1.0f / (1 << 15))
+#define S32_SCALE (1.0f / (1U << 31))
+
+static av_always_inline float load1(const uint8_t *src, int i, enum SPSampleSrc fmt)
+{
+    switch (fmt) {
+    case SP_SAMPLE_SRC_S16:
+        return ((const int16_t *)src)[i] * S16_SCALE;
+    case SP_SAMPLE_SRC_S24_32:
+        return (int32_t)(((const uint32_t *)src)[i] << 8) * S32_SCALE;
+    case SP_SAMPLE_SRC_S32:
+        return ((const int32_t *)src)[i] * S32_SCALE;
+    default:
+        return ((const float *)src)[i];
+    }
+}
+
+/* Converts from interleaved sample start onwards */
+static av_always_inline void conv_c(uint8_t **dst, const uint8_t *src, int start,
+                                    int nb_samples, int channels, int planar,
+                                    enum SPSampleSrc fmt)
+{
+    for (int i = start; i < nb_samples; i++) {
+        for (int c = 0; c < channels; c++) {
+            float v = load1(src, i*channels + c, fmt);
+            if (planar)
+                ((float *)dst[c])[i] = v;
+            else
+                ((float *)dst[0])[i*channels + c] = v;
+        }
+    }
+}
+
+static void s24_to_s32_c(uint8_t **dst, const uint8_t *src, int nb_samples,
+                         int channels)
+{
+    const uint32_t *s = (const uint32_t *)src;
+    int32_t *d = (int32_t *)dst[0];
+    for (int i = 0; i < nb_samples*channels; i++)
+        d[i] = s[i] << 8;
+}
+
+#define CONV_C(name, fmt, planar)                                               \
+static void name##_c(uint8_t **dst, const uint8_t *src, int nb_samples,        \
+                     int channels)                                              \
+{                                                                               \
+    conv_c(dst, src, 0, nb_samples, channels, planar, fmt);                     \
+}
+
+CONV_C(s16_flt,    SP_SAMPLE_SRC_S16,    0)
+CONV_C(s16_fltp,   SP_SAMPLE_SRC_S16,    1)
+CONV_C(s24_flt,    SP_SAMPLE_SRC_S24_32, 0)
+CONV_C(s24_fltp,   SP_SAMPLE_SRC_S24_32, 1)
+CONV_C(s32_flt,    SP_SAMPLE_SRC_S32,    0)
+CONV_C(s32_fltp,   SP_SAMPLE_SRC_S32,    1)
+CONV_C(flt_fltp,   SP_SAMPLE_SRC_FLT,    1)
+
+#if HAVE_X86_KERNELS
+/* Loads and converts 4 interleaved values */
+__attribute__((target("sse2")))
+static av_always_inline __m128 load4_sse2(const uint8_t *src, int i,
+                                          enum SPSampleSrc fmt)
+{
+    switch (fmt) {
+    case SP_SAMPLE_SRC_S16: {
+        __m128i v = _mm_loadl_epi64((const __m128i *)(src + 2*i));
+        v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(S16_SCALE));
+    }
+    case SP_SAMPLE_SRC_S24_32: {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 4*i));
+        v = _mm_slli_epi32(v, 8);
+        return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(S32_SCALE));
+    }
+    case SP_SAMPLE_SRC_S32: {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 4*i));
+        return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(S32_SCALE));
+    }
+    default:
+        return _mm_loadu_ps((const float *)(src + 4*i));
+    }
+}
+
+/* 8 interleaved values per iteration. Planar output is only vectorised
+ * for mono and stereo, everything else goes to the scalar code. */
+__attribute__((target("sse2")))
+static av_always_inline void conv_sse2(uint8_t **dst, const uint8_t *src,
+                                       int nb_samples, int channels, int planar,
+                                       enum SPSampleSrc fmt)
+{
+    int done = 0;
+
+    if (!planar || channels == 1) {
+        float *d = (float *)dst[0];
+        int n = (nb_samples*channels) & ~7;
+        for (int i = 0; i < n; i += 8) {
+            _mm_storeu_ps(d + i,     load4_sse2(src, i,     fmt));
+            _mm_storeu_ps(d + i + 4, load4_sse2(src, i + 4, fmt));
+        }
+        done = n / channels;
+    } else if (channels == 2) {
+        float *l = (float *)dst[0];
+        float *r = (float *)dst[1];
+        int n = (nb_samples*2) & ~7;
+        for (int i = 0; i < n; i += 8) {
+            __m128 a = load4_sse2(src, i,     fmt);
+            __m128 b = load4_sse2(src, i + 4, fmt);
+            _mm_storeu_ps(l + (i >> 1), _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(r + (i >> 1), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+        done = n >> 1;
+    }
+
+    conv_c(dst, src, done, nb_samples, channels, planar, fmt);
+}
+
+__attribute__((target("sse2")))
+static void s24_to_s32_sse2(uint8_t **dst, const uint8_t *src, int nb_samples,
+                            int channels)
+{
+    const uint32_t *s = (const uint32_t *)src;
+    int32_t *d = (int32_t *)dst[0];
+    int n = nb_samples*channels;
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        _mm_storeu_si128((__m128i *)(d + i), _mm_slli_epi32(v, 8));
+    }
+    for (; i < n; i++)
+        d[i] = s[i] << 8;
+}
+
+#define CONV_SSE2(name, fmt, planar)                                            \
+__attribute__((target("sse2")))                                                 \
+static void name##_sse2(uint8_t **dst, const uint8_t *src, int nb_samples,     \
+                        int channels)                                           \
+{                                                                               \
+    conv_sse2(dst, src, nb_samples, channels, planar, fmt);                     \
+}
+
+CONV_SSE2(s16_flt,    SP_SAMPLE_SRC_S16,    0)
+CONV_SSE2(s16_fltp,   SP_SAMPLE_SRC_S16,    1)
+CONV_SSE2(s24_flt,    SP_SAMPLE_SRC_S24_32, 0)
+CONV_SSE2(s24_fltp,   SP_SAMPLE_SRC_S24_32, 1)
+CONV_SSE2(s32_flt,    SP_SAMPLE_SRC_S32,    0)
+CONV_SSE2(s32_fltp,   SP_SAMPLE_SRC_S32,    1)
+CONV_SSE2(flt_fltp,   SP_SAMPLE_SRC_FLT,    1)
+#endif
+
+static const struct {
+    enum SPSampleSrc src;
+    enum AVSampleFormat dst;
+    SPSampleConvFn c;
+#if HAVE_X86_KERNELS
+    SPSampleConvFn sse2;
+#endif
+} conv_list[] = {
+#if HAVE_X86_KERNELS
+#define ENTRY(src, dst, name) { src, dst, name##_c, name##_sse2 }
+#else
+#define ENTRY(src, dst, name) { src, dst, name##_c }
+#endif
+    ENTRY(SP_SAMPLE_SRC_S16,    AV_SAMPLE_FMT_FLT,  s16_flt),
+    ENTRY(SP_SAMPLE_SRC_S16,    AV_SAMPLE_FMT_FLTP, s16_fltp),
+    ENTRY(SP_SAMPLE_SRC_S24_32, AV_SAMPLE_FMT_FLT,  s24_flt),
+    ENTRY(SP_SAMPLE_SRC_S24_32, AV_SAMPLE_FMT_FLTP, s24_fltp),
+    ENTRY(SP_SAMPLE_SRC_S24_32, AV_SAMPLE_FMT_S32,  s24_to_s32),
+    ENTRY(SP_SAMPLE_SRC_S32,    AV_SAMPLE_FMT_FLT,  s32_flt),
+    ENTRY(SP_SAMPLE_SRC_S32,    AV_SAMPLE_FMT_FLTP, s32_fltp),
+    ENTRY(SP_SAMPLE_SRC_FLT,    AV_SAMPLE_FMT_FLTP, flt_fltp),
+#undef ENTRY
+};
+
+SPSampleConvFn sp_sampleconv_get(enum SPSampleSrc src, enum AVSampleFormat dst,
+                                 const char **impl)
+{
+    for (int i = 0; i < FF_ARRAY_ELEMS(conv_list); i++) {
+        if (conv_list[i].src != src || conv_list[i].dst != dst)
+            continue;
+
+#if HAVE_X86_KERNELS
+        if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2) {
+            if (impl)
+                *impl = "sse2";
+            return conv_list[i].sse2;
+        }
+#endif
+        if (impl)
+            *impl = "c";
+        return conv_list[i].c;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <libavutil/samplefmt.h>
+
+/* Interleaved capture formats, as delivered by sound servers */
+enum SPSampleSrc {
+    SP_SAMPLE_SRC_S16,
+    SP_SAMPLE_SRC_S24_32, /* 24 bits, in the low bits of 32 */
+    SP_SAMPLE_SRC_S32,
+    SP_SAMPLE_SRC_FLT,
+};
+
+/* Converts nb_samples interleaved samples, dst has one pointer per plane */
+typedef void (*SPSampleConvFn)(uint8_t **dst, const uint8_t *src,
+                               int nb_samples, int channels);
+
+/* Returns a converter from src to dst, one of flt, fltp or (from 24 bit
+ * samples only) s32, or NULL if unsupported. Kernels are vectorised for
+ * packed output and for planar mono or stereo, and are bit-exact with the
+ * scalar code. impl is set to the name of the kernel if not NULL. */
+SPSampleConvFn sp_sampleconv_get(enum SPSampleSrc src, enum AVSampleFormat dst,
+                                 const char **impl);
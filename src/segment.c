@@ -0,0 +1,258 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/bprint.h>
+
+#include <libtxproto/log.h>
+
+#include "segment.h"
+#include "os_compat.h"
+
+typedef struct SegmentJob {
+    AVFormatContext *avf;
+    SPAVIOWriter *writer;
+    char *part_path;
+    char *final_path;
+    double duration;
+    struct SegmentJob *next;
+} SegmentJob;
+
+typedef struct SegmentEntry {
+    char *path;
+    double duration;
+} SegmentEntry;
+
+struct SPSegmentFinaliser {
+    void *log_ctx;
+    char *list_path;
+    int is_m3u8;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SegmentJob *first;
+    SegmentJob *last;
+    int quit;
+
+    /* Only touched by the thread */
+    SegmentEntry *entries;
+    int nb_entries;
+};
+
+static void write_list(SPSegmentFinaliser *f, int final)
+{
+    AVBPrint bp;
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+
+    if (f->is_m3u8) {
+        double max_duration = 0.0;
+        for (int i = 0; i < f->nb_entries; i++)
+            max_duration = FFMAX(max_duration, f->entries[i].duration);
+
+        av_bprintf(&bp, "#EXTM3U\n#EXT-X-VERSION:3\n");
+        av_bprintf(&bp, "#EXT-X-TARGETDURATION:%i\n", (int)ceil(max_duration));
+        av_bprintf(&bp, "#EXT-X-MEDIA-SEQUENCE:0\n");
+        for (int i = 0; i < f->nb_entries; i++)
+            av_bprintf(&bp, "#EXTINF:%.3f,\n%s\n", f->entries[i].duration,
+                       av_basename(f->entries[i].path));
+        if (final)
+            av_bprintf(&bp, "#EXT-X-ENDLIST\n");
+    } else {
+        for (int i = 0; i < f->nb_entries; i++)
+            av_bprintf(&bp, "%s\n", f->entries[i].path);
+    }
+
+    /* Replace atomically, so readers never see a partial list */
+    char *tmp_path = av_asprintf("%s.tmp", f->list_path);
+    FILE *file = tmp_path ? fopen(tmp_path, "w") : NULL;
+    if (!file) {
+        sp_log(f->log_ctx, SP_LOG_ERROR, "Unable to write segment list \"%s\"!\n",
+               f->list_path);
+    } else {
+        fwrite(bp.str, bp.len, 1, file);
+        if (fclose(file) || rename(tmp_path, f->list_path))
+            sp_log(f->log_ctx, SP_LOG_ERROR, "Unable to write segment list \"%s\": %s!\n",
+                   f->list_path, av_err2str(AVERROR(errno)));
+    }
+
+    av_free(tmp_path);
+    av_bprint_finalize(&bp, NULL);
+}
+
+static void finalise_segment(SPSegmentFinaliser *f, SegmentJob *job)
+{
+    int err = 0;
+
+    if (job->writer)
+        err = sp_avio_writer_close(&job->writer);
+    else if (job->avf && !(job->avf->oformat->flags & AVFMT_NOFILE))
+        err = avio_closep(&job->avf->pb);
+
+    if (job->avf)
+        job->avf->pb = NULL;
+    avformat_free_context(job->avf);
+
+    if (err < 0)
+        sp_log(f->log_ctx, SP_LOG_ERROR, "Error closing segment \"%s\": %s!\n",
+               job->part_path, av_err2str(err));
+
+    if (rename(job->part_path, job->final_path)) {
+        sp_log(f->log_ctx, SP_LOG_ERROR, "Unable to rename segment \"%s\": %s!\n",
+               job->part_path, av_err2str(AVERROR(errno)));
+        return;
+    }
+
+    sp_log(f->log_ctx, SP_LOG_VERBOSE, "Segment \"%s\" finalised (%.3f s)\n",
+           job->final_path, job->duration);
+
+    if (!f->list_path)
+        return;
+
+    SegmentEntry *entries = av_realloc_array(f->entries, f->nb_entries + 1,
+                                             sizeof(*entries));
+    if (!entries)
+        return;
+
+    f->entries = entries;
+    f->entries[f->nb_entries].path = job->final_path;
+    f->entries[f->nb_entries].duration = job->duration;
+    f->nb_entries++;
+    job->final_path = NULL;
+
+    write_list(f, 0);
+}
+
+static void *finaliser_thread(void *arg)
+{
+    SPSegmentFinaliser *f = arg;
+
+    sp_set_thread_name_self("segment_final");
+
+    pthread_mutex_lock(&f->lock);
+    while (1) {
+        while (!f->first && !f->quit)
+            pthread_cond_wait(&f->cond, &f->lock);
+        if (!f->first)
+            break;
+
+        SegmentJob *job = f->first;
+        f->first = job->next;
+        if (!f->first)
+            f->last = NULL;
+        pthread_mutex_unlock(&f->lock);
+
+        finalise_segment(f, job);
+
+        av_free(job->part_path);
+        av_free(job->final_path);
+        av_free(job);
+
+        pthread_mutex_lock(&f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    if (f->list_path)
+        write_list(f, 1);
+
+    return NULL;
+}
+
+SPSegmentFinaliser *sp_segment_finaliser_alloc(void *log_ctx, const char *list_path)
+{
+    SPSegmentFinaliser *f = av_mallocz(sizeof(*f));
+    if (!f)
+        return NULL;
+
+    f->log_ctx = log_ctx;
+    if (list_path) {
+        f->list_path = av_strdup(list_path);
+        if (!f->list_path) {
+            av_free(f);
+            return NULL;
+        }
+        f->is_m3u8 = av_match_ext(list_path, "m3u8");
+    }
+
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    pthread_create(&f->thread, NULL, finaliser_thread, f);
+
+    return f;
+}
+
+int sp_segment_finaliser_add(SPSegmentFinaliser *f, AVFormatContext *avf,
+                             SPAVIOWriter *writer, const char *part_path,
+                             const char *final_path, double duration)
+{
+    SegmentJob *job = av_mallocz(sizeof(*job));
+    if (!job)
+        return AVERROR(ENOMEM);
+
+    job->avf = avf;
+    job->writer = writer;
+    job->duration = duration;
+    job->part_path = av_strdup(part_path);
+    job->final_path = av_strdup(final_path);
+    if (!job->part_path || !job->final_path) {
+        av_free(job->part_path);
+        av_free(job->final_path);
+        av_free(job);
+        return AVERROR(ENOMEM);
+    }
+
+    pthread_mutex_lock(&f->lock);
+    if (f->last)
+        f->last->next = job;
+    else
+        f->first = job;
+    f->last = job;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+
+    return 0;
+}
+
+void sp_segment_finaliser_free(SPSegmentFinaliser **f)
+{
+    SPSegmentFinaliser *ctx = *f;
+    if (!ctx)
+        return;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->quit = 1;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_join(ctx->thread, NULL);
+
+    for (int i = 0; i < ctx->nb_entries; i++)
+        av_free(ctx->entries[i].path);
+    av_free(ctx->entries);
+    av_free(ctx->list_path);
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    av_freep(f);
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#pragma once
+
+#include <libavformat/avformat.h>
+
+#include "avio_async.h"
+
+/* Finalises closed output segments on a background thread: closes their
+ * output, renames them into place and updates the segment list. */
+typedef struct SPSegmentFinaliser SPSegmentFinaliser;
+
+/* list_path may be NULL, a list ending in .m3u8 is written as a playlist,
+ * anything else gets one segment path per line */
+SPSegmentFinaliser *sp_segment_finaliser_alloc(void *log_ctx, const char *list_path);
+
+/* Takes ownership of avf (trailer already written) and writer, if any.
+ * Segments are finalised in the order they were added. */
+int  sp_segment_finaliser_add(SPSegmentFinaliser *f, AVFormatContext *avf,
+                              SPAVIOWriter *writer, const char *part_path,
+                              const char *final_path, double duration);
+
+/* Finalises everything queued and closes the list */
+void sp_segment_finaliser_free(SPSegmentFinaliser **f);
@@ -41,6 +41,7 @@ int tx_init(TXMainContext *ctx)
     ctx->events = sp_bufferlist_new();
     ctx->ext_buf_refs = sp_bufferlist_new();
     ctx->epoch_value = ATOMIC_VAR_INIT(0);
+    sp_clock_slot_init(&ctx->epoch_clock);
     ctx->source_update_cb_ref = LUA_NOREF;
 
     return 0;
@@ -61,6 +62,7 @@ void tx_free(TXMainContext *ctx)
 
     /* Free all contexts */
     sp_bufferlist_free(&ctx->ext_buf_refs);
+    sp_clock_slot_uninit(&ctx->epoch_clock);
 
     /* Shut the I/O APIs off */
     if (ctx->io_api_ctx) {
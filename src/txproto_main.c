@@ -101,6 +101,7 @@ static void cleanup_fn(TXMainContext *ctx)
 
     /* Free all contexts */
     sp_bufferlist_free(&ctx->ext_buf_refs);
+    sp_clock_slot_uninit(&ctx->epoch_clock);
 
     /* Shut the I/O APIs off */
     if (ctx->io_api_ctx) {
@@ -143,6 +144,7 @@ int main(int argc, char *argv[])
     ctx->events = sp_bufferlist_new();
     ctx->ext_buf_refs = sp_bufferlist_new();
     ctx->epoch_value = ATOMIC_VAR_INIT(0);
+    sp_clock_slot_init(&ctx->epoch_clock);
     ctx->source_update_cb_ref = LUA_NOREF;
 
     /* Options */
@@ -18,8 +18,11 @@
 
 #include <pthread.h>
 #include <stdatomic.h>
+#include <math.h>
+#include <time.h>
 
 #include <libavutil/crc.h>
+#include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
 #include <libavutil/time.h>
 #include <libavutil/bprint.h>
@@ -69,6 +72,154 @@ calc:
     return sum;
 }
 
+void sp_fifo_notify_init(SPFIFONotify *n)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&n->lock, NULL);
+    pthread_cond_init(&n->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    n->seq = 0;
+}
+
+void sp_fifo_notify_uninit(SPFIFONotify *n)
+{
+    pthread_cond_destroy(&n->cond);
+    pthread_mutex_destroy(&n->lock);
+}
+
+void sp_fifo_notify_signal(SPFIFONotify *n)
+{
+    pthread_mutex_lock(&n->lock);
+    n->seq++;
+    pthread_cond_broadcast(&n->cond);
+    pthread_mutex_unlock(&n->lock);
+}
+
+unsigned int sp_fifo_notify_seq(SPFIFONotify *n)
+{
+    pthread_mutex_lock(&n->lock);
+    unsigned int seq = n->seq;
+    pthread_mutex_unlock(&n->lock);
+    return seq;
+}
+
+void sp_fifo_notify_wait(SPFIFONotify *n, unsigned int seq, int64_t deadline)
+{
+    pthread_mutex_lock(&n->lock);
+
+    while (n->seq == seq) {
+        if (deadline == INT64_MAX) {
+            pthread_cond_wait(&n->cond, &n->lock);
+            continue;
+        }
+
+        /* av_gettime_relative() is CLOCK_MONOTONIC based */
+        int64_t now = av_gettime_relative();
+        if (now >= deadline)
+            break;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        int64_t wake = ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000 + (deadline - now);
+        ts.tv_sec = wake / 1000000;
+        ts.tv_nsec = (wake % 1000000) * 1000;
+
+        if (pthread_cond_timedwait(&n->cond, &n->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+
+    pthread_mutex_unlock(&n->lock);
+}
+
+void sp_pacer_init(SPPacer *p, int64_t period)
+{
+    p->period = period;
+    p->phase = INT64_MIN;
+    p->tick = 0;
+    p->overruns = 0;
+}
+
+int64_t sp_pacer_wait(SPPacer *p)
+{
+    int64_t now = av_gettime_relative();
+
+    if (p->phase == INT64_MIN || !p->period) {
+        p->phase = now;
+        p->tick = 1;
+        return now;
+    }
+
+    int64_t target = p->phase + p->tick*p->period;
+    if (now >= target + p->period) {
+        int64_t missed = (now - target) / p->period;
+        p->overruns += missed;
+        p->tick += missed;
+    } else if (now < target) {
+        sp_sleep_until(target);
+        now = av_gettime_relative();
+    }
+
+    p->tick++;
+
+    return now;
+}
+
+#define TS_SMOOTHER_MAX_ERR 100000
+
+void sp_ts_smoother_init(SPTimestampSmoother *s, int sample_rate, double bandwidth)
+{
+    s->period = 1000000.0 / sample_rate;
+    s->bandwidth = bandwidth;
+    s->time = NAN;
+    s->scale = 1.0;
+    s->avg_scale = 1.0;
+    s->last_samples = 0;
+    s->last_pts = INT64_MIN;
+    s->resets = 0;
+}
+
+int64_t sp_ts_smoother_update(SPTimestampSmoother *s, int64_t raw, int nb_samples)
+{
+    if (isnan(s->time)) {
+        if (raw == AV_NOPTS_VALUE)
+            return AV_NOPTS_VALUE;
+        s->time = raw;
+    } else if (raw != AV_NOPTS_VALUE && s->last_samples) {
+        double err = raw - s->time;
+        if (fabs(err) > TS_SMOOTHER_MAX_ERR) {
+            s->time = raw;
+            s->resets++;
+        } else {
+            /* Coefficients for a critically damped loop, clipped to keep it
+             * stable with long blocks */
+            double dur = s->last_samples * s->period;
+            double omega = FFMIN(2.0 * M_PI * s->bandwidth * dur / 1000000.0, 0.5);
+            s->time += M_SQRT2 * omega * err;
+            s->scale += omega * omega * err / dur;
+            s->scale = av_clipd(s->scale, 0.99, 1.01);
+            s->avg_scale += FFMIN(dur / 10000000.0, 1.0) * (s->scale - s->avg_scale);
+        }
+    }
+
+    int64_t pts = llrint(s->time);
+    if (s->last_pts != INT64_MIN && pts <= s->last_pts)
+        pts = s->last_pts + 1;
+    s->last_pts = pts;
+
+    s->time += nb_samples * s->period * s->scale;
+    s->last_samples = nb_samples;
+
+    return pts;
+}
+
+double sp_ts_smoother_drift_ppm(const SPTimestampSmoother *s)
+{
+    return (s->avg_scale - 1.0) * 1000000.0;
+}
+
 // If the name starts with "@", try to interpret it as a number, and set *name
 // to the name of the n-th parameter.
 static void resolve_positional_arg(void *avobj, char **name)
@@ -0,0 +1,37 @@
+common = require "common"
+
+function muxer_eos(event)
+    print("EOS on muxer")
+    muxer_a.destroy()
+    src_frames = common.get_nb_of_frames(src)
+    dst_frames = common.get_nb_of_frames(dst)
+    print("Number of frames found in the src: "..src_frames)
+    print("Number of frames found in the dst: "..dst_frames)
+    assert(src_frames == dst_frames, "source and destination tests do not have the same number of frames")
+    tx.quit()
+end
+
+function main(...)
+    local arg = {...}
+    src, dst = arg[1], arg[2]
+
+    common.create_audio_sample(src)
+
+    tx.set_epoch(0)
+
+    source_f = tx.create_demuxer({
+            in_url = src,
+        })
+
+    muxer_a = tx.create_muxer({
+            out_url = dst,
+            priv_options = {
+                dump_info = true,
+                fifo_flags = "block_no_input,block_max_output"
+            },
+        })
+    muxer_a.link(source_f, 0)
+    muxer_a.schedule("eos", muxer_eos)
+
+    tx.commit()
+end
@@ -0,0 +1,202 @@
+/*
+ * This file is part of txproto.
+ *
+ * txproto is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * txproto is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with txproto; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/* Compares the capture colorspace conversion against sws_scale.
+ * Usage: colorconv_bench [width] [height] [iterations] */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+
+#include "../src/colorspace.h"
+
+static void fill_frame(AVFrame *f)
+{
+    uint32_t state = 0x12345678;
+    for (int y = 0; y < f->height; y++) {
+        uint8_t *row = f->data[0] + y*f->linesize[0];
+        for (int x = 0; x < f->width*4; x++) {
+            /* Smooth gradients with some noise, like desktop content */
+            state = state*1664525 + 1013904223;
+            row[x] = ((x >> 2) + y + ((state >> 24) & 7)) & 0xff;
+        }
+    }
+}
+
+static int bench_sws(AVFrame *src, AVFrame *dst, enum AVColorSpace cs,
+                     enum AVColorRange range, int iters, int flags,
+                     double *time)
+{
+    struct SwsContext *sws;
+    sws = sws_getContext(src->width, src->height, src->format,
+                         dst->width, dst->height, dst->format,
+                         flags, NULL, NULL, NULL);
+    if (!sws)
+        return AVERROR(EINVAL);
+
+    sws_setColorspaceDetails(sws, sws_getCoefficients(SWS_CS_DEFAULT), 1,
+                             sws_getCoefficients(cs == AVCOL_SPC_BT709 ?
+                                                 SWS_CS_ITU709 : SWS_CS_ITU601),
+                             range == AVCOL_RANGE_JPEG, 0, 1 << 16, 1 << 16);
+
+    int64_t start = av_gettime_relative();
+    for (int i = 0; i < iters; i++)
+        sws_scale(sws, (const uint8_t * const *)src->data, src->linesize,
+                  0, src->height, dst->data, dst->linesize);
+    *time = (av_gettime_relative() - start) / (1000.0 * iters);
+
+    sws_freeContext(sws);
+
+    return 0;
+}
+
+static int bench_conv(AVFrame *src, AVFrame *dst, enum AVColorSpace cs,
+                      enum AVColorRange range, int iters, double *time,
+                      const char **impl)
+{
+    SPColorConv *conv;
+    int err = sp_colorconv_alloc(&conv, src->format, dst->format, cs, range);
+    if (err < 0)
+        return err;
+
+    *impl = sp_colorconv_impl(conv);
+
+    int64_t start = av_gettime_relative();
+    for (int i = 0; i < iters; i++)
+        sp_colorconv_planes(conv, dst->data, dst->linesize, src->data[0],
+                            src->linesize[0], src->width, src->height);
+    *time = (av_gettime_relative() - start) / (1000.0 * iters);
+
+    sp_colorconv_free(&conv);
+
+    return 0;
+}
+
+static int max_diff(AVFrame *a, AVFrame *b)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(a->format);
+    int diff = 0;
+
+    for (int p = 0; p < av_pix_fmt_count_planes(a->format); p++) {
+        int w = p ? AV_CEIL_RSHIFT(a->width, desc->log2_chroma_w) : a->width;
+        int h = p ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+        if (a->format == AV_PIX_FMT_NV12 && p)
+            w *= 2;
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+                diff = FFMAX(diff, abs(a->data[p][y*a->linesize[p] + x] -
+                                       b->data[p][y*b->linesize[p] + x]));
+    }
+
+    return diff;
+}
+
+static AVFrame *alloc_frame(enum AVPixelFormat fmt, int width, int height)
+{
+    AVFrame *f = av_frame_alloc();
+    if (!f)
+        return NULL;
+
+    f->format = fmt;
+    f->width = width;
+    f->height = height;
+    if (av_frame_get_buffer(f, 0) < 0)
+        av_frame_free(&f);
+
+    return f;
+}
+
+int main(int argc, char *argv[])
+{
+    int width  = argc > 1 ? strtol(argv[1], NULL, 10) : 1920;
+    int height = argc > 2 ? strtol(argv[2], NULL, 10) : 1080;
+    int iters  = argc > 3 ? strtol(argv[3], NULL, 10) : 200;
+    int ret = 0;
+
+    const enum AVPixelFormat dst_fmts[] = { AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P };
+    const enum AVColorSpace spaces[] = { AVCOL_SPC_BT709, AVCOL_SPC_SMPTE170M };
+    const enum AVColorRange ranges[] = { AVCOL_RANGE_MPEG, AVCOL_RANGE_JPEG };
+
+    AVFrame *src = alloc_frame(AV_PIX_FMT_BGR0, width, height);
+    if (!src)
+        return 1;
+    fill_frame(src);
+
+    printf("%ix%i bgr0, %i iterations, times in ms per frame\n", width, height, iters);
+
+    for (int d = 0; d < FF_ARRAY_ELEMS(dst_fmts); d++) {
+        for (int s = 0; s < FF_ARRAY_ELEMS(spaces); s++) {
+            for (int r = 0; r < FF_ARRAY_ELEMS(ranges); r++) {
+                AVFrame *ref = alloc_frame(dst_fmts[d], width, height);
+                AVFrame *out = alloc_frame(dst_fmts[d], width, height);
+                AVFrame *c_out = alloc_frame(dst_fmts[d], width, height);
+                double t_sws, t_sws_exact, t_conv, t_c;
+                const char *impl, *c_impl;
+
+                if (!ref || !out || !c_out) {
+                    ret = 1;
+                    goto next;
+                }
+
+                if (bench_sws(src, ref, spaces[s], ranges[r], iters,
+                              SWS_FAST_BILINEAR, &t_sws) < 0 ||
+                    bench_sws(src, ref, spaces[s], ranges[r], iters,
+                              SWS_POINT | SWS_ACCURATE_RND | SWS_BITEXACT,
+                              &t_sws_exact) < 0 ||
+                    bench_conv(src, out, spaces[s], ranges[r], iters,
+                               &t_conv, &impl) < 0) {
+                    ret = 1;
+                    goto next;
+                }
+
+                /* Scalar reference, the kernels must match it exactly */
+                av_force_cpu_flags(0);
+                bench_conv(src, c_out, spaces[s], ranges[r], FFMAX(iters / 10, 1),
+                           &t_c, &c_impl);
+                av_force_cpu_flags(-1);
+
+                printf("%-8s %-10s %-6s sws %7.3f (accurate %7.3f), c %7.3f, "
+                       "%s %7.3f, %.2fx, max diff vs sws %i%s\n",
+                       av_get_pix_fmt_name(dst_fmts[d]),
+                       av_color_space_name(spaces[s]),
+                       av_color_range_name(ranges[r]),
+                       t_sws, t_sws_exact, t_c, impl, t_conv, t_sws / t_conv,
+                       max_diff(ref, out),
+                       max_diff(c_out, out) ? ", MISMATCH vs c" : "");
+
+                if (max_diff(c_out, out))
+                    ret = 1;
+
+next:
+                av_frame_free(&ref);
+                av_frame_free(&out);
+                av_frame_free(&c_out);
+            }
+        }
+    }
+
+    av_frame_free(&src);
+
+    return ret;
+}
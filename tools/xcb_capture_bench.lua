@@ -0,0 +1,60 @@
+--[[ Measures XCB capture throughput and pacing.
+     Usage: txproto -s tools/xcb_capture_bench.lua [pipeline_depth] [seconds] ]]--
+
+display_id = nil
+samples = 0
+totals = { capture_rate = 0, grab_wait = 0, jitter = 0 }
+
+function io_update_cb(identifier, entry)
+    if display_id == nil and entry.type == "display" and entry.default then
+        display_id = identifier
+    end
+end
+
+function source_stats(stats)
+    if stats.capture_rate == nil then
+        return
+    end
+
+    samples = samples + 1
+    -- The first interval includes startup
+    if samples > 1 then
+        for k, v in pairs(totals) do
+            totals[k] = v + stats[k]
+        end
+    end
+
+    if samples > duration then
+        local n = samples - 1
+        print(string.format("depth %i: %.2f fps, grab wait %i us, jitter %i us",
+                            depth, totals.capture_rate / n,
+                            math.floor(totals.grab_wait / n),
+                            math.floor(totals.jitter / n)))
+        tx.quit()
+    end
+end
+
+function main(...)
+    local arg = {...}
+    depth = tonumber(arg[1] or 2)
+    duration = tonumber(arg[2] or 10)
+
+    event = tx.register_io_cb(io_update_cb)
+    event.destroy()
+
+    tx.set_epoch(0)
+
+    source = tx.create_io(display_id, {
+            pipeline_depth = tostring(depth),
+        })
+    source.schedule("stats", source_stats)
+
+    -- Keeps consuming frames, without holding on to them
+    sink = tx.create_filtergraph({
+            graph = "select='eq(n,0)'",
+            priv_options = { dump_graph = false },
+        })
+    sink.link(source)
+
+    tx.commit()
+end
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Compares XCB capture pipeline depths on a headless Xvfb server.
+# Usage: tools/xcb_capture_bench.sh [txproto binary] [WxH] [seconds]
+
+TXPROTO=${1:-build/src/txproto}
+SIZE=${2:-3840x2160}
+SECONDS_RUN=${3:-10}
+DISPLAY_NUM=:97
+
+Xvfb $DISPLAY_NUM -screen 0 ${SIZE}x24 -nolisten tcp &
+XVFB_PID=$!
+trap 'kill $XVFB_PID' EXIT
+sleep 1
+
+for depth in 1 2 3; do
+    DISPLAY=$DISPLAY_NUM "$TXPROTO" -s "$(dirname "$0")/xcb_capture_bench.lua" \
+        "$depth" "$SECONDS_RUN" | grep '^depth'
+done